@@ -1,6 +1,11 @@
 #include "matrix4x4.h"
+#include "transform.h"
 #include "math_macros.h"
+#include "image.h"
+#include "rasterizer.h"
+#include "vertex_pipeline.h"
 #include <fstream>
+#include <string>
 
 const vec3d verts[146] = {
 	{ 0,    39.034,         0 },{ 0.76212,    36.843,         0 },
@@ -109,99 +114,110 @@ const uint32_t tris[numTris * 3] = {
 	112, 143, 116, 116, 143, 144, 116, 145, 119
 };
 
-bool computePixelCoordinates(const vec3f pWorld, vec3f& raster, const mat44f& worldToCamera,
-	const mat44f& canvasImgStuff)
-{
-	vec3f cam;
-	worldToCamera.multVec(pWorld, cam);
-	vec3f screen;
-	screen.x = cam.x / -cam.z * canvasImgStuff[3][0];
-	screen.y = cam.y / -cam.z * canvasImgStuff[3][0];
-	vec3f ndc;
-
-	float canvasWidth = canvasImgStuff[2][0];
-	float canvasHeight = canvasImgStuff[2][1];
-
-	float imgWidth = canvasImgStuff[1][0];
-	float imgHeight = canvasImgStuff[1][1];
-
-	float left = canvasImgStuff[0][0];
-	float right = canvasImgStuff[0][1];
-	float bottom = canvasImgStuff[0][2];
-	float top = canvasImgStuff[0][3];
-
-	Vec3Util::debug_print(screen);
-	
-	ndc.x = (screen.x + right) / canvasWidth;
-	ndc.y = (screen.y + top) / canvasHeight;
-	raster.x = (int)(ndc.x * imgWidth);
-	raster.y = (int)((1 - ndc.y) * imgHeight);
-
-	if (screen.x < left || screen.x > right || screen.y < bottom || screen.y > top)
-		return false;
-
-	return true;
-}
-
 int main(int argc, const char** argv)
 {
+	CullMode cull = kCullBack;
+	unsigned numThreads = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		if (arg == "--cull" && i + 1 < argc)
+		{
+			std::string mode = argv[++i];
+			if (mode == "back")
+				cull = kCullBack;
+			else if (mode == "front")
+				cull = kCullFront;
+			else if (mode != "none")
+			{
+				std::cout << "unknown cull mode " << mode << ", expected none, back or front" << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--threads" && i + 1 < argc)
+			numThreads = (unsigned)atoi(argv[++i]);
+		else
+		{
+			std::cout << "usage: " << argv[0] << " [--cull none|back|front] [--threads n]" << std::endl;
+			return 1;
+		}
+	}
 
-	mat44f camToWorld(0.871214f, 0.0f, -0.490904f, 0.0f, -0.192902f, 0.919559f, -0.342346f, 0.0f, 0.451415f, 0.392953f, 0.801132f, 0.0f, 14.777467f, 29.361945f, 50, 1.0f);	
-	mat44f worldToCam = camToWorld.inverse();
+	Transform camToWorld(mat44f(0.871214f, 0.0f, -0.490904f, 0.0f, -0.192902f, 0.919559f, -0.342346f, 0.0f, 0.451415f, 0.392953f, 0.801132f, 0.0f, 14.777467f, 29.361945f, 50, 1.0f));
+	Transform worldToCam = camToWorld.inverse();
 
 	float zNear = 0.1f;
 	float zFar = 100.0f;
 	float fov = 90 * DEG_TO_RAD;
 
 	float canvasSize = 2 * tan(fov * 0.5) * zNear;
-	std::cout << canvasSize;
-	float canvasWidth = canvasSize;
-	float canvasHeight = canvasSize;
 	uint32_t imgWidth = 512;
 	uint32_t imgHeight = 512;
 
-	mat44f stuff;
-	stuff[0][0] = -canvasSize / 2; //canvas X min
-	stuff[0][1] = canvasSize / 2; //canvas X max
-	stuff[0][2] = -canvasSize / 2;//canvas Y min
-	stuff[0][3] = canvasSize / 2; //canvas Y max
-
-	stuff[1][0] = imgWidth;
-	stuff[1][1] = imgHeight;
-
-	stuff[2][0] = canvasWidth;
-	stuff[2][1] = canvasHeight;
-
-	stuff[3][0] = zNear;
-	stuff[3][1] = zFar;
+	Projection projection;
+	projection.zNear = zNear;
+	projection.zFar = zFar;
+	projection.left = -canvasSize / 2;
+	projection.right = canvasSize / 2;
+	projection.bottom = -canvasSize / 2;
+	projection.top = canvasSize / 2;
+	projection.imgWidth = imgWidth;
+	projection.imgHeight = imgHeight;
+
+	Mesh mesh;
+	for (int i = 0; i < 146; i++)
+		mesh.addVertex((float)verts[i].x, (float)verts[i].y, (float)verts[i].z);
+	mesh.indices.assign(tris, tris + numTris * 3);
+
+	VertexPipeline pipeline;
+	pipeline.transform(mesh, worldToCam, projection, numThreads);
+	std::vector<AssembledTriangle> assembled;
+	pipeline.assemble(mesh, cull, assembled);
 
 	std::ofstream ofs;
-
 	ofs.open("proj.svg");
 	ofs << "<svg version=\"1.1\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" xmlns=\"http://www.w3.org/2000/svg\" height=\"512\" width=\"512\">" << std::endl;
-	for (uint32_t i = 0; i < numTris; i++)
+	for (size_t i = 0; i < assembled.size(); i++)
 	{
-		const vec3d vert0 = verts[tris[i * 3]];
-		const vec3d vert1 = verts[tris[i * 3 + 1]];
-		const vec3d vert2 = verts[tris[i * 3 + 2]];
+		//triangles cut by the frustum are drawn red
+		const RasterVertex* v = assembled[i].v;
+		int val = assembled[i].clipped ? 255 : 0;
+		for (int k = 0; k < 3; k++)
+		{
+			const RasterVertex& a = v[k];
+			const RasterVertex& b = v[(k + 1) % 3];
+			ofs << "<line x1=\"" << a.x << "\" y1=\"" << a.y << "\" x2=\"" << b.x << "\" y2=\"" << b.y << "\" style=\"stroke:rgb(" << val << ",0,0);stroke-width:1\" />\n";
+		}
+	}
+	ofs << "</svg>\n";
+	ofs.close();
 
-		const vec3f v0World(vert0.x, vert0.y, vert0.z);
-		const vec3f v1World(vert1.x, vert1.y, vert1.z);
-		const vec3f v2World(vert2.x, vert2.y, vert2.z);
+	//flat shaded by the angle to the view direction, both sides lit
+	std::vector<float> shades(mesh.numTriangles());
+	for (int t = 0; t < mesh.numTriangles(); t++)
+	{
+		const vec3f& c0 = pipeline.getCamera(mesh.indices[t * 3]);
+		const vec3f& c1 = pipeline.getCamera(mesh.indices[t * 3 + 1]);
+		const vec3f& c2 = pipeline.getCamera(mesh.indices[t * 3 + 2]);
+		vec3f n = Vec3Util::cross(c1 - c0, c2 - c0);
+		float facing = n.lengthSquared() > 0 ? fabsf(Vec3Util::normalize(n).z) : 0;
+		shades[t] = 0.2f + 0.8f * facing;
+	}
 
-		vec3f v0raster, v1raster, v2raster;
-		bool v = true;
-		v &= computePixelCoordinates(v0World, v0raster, worldToCam, stuff);
-		v &= computePixelCoordinates(v1World, v1raster, worldToCam, stuff);
-		v &= computePixelCoordinates(v2World, v2raster, worldToCam, stuff);
+	std::vector<RasterTriangle> triangles(assembled.size());
+	for (size_t i = 0; i < assembled.size(); i++)
+	{
+		for (int k = 0; k < 3; k++)
+			triangles[i].v[k] = assembled[i].v[k];
+		float shade = shades[assembled[i].source];
+		triangles[i].color.r = triangles[i].color.g = triangles[i].color.b = shade;
+		triangles[i].id = assembled[i].source;
+	}
 
-		int val = v ? 0 : 255;
+	Rasterizer rasterizer(imgWidth, imgHeight);
+	rasterizer.draw(triangles, numThreads);
+	if (writePPM("proj.ppm", rasterizer.getImage()) != 0)
+		std::cout << "failed to write proj.ppm" << std::endl;
 
-		ofs << "<line x1=\"" << v0raster.x << "\" y1=\"" << v0raster.y << "\" x2=\"" << v1raster.x << "\" y2=\"" << v1raster.y << "\" style=\"stroke:rgb(" << val << ",0,0);stroke-width:1\" />\n";
-		ofs << "<line x1=\"" << v1raster.x << "\" y1=\"" << v1raster.y << "\" x2=\"" << v2raster.x << "\" y2=\"" << v2raster.y << "\" style=\"stroke:rgb(" << val << ",0,0);stroke-width:1\" />\n";
-		ofs << "<line x1=\"" << v2raster.x << "\" y1=\"" << v2raster.y << "\" x2=\"" << v0raster.x << "\" y2=\"" << v0raster.y << "\" style=\"stroke:rgb(" << val << ",0,0);stroke-width:1\" />\n";
-	}
-	ofs << "</svg>\n";
-	ofs.close();
 	return 0;
 }
@@ -0,0 +1,256 @@
+//
+//  rasterizer.h
+//  theraytracer
+//
+//  Tiled software rasterizer with a depth buffer. Triangles are binned
+//  into screen tiles, the tiles are filled in parallel, and inside a
+//  tile the edge functions and depth of 8 pixels are evaluated per step
+//  in SIMD lanes.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef rasterizer_h
+#define rasterizer_h
+
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "image.h"
+#include "parallel.h"
+#include "spectrum_simd.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//A projected vertex. x and y are raster coordinates with pixel centers at +0.5,
+//invZ is 1 / the camera space distance in front of the camera, which unlike the
+//distance itself is linear in raster space
+struct RasterVertex
+{
+    float x, y;
+    float invZ;
+};
+
+struct RasterTriangle
+{
+    RasterVertex v[3];
+    RGB color;
+    //written to the id buffer where the triangle is visible
+    uint32_t id;
+};
+
+//Draws flat colored triangles into an image and their ids into an id buffer. Triangles
+//are drawn in submission order within every tile, so the result does not depend on the
+//number of threads.
+//Edges are inclusive: a pixel center exactly on an edge shared by two triangles is
+//drawn by both and resolved by the depth test, which keeps the first.
+class Rasterizer
+{
+public:
+    static const int kTileSize = 64;
+    //pixels evaluated per step, a whole number of HeroFloat vectors
+    static const int kStep = 8;
+    //triangles binned per task
+    static const int kBinChunk = 4096;
+    //id of pixels no triangle covers
+    static const uint32_t kNoId = 0xffffffff;
+
+    Rasterizer(int width, int height) : image(width, height)
+    {
+        tilesX = (width + kTileSize - 1) / kTileSize;
+        tilesY = (height + kTileSize - 1) / kTileSize;
+        //steps never cross a tile, padding to whole tiles keeps the last step inside the buffer
+        depthStride = tilesX * kTileSize;
+        depth.resize((size_t)depthStride * height);
+        ids.resize((size_t)width * height);
+        clear(Image::kBlack);
+    }
+
+    int getWidth() const { return image.getWidth(); }
+    int getHeight() const { return image.getHeight(); }
+
+    //clears the image to [background], the depth buffer to infinitely far and the ids to kNoId
+    void clear(const RGB& background)
+    {
+        image.fill(background);
+        std::fill(depth.begin(), depth.end(), 0.0f);
+        std::fill(ids.begin(), ids.end(), (uint32_t)kNoId);
+    }
+
+    //Draws [triangles] on [numThreads] threads (0 = one per core). Triangles with a vertex
+    //on or behind the camera plane (invZ <= 0) are skipped, they must be clipped before.
+    void draw(const std::vector<RasterTriangle>& triangles, unsigned numThreads = 0)
+    {
+        const int numTiles = tilesX * tilesY;
+        const int numChunks = (int)((triangles.size() + kBinChunk - 1) / kBinChunk);
+
+        //set up and bin chunks of triangles in parallel, each chunk into its own bins so
+        //that walking the chunks in order keeps the submission order
+        std::vector<Setup> setups(triangles.size());
+        std::vector<std::vector<uint32_t> > bins((size_t)numChunks * numTiles);
+        parallelFor(0, numChunks, 1, [&](int chunk)
+        {
+            size_t end = std::min(triangles.size(), (size_t)(chunk + 1) * kBinChunk);
+            for (size_t i = (size_t)chunk * kBinChunk; i < end; i++)
+            {
+                Setup& s = setups[i];
+                if (!setup(triangles[i], s))
+                    continue;
+
+                for (int ty = s.minY / kTileSize; ty <= s.maxY / kTileSize; ty++)
+                    for (int tx = s.minX / kTileSize; tx <= s.maxX / kTileSize; tx++)
+                        bins[(size_t)chunk * numTiles + ty * tilesX + tx].push_back((uint32_t)i);
+            }
+        }, numThreads);
+
+        parallelFor(0, numTiles, 1, [&](int tile)
+        {
+            for (int chunk = 0; chunk < numChunks; chunk++)
+            {
+                const std::vector<uint32_t>& bin = bins[(size_t)chunk * numTiles + tile];
+                for (size_t i = 0; i < bin.size(); i++)
+                    drawInTile(setups[bin[i]], tile % tilesX, tile / tilesX);
+            }
+        }, numThreads);
+    }
+
+    const Image& getImage() const { return image; }
+    //id of the triangle visible at pixel (x, y)
+    uint32_t getId(int x, int y) const { return ids[(size_t)y * getWidth() + x]; }
+
+private:
+    static_assert(kStep % HeroFloat::kLanes == 0, "a step must be whole vectors");
+    static_assert(kTileSize % kStep == 0, "a tile row must be whole steps");
+
+    //Edge function e is a[e] * x + b[e] * y + c[e], positive inside and zero on the edge
+    //opposite vertex e. invZ is the plane zx * x + zy * y + z0.
+    struct Setup
+    {
+        float a[3], b[3], c[3];
+        float zx, zy, z0;
+        int minX, minY, maxX, maxY;
+        RGB color;
+        uint32_t id;
+    };
+
+    //returns false if [tri] covers no pixels or cannot be drawn
+    bool setup(const RasterTriangle& tri, Setup& s) const
+    {
+        RasterVertex v[3] = { tri.v[0], tri.v[1], tri.v[2] };
+        if (!(v[0].invZ > 0 && v[1].invZ > 0 && v[2].invZ > 0))
+            return false;
+
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[1].y - v[0].y) * (v[2].x - v[0].x);
+        if (!(area != 0))
+            return false;
+        //either winding is drawn, make the inside positive
+        if (area < 0)
+        {
+            std::swap(v[1], v[2]);
+            area = -area;
+        }
+
+        float minX = std::min(v[0].x, std::min(v[1].x, v[2].x));
+        float maxX = std::max(v[0].x, std::max(v[1].x, v[2].x));
+        float minY = std::min(v[0].y, std::min(v[1].y, v[2].y));
+        float maxY = std::max(v[0].y, std::max(v[1].y, v[2].y));
+        if (maxX < 0 || maxY < 0 || minX >= getWidth() || minY >= getHeight())
+            return false;
+
+        s.minX = std::max(0, (int)floorf(minX));
+        s.minY = std::max(0, (int)floorf(minY));
+        s.maxX = (int)std::min((float)getWidth() - 1, ceilf(maxX));
+        s.maxY = (int)std::min((float)getHeight() - 1, ceilf(maxY));
+
+        float invArea = 1 / area;
+        s.zx = s.zy = s.z0 = 0;
+        for (int e = 0; e < 3; e++)
+        {
+            const RasterVertex& p = v[(e + 1) % 3];
+            const RasterVertex& q = v[(e + 2) % 3];
+            s.a[e] = p.y - q.y;
+            s.b[e] = q.x - p.x;
+            s.c[e] = -(s.a[e] * p.x + s.b[e] * p.y);
+
+            //the normalized edge functions are the barycentric coordinates
+            s.zx += s.a[e] * invArea * v[e].invZ;
+            s.zy += s.b[e] * invArea * v[e].invZ;
+            s.z0 += s.c[e] * invArea * v[e].invZ;
+        }
+
+        s.color = tri.color;
+        s.id = tri.id;
+        return true;
+    }
+
+    void drawInTile(const Setup& s, int tx, int ty)
+    {
+        const int x0 = std::max(s.minX, tx * kTileSize) & ~(kStep - 1);
+        const int x1 = std::min(s.maxX, (tx + 1) * kTileSize - 1);
+        const int y0 = std::max(s.minY, ty * kTileSize);
+        const int y1 = std::min(s.maxY, (ty + 1) * kTileSize - 1);
+        const int width = getWidth();
+
+        alignas(32) float z[kStep];
+        for (int y = y0; y <= y1; y++)
+        {
+            const float py = y + 0.5f;
+            const HeroFloat rowW0(s.b[0] * py + s.c[0]);
+            const HeroFloat rowW1(s.b[1] * py + s.c[1]);
+            const HeroFloat rowW2(s.b[2] * py + s.c[2]);
+            const HeroFloat rowZ(s.zy * py + s.z0);
+            float* depthRow = &depth[(size_t)y * depthStride];
+
+            for (int x = x0; x <= x1; x += kStep)
+            {
+                int visible = 0;
+                for (int k = 0; k < kStep; k += HeroFloat::kLanes)
+                {
+                    HeroFloat px = HeroFloat(x + k + 0.5f) + HeroFloat::lanes();
+                    int outside = (HeroFloat(s.a[0]) * px + rowW0).signMask() |
+                                  (HeroFloat(s.a[1]) * px + rowW1).signMask() |
+                                  (HeroFloat(s.a[2]) * px + rowW2).signMask();
+
+                    //nearer is a larger invZ, the stored value minus ours is negative
+                    HeroFloat pz = HeroFloat(s.zx) * px + rowZ;
+                    int nearer = (HeroFloat::load(depthRow + x + k) - pz).signMask();
+                    visible |= (nearer & ~outside) << k;
+                    pz.store(z + k);
+                }
+
+                for (; visible; visible &= visible - 1)
+                {
+                    int i = ctz(visible);
+                    if (x + i >= width)
+                        break;
+                    depthRow[x + i] = z[i];
+                    image.pixels[(size_t)y * width + x + i] = s.color;
+                    ids[(size_t)y * width + x + i] = s.id;
+                }
+            }
+        }
+    }
+
+    static int ctz(int v)
+    {
+#if defined(_MSC_VER)
+        unsigned long i;
+        _BitScanForward(&i, v);
+        return (int)i;
+#else
+        return __builtin_ctz(v);
+#endif
+    }
+
+    Image image;
+    //invZ per pixel, 0 is infinitely far
+    std::vector<float> depth;
+    int depthStride;
+    std::vector<uint32_t> ids;
+    int tilesX, tilesY;
+};
+
+#endif /* rasterizer_h */
@@ -0,0 +1,275 @@
+//
+//  vertex_pipeline.h
+//  theraytracer
+//
+//  Vertex processing ahead of the rasterizer: every unique vertex of a
+//  mesh is transformed and projected once, in SIMD batches, into a
+//  post-transform cache, and the triangles are then assembled from the
+//  cache, culled by facing and clipped to the view frustum.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef vertex_pipeline_h
+#define vertex_pipeline_h
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include "vec3.h"
+#include "transform.h"
+#include "parallel.h"
+#include "spectrum_simd.h"
+#include "rasterizer.h"
+
+//An indexed triangle mesh, positions are stored as separate x, y and z arrays so that
+//a batch of vertices loads straight into SIMD lanes
+struct Mesh
+{
+    void addVertex(float x, float y, float z)
+    {
+        px.push_back(x);
+        py.push_back(y);
+        pz.push_back(z);
+    }
+
+    int numVertices() const { return (int)px.size(); }
+    int numTriangles() const { return (int)(indices.size() / 3); }
+
+    std::vector<float> px, py, pz;
+    //three per triangle, counter clockwise seen from the front
+    std::vector<uint32_t> indices;
+};
+
+//Perspective projection of a camera looking down -z. The canvas is the window
+//[left, right] x [bottom, top] on the near plane, it is mapped onto the image.
+struct Projection
+{
+    float zNear, zFar;
+    float left, right, bottom, top;
+    int imgWidth, imgHeight;
+
+    //projects the camera space point [cam], which must be in front of the near plane
+    RasterVertex toRaster(const vec3f& cam) const
+    {
+        float invZ = 1 / -cam.z;
+        RasterVertex r;
+        r.x = (cam.x * invZ * zNear - left) / (right - left) * imgWidth;
+        r.y = (1 - (cam.y * invZ * zNear - bottom) / (top - bottom)) * imgHeight;
+        r.invZ = invZ;
+        return r;
+    }
+};
+
+enum CullMode
+{
+    kCullNone,
+    kCullBack,
+    kCullFront,
+};
+
+//A triangle ready to be drawn, [source] is the index of the mesh triangle it came from.
+//Clipping can split one mesh triangle into several.
+struct AssembledTriangle
+{
+    RasterVertex v[3];
+    uint32_t source;
+    bool clipped;
+};
+
+class VertexPipeline
+{
+public:
+    //Bits of an outcode, set for each frustum plane a camera space point is outside of.
+    //In camera space the planes are d - zNear, zFar - d, x * zNear - left * d,
+    //right * d - x * zNear, y * zNear - bottom * d and top * d - y * zNear, with d = -z
+    //the distance in front of the camera, and a point is inside where all are >= 0.
+    enum
+    {
+        kOutNear = 1 << 0,
+        kOutFar = 1 << 1,
+        kOutLeft = 1 << 2,
+        kOutRight = 1 << 3,
+        kOutBottom = 1 << 4,
+        kOutTop = 1 << 5,
+        kNumPlanes = 6,
+    };
+
+    //Fills the post-transform cache with every vertex of [mesh] in camera space, projected
+    //and with its outcode. Vertices are processed HeroFloat::kLanes at a time, batches run
+    //on [numThreads] threads (0 = one per core). [worldToCamera] must be affine.
+    void transform(const Mesh& mesh, const Transform& worldToCamera, const Projection& proj, unsigned numThreads = 0)
+    {
+        projection = proj;
+        const int n = mesh.numVertices();
+        const int lanes = HeroFloat::kLanes;
+        const int numBatches = (n + lanes - 1) / lanes;
+
+        camera.resize(n);
+        raster.resize(n);
+        outcodes.resize(n);
+
+        const mat44f& m = worldToCamera.getMatrix();
+        parallelFor(0, numBatches, 64, [&](int batch)
+        {
+            const int first = batch * lanes;
+            const int count = std::min(lanes, n - first);
+
+            alignas(32) float in[3][HeroFloat::kLanes] = { { 0 } };
+            for (int k = 0; k < count; k++)
+            {
+                in[0][k] = mesh.px[first + k];
+                in[1][k] = mesh.py[first + k];
+                in[2][k] = mesh.pz[first + k];
+            }
+
+            HeroFloat x = HeroFloat::load(in[0]), y = HeroFloat::load(in[1]), z = HeroFloat::load(in[2]);
+            HeroFloat cx = x * HeroFloat(m[0][0]) + y * HeroFloat(m[1][0]) + z * HeroFloat(m[2][0]) + HeroFloat(m[3][0]);
+            HeroFloat cy = x * HeroFloat(m[0][1]) + y * HeroFloat(m[1][1]) + z * HeroFloat(m[2][1]) + HeroFloat(m[3][1]);
+            HeroFloat cz = x * HeroFloat(m[0][2]) + y * HeroFloat(m[1][2]) + z * HeroFloat(m[2][2]) + HeroFloat(m[3][2]);
+            HeroFloat d = HeroFloat(0.0f) - cz;
+
+            //a plane value below zero sets the sign bit, which is the outcode bit of the lane
+            HeroFloat nearV(proj.zNear);
+            int planeMasks[kNumPlanes] = {
+                (d - nearV).signMask(),
+                (HeroFloat(proj.zFar) - d).signMask(),
+                (cx * nearV - HeroFloat(proj.left) * d).signMask(),
+                (HeroFloat(proj.right) * d - cx * nearV).signMask(),
+                (cy * nearV - HeroFloat(proj.bottom) * d).signMask(),
+                (HeroFloat(proj.top) * d - cy * nearV).signMask(),
+            };
+
+            //the same projection as Projection::toRaster, vertices behind the camera get
+            //garbage that is never used since their outcode has kOutNear
+            HeroFloat invZ = HeroFloat(1.0f) / d;
+            HeroFloat scaleX = HeroFloat((float)proj.imgWidth / (proj.right - proj.left));
+            HeroFloat scaleY = HeroFloat((float)proj.imgHeight / (proj.top - proj.bottom));
+            HeroFloat rx = (cx * invZ * nearV - HeroFloat(proj.left)) * scaleX;
+            HeroFloat ry = HeroFloat((float)proj.imgHeight) - (cy * invZ * nearV - HeroFloat(proj.bottom)) * scaleY;
+
+            alignas(32) float out[6][HeroFloat::kLanes];
+            cx.store(out[0]);
+            cy.store(out[1]);
+            cz.store(out[2]);
+            rx.store(out[3]);
+            ry.store(out[4]);
+            invZ.store(out[5]);
+
+            for (int k = 0; k < count; k++)
+            {
+                camera[first + k] = vec3f(out[0][k], out[1][k], out[2][k]);
+                raster[first + k].x = out[3][k];
+                raster[first + k].y = out[4][k];
+                raster[first + k].invZ = out[5][k];
+
+                uint8_t code = 0;
+                for (int p = 0; p < kNumPlanes; p++)
+                    code |= ((planeMasks[p] >> k) & 1) << p;
+                outcodes[first + k] = code;
+            }
+        }, numThreads);
+    }
+
+    //Assembles the triangles of [mesh] from the cache filled by transform(). Triangles are
+    //culled by [cull], dropped if they are outside of one frustum plane and clipped if they
+    //cross any. The result is in mesh order and appended to [out].
+    void assemble(const Mesh& mesh, CullMode cull, std::vector<AssembledTriangle>& out) const
+    {
+        for (int t = 0; t < mesh.numTriangles(); t++)
+        {
+            const uint32_t* idx = &mesh.indices[t * 3];
+            const vec3f& c0 = camera[idx[0]];
+            const vec3f& c1 = camera[idx[1]];
+            const vec3f& c2 = camera[idx[2]];
+
+            if (cull != kCullNone)
+            {
+                //the camera is at the origin, front faces wind counter clockwise towards it
+                float facing = Vec3Util::cross(c1 - c0, c2 - c0).dot(c0);
+                if (facing >= 0 ? cull == kCullBack : cull == kCullFront)
+                    continue;
+            }
+
+            uint8_t all = outcodes[idx[0]] & outcodes[idx[1]] & outcodes[idx[2]];
+            uint8_t any = outcodes[idx[0]] | outcodes[idx[1]] | outcodes[idx[2]];
+            if (all)
+                continue;
+
+            AssembledTriangle tri;
+            tri.source = (uint32_t)t;
+            tri.clipped = false;
+            if (!any)
+            {
+                for (int k = 0; k < 3; k++)
+                    tri.v[k] = raster[idx[k]];
+                out.push_back(tri);
+                continue;
+            }
+
+            //Sutherland-Hodgman in camera space against the planes that are crossed,
+            //the polygon gains at most one vertex per plane
+            vec3f polygon[3 + kNumPlanes], clipped[3 + kNumPlanes];
+            int count = 3;
+            polygon[0] = c0;
+            polygon[1] = c1;
+            polygon[2] = c2;
+            for (int p = 0; p < kNumPlanes && count >= 3; p++)
+            {
+                if (!(any & (1 << p)))
+                    continue;
+
+                int clippedCount = 0;
+                for (int i = 0; i < count; i++)
+                {
+                    const vec3f& a = polygon[i];
+                    const vec3f& b = polygon[(i + 1) % count];
+                    float da = planeDistance(p, a), db = planeDistance(p, b);
+                    if (da >= 0)
+                        clipped[clippedCount++] = a;
+                    if ((da >= 0) != (db >= 0))
+                        clipped[clippedCount++] = a + (b - a) * (da / (da - db));
+                }
+                count = clippedCount;
+                for (int i = 0; i < count; i++)
+                    polygon[i] = clipped[i];
+            }
+
+            //fan of the convex polygon
+            tri.clipped = true;
+            for (int i = 1; i + 1 < count; i++)
+            {
+                tri.v[0] = projection.toRaster(polygon[0]);
+                tri.v[1] = projection.toRaster(polygon[i]);
+                tri.v[2] = projection.toRaster(polygon[i + 1]);
+                out.push_back(tri);
+            }
+        }
+    }
+
+    //the cached camera space position of vertex [i]
+    const vec3f& getCamera(int i) const { return camera[i]; }
+
+private:
+    //value of frustum plane [p] at camera space point [c], negative outside
+    float planeDistance(int p, const vec3f& c) const
+    {
+        float d = -c.z;
+        switch (p)
+        {
+            case 0: return d - projection.zNear;
+            case 1: return projection.zFar - d;
+            case 2: return c.x * projection.zNear - projection.left * d;
+            case 3: return projection.right * d - c.x * projection.zNear;
+            case 4: return c.y * projection.zNear - projection.bottom * d;
+            default: return projection.top * d - c.y * projection.zNear;
+        }
+    }
+
+    Projection projection;
+    std::vector<vec3f> camera;
+    std::vector<RasterVertex> raster;
+    std::vector<uint8_t> outcodes;
+};
+
+#endif /* vertex_pipeline_h */
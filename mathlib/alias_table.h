@@ -0,0 +1,150 @@
+//
+//  alias_table.h
+//  theraytracer
+//
+//  Walker's alias method: after an O(n) setup, an index is drawn from a
+//  discrete distribution of n weights in constant time with one random
+//  number, which also yields a fresh uniform number for use inside the
+//  chosen bin
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef alias_table_h
+#define alias_table_h
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+class AliasTable
+{
+public:
+    AliasTable() : total(0) {}
+
+    //Builds the table of the non-negative [weights]. If they are all zero every index is
+    //equally likely.
+    explicit AliasTable(const std::vector<float>& weights)
+    {
+        const size_t n = weights.size();
+        bins.resize(n);
+
+        double sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += weights[i];
+        total = (float)sum;
+
+        //Vose: scaled weights below 1 are topped up by ones above 1
+        std::vector<uint32_t> small, large;
+        std::vector<double> scaled(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            scaled[i] = sum > 0 ? weights[i] * n / sum : 1.0;
+            bins[i].pdf = (float)(scaled[i] / n);
+            (scaled[i] < 1 ? small : large).push_back((uint32_t)i);
+        }
+
+        while (!small.empty() && !large.empty())
+        {
+            uint32_t s = small.back(), l = large.back();
+            small.pop_back();
+            bins[s].probability = (float)scaled[s];
+            bins[s].alias = l;
+
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1)
+            {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        //what is left is 1 up to rounding
+        large.insert(large.end(), small.begin(), small.end());
+        for (size_t i = 0; i < large.size(); i++)
+        {
+            bins[large[i]].probability = 1;
+            bins[large[i]].alias = large[i];
+        }
+    }
+
+    size_t size() const { return bins.size(); }
+    //the sum of the weights
+    float getTotal() const { return total; }
+    //the probability of drawing index [i]
+    float pdf(size_t i) const { return bins[i].pdf; }
+
+    //Draws an index with [u] in [0, 1). [remapped] is set to a uniform number in [0, 1) that
+    //does not depend on which index was drawn.
+    uint32_t sample(float u, float& remapped) const
+    {
+        const size_t n = bins.size();
+        float scaled = u * n;
+        size_t i = (size_t)scaled;
+        if (i >= n)
+            i = n - 1;
+
+        //the largest float below 1
+        const float oneMinusEpsilon = 0.99999994f;
+        const Bin& bin = bins[i];
+        float v = scaled - i;
+        if (v < bin.probability)
+        {
+            remapped = std::min(v / bin.probability, oneMinusEpsilon);
+            return (uint32_t)i;
+        }
+        remapped = std::min((v - bin.probability) / (1 - bin.probability), oneMinusEpsilon);
+        return bin.alias;
+    }
+
+private:
+    struct Bin
+    {
+        float probability;
+        uint32_t alias;
+        float pdf;
+    };
+
+    std::vector<Bin> bins;
+    float total;
+};
+
+//A distribution over the cells of a [width] x [height] grid of weights, drawn in constant
+//time: a row from the marginal table of the row sums, then a column from the table of the row
+class AliasTable2D
+{
+public:
+    AliasTable2D() : width(0), height(0) {}
+
+    //[weights] are row by row
+    AliasTable2D(const std::vector<float>& weights, int w, int h) : width(w), height(h)
+    {
+        std::vector<float> rowWeights(h);
+        rows.reserve(h);
+        for (int y = 0; y < h; y++)
+        {
+            rows.push_back(AliasTable(std::vector<float>(weights.begin() + (size_t)y * w, weights.begin() + (size_t)(y + 1) * w)));
+            rowWeights[y] = rows[y].getTotal();
+        }
+        marginal = AliasTable(rowWeights);
+    }
+
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+
+    //the probability of drawing cell (x, y)
+    float pdf(int x, int y) const { return marginal.pdf(y) * rows[y].pdf(x); }
+
+    //Draws cell (x, y) with (u1, u2) in [0, 1)^2, (fx, fy) is a uniform position inside it
+    void sample(float u1, float u2, int& x, int& y, float& fx, float& fy) const
+    {
+        y = (int)marginal.sample(u1, fy);
+        x = (int)rows[y].sample(u2, fx);
+    }
+
+private:
+    int width, height;
+    AliasTable marginal;
+    std::vector<AliasTable> rows;
+};
+
+#endif /* alias_table_h */
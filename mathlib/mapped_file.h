@@ -0,0 +1,128 @@
+//
+//  mapped_file.h
+//  theraytracer
+//
+//  A read-only view of a whole file, memory-mapped where the platform
+//  supports it so pages are read on first access and shared between runs
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef mapped_file_h
+#define mapped_file_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+class MappedFile
+{
+public:
+    //how the mapping will be read, lets the system tune read-ahead
+    enum Access
+    {
+        kAccessSequential,
+        kAccessRandom,
+    };
+
+    MappedFile() : mapping(NULL), mappingSize(0) {}
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    //Maps the file at [path], on platforms without mmap it is read into memory.
+    //returns false if the file cannot be opened or is empty
+    bool open(const char* path)
+    {
+        close();
+
+#ifndef _WIN32
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0)
+        {
+            ::close(fd);
+            return false;
+        }
+
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+            return false;
+
+        mapping = map;
+        mappingSize = st.st_size;
+#else
+        FILE* file = fopen(path, "rb");
+        if (!file)
+            return false;
+
+        _fseeki64(file, 0, SEEK_END);
+        mappingSize = (size_t)_ftelli64(file);
+        _fseeki64(file, 0, SEEK_SET);
+        mapping = mappingSize ? malloc(mappingSize) : NULL;
+        if (!mapping || fread(mapping, 1, mappingSize, file) != mappingSize)
+        {
+            fclose(file);
+            close();
+            return false;
+        }
+        fclose(file);
+#endif
+        return true;
+    }
+
+    void close()
+    {
+        if (mapping)
+        {
+#ifndef _WIN32
+            munmap(mapping, mappingSize);
+#else
+            free(mapping);
+#endif
+        }
+
+        mapping = NULL;
+        mappingSize = 0;
+    }
+
+    //hints the access pattern of the bytes in [offset, offset + size)
+    void advise(Access access, size_t offset = 0, size_t size = (size_t)-1) const
+    {
+#ifndef _WIN32
+        if (!mapping || offset >= mappingSize)
+            return;
+
+        //madvise wants a page aligned start
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = offset / page * page;
+        size_t end = (size > mappingSize - offset) ? mappingSize : offset + size;
+        posix_madvise((uint8_t*)mapping + start, end - start,
+                      access == kAccessSequential ? POSIX_MADV_WILLNEED : POSIX_MADV_RANDOM);
+#else
+        (void)access; (void)offset; (void)size;
+#endif
+    }
+
+    bool isOpen() const { return mapping != NULL; }
+    const uint8_t* data() const { return (const uint8_t*)mapping; }
+    size_t size() const { return mappingSize; }
+
+private:
+    void* mapping;
+    size_t mappingSize;
+};
+
+#endif /* mapped_file_h */
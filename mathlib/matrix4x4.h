@@ -101,7 +101,7 @@ public:
 		return trans;
 	}
 
-	Matrix4x4<T> inverse()
+	Matrix4x4<T> inverse() const
 	{
 		int i, j, k;
 		Matrix4x4<T> s;
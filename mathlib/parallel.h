@@ -0,0 +1,74 @@
+//
+//  parallel.h
+//  theraytracer
+//
+//  Small helpers for spreading loops over worker threads
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef parallel_h
+#define parallel_h
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+//Returns the number of worker threads to use for [requested] threads (0 = one per core)
+inline unsigned resolveThreadCount(unsigned requested)
+{
+    if (requested)
+        return requested;
+    
+    unsigned cores = std::thread::hardware_concurrency();
+    return cores ? cores : 1;
+}
+
+//Calls func(i) for every i in [begin, end) on [numThreads] threads (0 = one per core).
+//Indices are handed out in chunks of [grain] through an atomic counter, so the order
+//in which indices run is unspecified and func must not depend on it.
+template<typename Func>
+void parallelFor(int begin, int end, int grain, const Func& func, unsigned numThreads = 0)
+{
+    if (end <= begin)
+        return;
+    
+    grain = std::max(1, grain);
+    unsigned numChunks = (unsigned)((end - begin + grain - 1) / grain);
+    numThreads = std::min(resolveThreadCount(numThreads), numChunks);
+    
+    if (numThreads <= 1)
+    {
+        for (int i = begin; i < end; i++)
+            func(i);
+        return;
+    }
+    
+    std::atomic<int> next(begin);
+    auto worker = [&]()
+    {
+        for (;;)
+        {
+            int first = next.fetch_add(grain);
+            if (first >= end)
+                break;
+            
+            int last = std::min(end, first + grain);
+            for (int i = first; i < last; i++)
+                func(i);
+        }
+    };
+    
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < numThreads; i++)
+        threads.push_back(std::thread(worker));
+    
+    worker();
+    
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+#endif /* parallel_h */
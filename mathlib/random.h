@@ -0,0 +1,62 @@
+//
+//  random.h
+//  theraytracer
+//
+//  Counter-based random numbers. Every value is a pure function of
+//  (pixel, sample, dimension), so there is no shared generator state:
+//  threads never contend and a render is reproducible bit-for-bit
+//  regardless of thread count or scheduling.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef random_h
+#define random_h
+
+#include <stdint.h>
+
+//Permutes a 32-bit integer with a PCG output stage (one LCG step
+//followed by the RXS-M-XS permutation of the PCG family)
+inline uint32_t pcgHash(uint32_t v)
+{
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+//Maps the upper 24 bits of [v] to a float in [0, 1)
+inline float uintToFloat01(uint32_t v)
+{
+    return (v >> 8) * (1.0f / 16777216.0f);
+}
+
+//Returns a uniformly distributed integer for dimension [dim] of sample [sampleIndex] in pixel [pixelIndex]
+inline uint32_t sampleUInt(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t dim, uint32_t seed = 0)
+{
+    return pcgHash(pixelIndex ^ pcgHash(sampleIndex ^ pcgHash(dim ^ pcgHash(seed))));
+}
+
+//Returns a uniformly distributed float in [0, 1) for dimension [dim] of sample [sampleIndex] in pixel [pixelIndex]
+inline float sampleUniform(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t dim, uint32_t seed = 0)
+{
+    return uintToFloat01(sampleUInt(pixelIndex, sampleIndex, dim, seed));
+}
+
+//Walks the dimensions of one (pixel, sample) pair, each call to next01()
+//consumes the next dimension. Cheap to create, create one per sample.
+class SampleRng
+{
+public:
+    SampleRng(uint32_t pixel, uint32_t sample, uint32_t s = 0) :
+    pixelIndex(pixel), sampleIndex(sample), seed(s), dimension(0) {}
+    
+    uint32_t nextUInt() { return sampleUInt(pixelIndex, sampleIndex, dimension++, seed); }
+    float next01() { return uintToFloat01(nextUInt()); }
+    
+    uint32_t pixelIndex;
+    uint32_t sampleIndex;
+    uint32_t seed;
+    uint32_t dimension;
+};
+
+#endif /* random_h */
@@ -0,0 +1,132 @@
+//
+//  transform.h
+//  theraytracer
+//
+//  A matrix together with its inverse and the transpose of its inverse,
+//  all computed once, so points, directions and normals can be moved
+//  between spaces in both directions without inverting anything later
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef transform_h
+#define transform_h
+
+#include "vec3.h"
+#include "matrix4x4.h"
+
+//Transforms use the row vector convention of Matrix4x4::multVec: a point is p * M, so
+//the translation is row 3 and a matrix is affine if its last column is (0, 0, 0, 1).
+//Affine matrices, which is every rigid, scaling or shearing transform, are inverted in
+//closed form and transform points without the homogeneous divide.
+template<typename T>
+class TransformT
+{
+public:
+	//the identity
+	TransformT() : affine(true) {}
+
+	explicit TransformT(const Matrix4x4<T>& m) : matrix(m),
+	inverseMatrix(isAffine(m) ? affineInverse(m) : m.inverse()),
+	normalMatrix(inverseMatrix.transpose()), affine(isAffine(m)) {}
+
+	const Matrix4x4<T>& getMatrix() const { return matrix; }
+	const Matrix4x4<T>& getInverseMatrix() const { return inverseMatrix; }
+	//the inverse transpose, which keeps normals perpendicular to transformed surfaces
+	const Matrix4x4<T>& getNormalMatrix() const { return normalMatrix; }
+	bool isAffine() const { return affine; }
+
+	//the inverse transform, nothing is recomputed
+	TransformT<T> inverse() const
+	{
+		return TransformT<T>(inverseMatrix, matrix, matrix.transpose(), affine);
+	}
+
+	//applies this transform, then [r]
+	TransformT<T> operator * (const TransformT<T>& r) const
+	{
+		Matrix4x4<T> m = matrix * r.matrix;
+		Matrix4x4<T> inv = r.inverseMatrix * inverseMatrix;
+		return TransformT<T>(m, inv, inv.transpose(), affine && r.affine);
+	}
+
+	Vec3<T> point(const Vec3<T>& p) const
+	{
+		if (!affine)
+		{
+			Vec3<T> dst;
+			matrix.multVec(p, dst);
+			return dst;
+		}
+
+		const Matrix4x4<T>& m = matrix;
+		return Vec3<T>(p.x * m[0][0] + p.y * m[1][0] + p.z * m[2][0] + m[3][0],
+		               p.x * m[0][1] + p.y * m[1][1] + p.z * m[2][1] + m[3][1],
+		               p.x * m[0][2] + p.y * m[1][2] + p.z * m[2][2] + m[3][2]);
+	}
+
+	//a direction, not normalized
+	Vec3<T> vector(const Vec3<T>& v) const
+	{
+		Vec3<T> dst;
+		matrix.multDirVec(v, dst);
+		return dst;
+	}
+
+	//a surface normal, not normalized
+	Vec3<T> normal(const Vec3<T>& n) const
+	{
+		Vec3<T> dst;
+		normalMatrix.multDirVec(n, dst);
+		return dst;
+	}
+
+private:
+	TransformT(const Matrix4x4<T>& m, const Matrix4x4<T>& inv, const Matrix4x4<T>& invT, bool isAffine) :
+	matrix(m), inverseMatrix(inv), normalMatrix(invT), affine(isAffine) {}
+
+	static bool isAffine(const Matrix4x4<T>& m)
+	{
+		return m[0][3] == 0 && m[1][3] == 0 && m[2][3] == 0 && m[3][3] == 1;
+	}
+
+	//Inverse of [A 0; t 1]: [A^-1 0; -t A^-1 1], A^-1 from the cofactors of A.
+	//A singular A gives the identity, as Matrix4x4::inverse() does.
+	static Matrix4x4<T> affineInverse(const Matrix4x4<T>& m)
+	{
+		T c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+		T c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+		T c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+		T det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+		if (det == 0)
+			return Matrix4x4<T>();
+
+		T invDet = 1 / det;
+		Matrix4x4<T> inv;
+		inv[0][0] = c00 * invDet;
+		inv[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+		inv[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+		inv[1][0] = c01 * invDet;
+		inv[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+		inv[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+		inv[2][0] = c02 * invDet;
+		inv[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+		inv[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+
+		for (int j = 0; j < 3; j++)
+			inv[3][j] = -(m[3][0] * inv[0][j] + m[3][1] * inv[1][j] + m[3][2] * inv[2][j]);
+		return inv;
+	}
+
+	Matrix4x4<T> matrix;
+	Matrix4x4<T> inverseMatrix;
+	Matrix4x4<T> normalMatrix;
+	bool affine;
+};
+
+//A transform with floating-point precision
+typedef TransformT<float> Transform;
+//A transform with double precision
+typedef TransformT<double> Transformd;
+
+#endif /* transform_h */
@@ -133,6 +133,18 @@ public:
 		return vnorm.normalize();
 	}
 
+	//Builds tangent and bitangent so that (tangent, bitangent, n) is an orthonormal
+	//basis around the unit vector n (Duff et al. 2017, "Building an Orthonormal Basis, Revisited")
+	template<typename T>
+	static void orthonormalBasis(const Vec3<T>& n, Vec3<T>& tangent, Vec3<T>& bitangent)
+	{
+		T sign = copysign((T)1, n.z);
+		T a = -1 / (sign + n.z);
+		T b = n.x * n.y * a;
+		tangent = Vec3<T>(1 + sign * n.x * n.x * a, sign * b, -sign * n.x);
+		bitangent = Vec3<T>(b, sign + n.y * n.y * a, -n.y);
+	}
+
 	//Performs the cross product of A and B (A x B order)
 	template<typename T>
 	static Vec3<T> cross(const Vec3<T>& a, const Vec3<T>& b)
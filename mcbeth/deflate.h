@@ -0,0 +1,518 @@
+//
+//  deflate.h
+//  theraytracer
+//
+//  A small DEFLATE (RFC 1951) compressor for the PNG writer: greedy LZ77 over
+//  a hash chain and dynamic Huffman blocks, plus the Adler-32 and CRC-32
+//  checksums of zlib streams and PNG chunks. Streams are made to be cut into
+//  independently compressed pieces that concatenate into one valid stream.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef deflate_h
+#define deflate_h
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+//Appends bits to a byte vector, least significant bit first as DEFLATE packs them
+class BitWriter
+{
+public:
+    BitWriter(std::vector<uint8_t>& o) : out(o), bits(0), count(0) {}
+
+    //appends the [n] low bits of [value], n <= 32
+    void put(uint32_t value, int n)
+    {
+        bits |= (uint64_t)value << count;
+        count += n;
+        while (count >= 8)
+        {
+            out.push_back((uint8_t)bits);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    //pads with zero bits to the next byte boundary
+    void align()
+    {
+        if (count > 0)
+            put(0, 8 - count);
+    }
+
+    std::vector<uint8_t>& out;
+    uint64_t bits;
+    int count;
+};
+
+class Deflate
+{
+public:
+    static const int kWindowSize = 32768;
+    static const int kMinMatch = 3;
+    static const int kMaxMatch = 258;
+    //candidates tried per position, more finds longer matches at the cost of speed
+    static const int kMaxChain = 8;
+    static const int kHashBits = 15;
+    //tokens per Huffman block, every block gets its own codes
+    static const int kBlockTokens = 1 << 16;
+
+    //Compresses [size] bytes of [data] and appends them to [out] as dynamic Huffman
+    //blocks. If [last], the final block is marked as the end of the stream. Otherwise
+    //the data ends with an empty stored block, which leaves it byte aligned, so the
+    //compressed pieces of consecutive parts of a stream can simply be concatenated.
+    //Matches never reach back before [data], the pieces are fully independent.
+    static void compress(const uint8_t* data, size_t size, bool last, std::vector<uint8_t>& out)
+    {
+        BitWriter writer(out);
+        std::vector<Token> tokens;
+        tokens.reserve(kBlockTokens);
+
+        std::vector<int32_t> head((size_t)1 << kHashBits, -1);
+        std::vector<int32_t> prev(kWindowSize, -1);
+
+        bool finished = false;
+        size_t i = 0;
+        while (i < size)
+        {
+            int bestLength = 0;
+            int bestDistance = 0;
+            if (i + kMinMatch <= size)
+            {
+                uint32_t h = hash(data + i);
+                int maxLength = (int)std::min<size_t>(kMaxMatch, size - i);
+                int32_t candidate = head[h];
+                for (int chain = 0; chain < kMaxChain && candidate >= 0 && i - candidate <= kWindowSize; chain++)
+                {
+                    const uint8_t* a = data + candidate;
+                    const uint8_t* b = data + i;
+                    //a longer match must also agree at the current best length
+                    if (a[bestLength] == b[bestLength] && a[0] == b[0])
+                    {
+                        int length = matchLength(a, b, maxLength);
+                        if (length > bestLength)
+                        {
+                            bestLength = length;
+                            bestDistance = (int)(i - candidate);
+                            if (length == maxLength)
+                                break;
+                        }
+                    }
+                    candidate = prev[candidate & (kWindowSize - 1)];
+                }
+            }
+
+            if (bestLength >= kMinMatch)
+            {
+                Token t = { (uint16_t)bestLength, (uint16_t)bestDistance };
+                tokens.push_back(t);
+                //long matches only index their start, like the fast levels of zlib
+                int indexed = bestLength <= 32 ? bestLength : 1;
+                for (int k = 0; k < indexed; k++)
+                    insert(data, size, i + k, head, prev);
+                i += bestLength;
+            }
+            else
+            {
+                Token t = { data[i], 0 };
+                tokens.push_back(t);
+                insert(data, size, i, head, prev);
+                i++;
+            }
+
+            if (tokens.size() == kBlockTokens)
+            {
+                finished = last && i == size;
+                writeBlock(tokens, finished, writer);
+                tokens.clear();
+            }
+        }
+
+        if (!tokens.empty() || (last && !finished))
+            writeBlock(tokens, last, writer);
+        if (!last)
+        {
+            //empty stored block: header, alignment, LEN 0 and NLEN 0xffff
+            writer.put(0, 3);
+            writer.align();
+            writer.put(0x0000, 16);
+            writer.put(0xffff, 16);
+        }
+        writer.align();
+    }
+
+private:
+    //a literal byte if distance is 0, a match of [lengthOrLiteral] bytes otherwise
+    struct Token
+    {
+        uint16_t lengthOrLiteral;
+        uint16_t distance;
+    };
+
+    static uint32_t hash(const uint8_t* p)
+    {
+        uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+        return (v * 2654435761u) >> (32 - kHashBits);
+    }
+
+    //number of equal bytes at [a] and [b], at most [maxLength], compared 8 bytes at a time
+    static int matchLength(const uint8_t* a, const uint8_t* b, int maxLength)
+    {
+        int length = 0;
+        while (length + 8 <= maxLength)
+        {
+            uint64_t x, y;
+            memcpy(&x, a + length, 8);
+            memcpy(&y, b + length, 8);
+            if (x != y)
+                break;
+            length += 8;
+        }
+        while (length < maxLength && a[length] == b[length])
+            length++;
+        return length;
+    }
+
+    static void insert(const uint8_t* data, size_t size, size_t i,
+                       std::vector<int32_t>& head, std::vector<int32_t>& prev)
+    {
+        if (i + kMinMatch > size)
+            return;
+        uint32_t h = hash(data + i);
+        prev[i & (kWindowSize - 1)] = head[h];
+        head[h] = (int32_t)i;
+    }
+
+    //symbol 257..285 and extra bits of a match length
+    static int lengthCode(int length, int& extraBits, int& extra)
+    {
+        int l = length - 3;
+        if (length == 258)
+        {
+            extraBits = extra = 0;
+            return 285;
+        }
+        if (l < 8)
+        {
+            extraBits = extra = 0;
+            return 257 + l;
+        }
+        int nb = highestBit(l);
+        extraBits = nb - 2;
+        extra = l & ((1 << extraBits) - 1);
+        return 257 + 4 * (nb - 1) + ((l >> (nb - 2)) & 3);
+    }
+
+    //symbol 0..29 and extra bits of a match distance
+    static int distanceCode(int distance, int& extraBits, int& extra)
+    {
+        int d = distance - 1;
+        if (d < 4)
+        {
+            extraBits = extra = 0;
+            return d;
+        }
+        int nb = highestBit(d);
+        extraBits = nb - 1;
+        extra = d & ((1 << extraBits) - 1);
+        return 2 * nb + ((d >> (nb - 1)) & 1);
+    }
+
+    static int highestBit(uint32_t v)
+    {
+        int n = 0;
+        while (v >>= 1)
+            n++;
+        return n;
+    }
+
+    //Huffman code lengths of [n] symbols with frequencies [freq], none longer than
+    //[maxBits]. Too deep trees are rebuilt from flattened frequencies. At least two
+    //symbols always get a code, so every code is complete.
+    static void buildLengths(const uint32_t* freq, int n, int maxBits, uint8_t* lengths)
+    {
+        std::vector<uint32_t> f(freq, freq + n);
+        int used = 0;
+        for (int i = 0; i < n; i++)
+            used += f[i] ? 1 : 0;
+        for (int i = 0; used < 2 && i < n; i++)
+        {
+            if (!f[i])
+            {
+                f[i] = 1;
+                used++;
+            }
+        }
+
+        for (;;)
+        {
+            typedef std::pair<uint64_t, int> Node;
+            std::priority_queue<Node, std::vector<Node>, std::greater<Node> > queue;
+            std::vector<int> parent(2 * n, -1);
+            for (int i = 0; i < n; i++)
+                if (f[i])
+                    queue.push(Node(f[i], i));
+
+            int next = n;
+            while (queue.size() > 1)
+            {
+                Node a = queue.top(); queue.pop();
+                Node b = queue.top(); queue.pop();
+                parent[a.second] = parent[b.second] = next;
+                queue.push(Node(a.first + b.first, next++));
+            }
+
+            //internal nodes are created after their children, so walking down from the
+            //root visits every parent before its children
+            std::vector<int> depth(next, 0);
+            for (int node = next - 2; node >= 0; node--)
+                if (parent[node] >= 0)
+                    depth[node] = depth[parent[node]] + 1;
+
+            int maxDepth = 0;
+            for (int i = 0; i < n; i++)
+            {
+                lengths[i] = f[i] ? (uint8_t)depth[i] : 0;
+                maxDepth = std::max(maxDepth, (int)lengths[i]);
+            }
+            if (maxDepth <= maxBits)
+                return;
+
+            for (int i = 0; i < n; i++)
+                if (f[i])
+                    f[i] = (f[i] >> 1) | 1;
+        }
+    }
+
+    //canonical codes for [lengths] (RFC 1951 3.2.2), bit reversed for the LSB first writer
+    static void buildCodes(const uint8_t* lengths, int n, uint16_t* codes)
+    {
+        int count[16] = { 0 };
+        for (int i = 0; i < n; i++)
+            count[lengths[i]]++;
+        count[0] = 0;
+
+        int nextCode[16] = { 0 };
+        int code = 0;
+        for (int bits = 1; bits < 16; bits++)
+        {
+            code = (code + count[bits - 1]) << 1;
+            nextCode[bits] = code;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            int len = lengths[i];
+            if (!len)
+            {
+                codes[i] = 0;
+                continue;
+            }
+            int c = nextCode[len]++;
+            int reversed = 0;
+            for (int b = 0; b < len; b++)
+                reversed |= ((c >> b) & 1) << (len - 1 - b);
+            codes[i] = (uint16_t)reversed;
+        }
+    }
+
+    static void writeBlock(const std::vector<Token>& tokens, bool final, BitWriter& writer)
+    {
+        uint32_t litFreq[286] = { 0 };
+        uint32_t distFreq[30] = { 0 };
+        int extraBits, extra;
+        for (size_t i = 0; i < tokens.size(); i++)
+        {
+            const Token& t = tokens[i];
+            if (t.distance == 0)
+                litFreq[t.lengthOrLiteral]++;
+            else
+            {
+                litFreq[lengthCode(t.lengthOrLiteral, extraBits, extra)]++;
+                distFreq[distanceCode(t.distance, extraBits, extra)]++;
+            }
+        }
+        litFreq[256] = 1;
+
+        uint8_t lengths[286 + 30];
+        uint8_t* litLengths = lengths;
+        uint8_t* distLengths = lengths + 286;
+        buildLengths(litFreq, 286, 15, litLengths);
+        buildLengths(distFreq, 30, 15, distLengths);
+
+        int numLit = 286;
+        while (numLit > 257 && litLengths[numLit - 1] == 0)
+            numLit--;
+        int numDist = 30;
+        while (numDist > 1 && distLengths[numDist - 1] == 0)
+            numDist--;
+
+        //the code lengths of both trees, run length coded with symbols 16, 17 and 18
+        uint8_t all[286 + 30];
+        memcpy(all, litLengths, numLit);
+        memcpy(all + numLit, distLengths, numDist);
+        int total = numLit + numDist;
+
+        std::vector<uint8_t> clSymbols, clExtra;
+        uint32_t clFreq[19] = { 0 };
+        for (int i = 0; i < total;)
+        {
+            uint8_t len = all[i];
+            int run = 1;
+            while (i + run < total && all[i + run] == len)
+                run++;
+
+            if (len == 0 && run >= 3)
+            {
+                int r = std::min(run, 138);
+                clSymbols.push_back(r >= 11 ? 18 : 17);
+                clExtra.push_back((uint8_t)(r >= 11 ? r - 11 : r - 3));
+                i += r;
+            }
+            else if (len != 0 && run >= 4)
+            {
+                //the length itself, then repeats of it
+                clSymbols.push_back(len);
+                clExtra.push_back(0);
+                int r = std::min(run - 1, 6);
+                clSymbols.push_back(16);
+                clExtra.push_back((uint8_t)(r - 3));
+                i += 1 + r;
+            }
+            else
+            {
+                clSymbols.push_back(len);
+                clExtra.push_back(0);
+                i++;
+            }
+        }
+        for (size_t i = 0; i < clSymbols.size(); i++)
+            clFreq[clSymbols[i]]++;
+
+        uint8_t clLengths[19];
+        uint16_t clCodes[19];
+        buildLengths(clFreq, 19, 7, clLengths);
+        buildCodes(clLengths, 19, clCodes);
+
+        static const uint8_t kCodeLengthOrder[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+        int numCL = 19;
+        while (numCL > 4 && clLengths[kCodeLengthOrder[numCL - 1]] == 0)
+            numCL--;
+
+        uint16_t litCodes[286];
+        uint16_t distCodes[30];
+        buildCodes(litLengths, 286, litCodes);
+        buildCodes(distLengths, 30, distCodes);
+
+        writer.put(final ? 1 : 0, 1);
+        writer.put(2, 2);
+        writer.put(numLit - 257, 5);
+        writer.put(numDist - 1, 5);
+        writer.put(numCL - 4, 4);
+        for (int i = 0; i < numCL; i++)
+            writer.put(clLengths[kCodeLengthOrder[i]], 3);
+
+        for (size_t i = 0; i < clSymbols.size(); i++)
+        {
+            int s = clSymbols[i];
+            writer.put(clCodes[s], clLengths[s]);
+            if (s == 16)
+                writer.put(clExtra[i], 2);
+            else if (s == 17)
+                writer.put(clExtra[i], 3);
+            else if (s == 18)
+                writer.put(clExtra[i], 7);
+        }
+
+        for (size_t i = 0; i < tokens.size(); i++)
+        {
+            const Token& t = tokens[i];
+            if (t.distance == 0)
+            {
+                writer.put(litCodes[t.lengthOrLiteral], litLengths[t.lengthOrLiteral]);
+                continue;
+            }
+
+            int code = lengthCode(t.lengthOrLiteral, extraBits, extra);
+            writer.put(litCodes[code], litLengths[code]);
+            if (extraBits)
+                writer.put(extra, extraBits);
+
+            code = distanceCode(t.distance, extraBits, extra);
+            writer.put(distCodes[code], distLengths[code]);
+            if (extraBits)
+                writer.put(extra, extraBits);
+        }
+
+        writer.put(litCodes[256], litLengths[256]);
+    }
+};
+
+//Adler-32 of [size] bytes, continued from [adler]
+inline uint32_t adler32(const uint8_t* data, size_t size, uint32_t adler = 1)
+{
+    const uint32_t kBase = 65521;
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (size > 0)
+    {
+        //5552 bytes is the most that can be summed before b overflows
+        size_t n = std::min<size_t>(size, 5552);
+        size -= n;
+        while (n--)
+        {
+            a += *data++;
+            b += a;
+        }
+        a %= kBase;
+        b %= kBase;
+    }
+    return a | (b << 16);
+}
+
+//Adler-32 of the concatenation of two pieces from their checksums and the length of the second
+inline uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t length2)
+{
+    const uint32_t kBase = 65521;
+    uint32_t rem = (uint32_t)(length2 % kBase);
+    uint32_t sum1 = adler1 & 0xffff;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % kBase);
+    sum1 += (adler2 & 0xffff) + kBase - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + kBase - rem;
+    if (sum1 >= kBase) sum1 -= kBase;
+    if (sum1 >= kBase) sum1 -= kBase;
+    if (sum2 >= (kBase << 1)) sum2 -= (kBase << 1);
+    if (sum2 >= kBase) sum2 -= kBase;
+    return sum1 | (sum2 << 16);
+}
+
+//CRC-32 (ISO 3309, as used by PNG) of [size] bytes, continued from [crc]
+inline uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+    struct Table
+    {
+        Table()
+        {
+            for (uint32_t n = 0; n < 256; n++)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                entries[n] = c;
+            }
+        }
+        uint32_t entries[256];
+    };
+    static const Table table;
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#endif /* deflate_h */
@@ -12,134 +12,566 @@
 #define image_h
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <iostream>
+#include <vector>
 #include "math_macros.h"
+#include "parallel.h"
+#include "mapped_file.h"
+#include "deflate.h"
 
 struct RGB
 {
 	float r, g, b;
 };
 
-// Represents a basic image holding R, G and B data.
-class Image
+//Pixel formats of ImageT. A format names the type a pixel is stored as and
+//converts between it and RGB, encode() is where a color gets quantized.
+
+//32-bit float per channel, the working format with no loss
+struct PixelFormatF32
+{
+	typedef RGB Pixel;
+	static Pixel encode(const RGB& c) { return c; }
+	static RGB decode(const Pixel& p) { return p; }
+};
+
+//IEEE 754 binary16, round to nearest even, out of range values become infinity
+inline uint16_t floatToHalf(float f)
+{
+	uint32_t x;
+	memcpy(&x, &f, sizeof(x));
+	uint32_t sign = (x >> 16) & 0x8000;
+	uint32_t absx = x & 0x7fffffff;
+
+	//infinity and nan, nan stays quiet
+	if (absx >= 0x7f800000)
+		return (uint16_t)(sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0));
+	//rounds to a value above 65504
+	if (absx >= 0x477ff000)
+		return (uint16_t)(sign | 0x7c00);
+	//below 2^-14 the result is a denormal in steps of 2^-24
+	if (absx < 0x38800000)
+	{
+		float a;
+		memcpy(&a, &absx, sizeof(a));
+		return (uint16_t)(sign | lrintf(a * 16777216.0f));
+	}
+
+	//rebias the exponent from 127 to 15 and round the mantissa to 10 bits
+	return (uint16_t)(sign | ((absx + 0xc8000fff + ((absx >> 13) & 1)) >> 13));
+}
+
+inline float halfToFloat(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exponent = (h >> 10) & 0x1f;
+	uint32_t mantissa = h & 0x3ff;
+
+	uint32_t x;
+	if (exponent == 0x1f)
+		x = sign | 0x7f800000 | (mantissa << 13);
+	else if (exponent == 0)
+	{
+		float f = mantissa * (1.0f / 16777216.0f);
+		memcpy(&x, &f, sizeof(x));
+		x |= sign;
+	}
+	else
+		x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+	float f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+struct RGBHalf
+{
+	uint16_t r, g, b;
+};
+
+//16-bit float per channel, keeps values above 1 for later tone mapping
+struct PixelFormatF16
+{
+	typedef RGBHalf Pixel;
+	static Pixel encode(const RGB& c) { Pixel p = { floatToHalf(c.r), floatToHalf(c.g), floatToHalf(c.b) }; return p; }
+	static RGB decode(const Pixel& p) { RGB c = { halfToFloat(p.r), halfToFloat(p.g), halfToFloat(p.b) }; return c; }
+};
+
+struct RGB8
+{
+	uint8_t r, g, b;
+};
+
+//8-bit unsigned normalized per channel, quantized the same way writePPM always
+//has (clamped and truncated), so a PPM of this format is a byte copy
+struct PixelFormatU8
+{
+	typedef RGB8 Pixel;
+	static uint8_t quantize(float v) { clamp<float>(v, 0, 1); return (uint8_t)(v * 255); }
+	static Pixel encode(const RGB& c) { Pixel p = { quantize(c.r), quantize(c.g), quantize(c.b) }; return p; }
+	static RGB decode(const Pixel& p) { RGB c = { p.r / 255.0f, p.g / 255.0f, p.b / 255.0f }; return c; }
+};
+
+struct RGB16
+{
+	uint16_t r, g, b;
+};
+
+//16-bit unsigned normalized per channel, rounded to nearest
+struct PixelFormatU16
+{
+	typedef RGB16 Pixel;
+	static uint16_t quantize(float v) { clamp<float>(v, 0, 1); return (uint16_t)(v * 65535 + 0.5f); }
+	static Pixel encode(const RGB& c) { Pixel p = { quantize(c.r), quantize(c.g), quantize(c.b) }; return p; }
+	static RGB decode(const Pixel& p) { RGB c = { p.r / 65535.0f, p.g / 65535.0f, p.b / 65535.0f }; return c; }
+};
+
+//the sRGB transfer function and its inverse on [0, 1]
+inline float linearToSRGB(float v)
+{
+    return v <= 0.0031308f ? 12.92f * v : 1.055f * powf(v, 1 / 2.4f) - 0.055f;
+}
+
+inline float srgbToLinear(float v)
+{
+    return v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+}
+
+//linear value of an sRGB encoded byte
+inline float srgb8ToLinear(uint8_t v)
+{
+    struct Table
+    {
+        Table() { for (int i = 0; i < 256; i++) entries[i] = srgbToLinear(i / 255.0f); }
+        float entries[256];
+    };
+    static const Table table;
+    return table.entries[v];
+}
+
+// Represents a basic image holding R, G and B data in the pixel format [Format].
+// pixels is the storage itself, renderers write encoded pixels straight into it.
+template <typename Format>
+class ImageT
 {
 private:
 	int w, h;
 public:
+	typedef typename Format::Pixel Pixel;
+
+	ImageT() : w(0), h(0), pixels(nullptr) {}
+	ImageT(int width, int height) : w(width), h(height), pixels(nullptr) { pixels = new Pixel[w * h]; memset(pixels, 0, sizeof(Pixel) * w * h); }
+	~ImageT() { if (pixels) delete[] pixels; }
 
-	Image() : w(0), h(0), pixels(nullptr) {}
-	Image(int width, int height) : w(width), h(height), pixels(nullptr) { pixels = new RGB[w * h]; memset(pixels, 0, sizeof(RGB) * w * h); }
-	~Image() { if (pixels) delete[] pixels; }
+	ImageT(const ImageT&) = delete;
+	ImageT& operator = (const ImageT&) = delete;
 
 	int getWidth() const { return w;  }
 	int getHeight() const { return h; }
     
-    void fill(RGB color) const { for (int i = 0; i < w * h; i++) { pixels[i] = color; } }
+    void fill(RGB color) const { Pixel p = Format::encode(color); for (int i = 0; i < w * h; i++) { pixels[i] = p; } }
 
-	const RGB& operator[] (const unsigned int &i) const { return pixels[i]; }
-	RGB& operator[] (const unsigned int &i) { return pixels[i]; }
+	//reads and writes pixel [i] as RGB, converting from and to the pixel format
+	RGB get(const unsigned int &i) const { return Format::decode(pixels[i]); }
+	void set(const unsigned int &i, const RGB& color) { pixels[i] = Format::encode(color); }
 
-	RGB* pixels;
+	const Pixel& operator[] (const unsigned int &i) const { return pixels[i]; }
+	Pixel& operator[] (const unsigned int &i) { return pixels[i]; }
+
+	Pixel* pixels;
 
 	static const RGB kBlack, kWhite, kRed, kGreen, kBlue;
 };
 
-const RGB Image::kBlack = { 0, 0, 0 };
-const RGB Image::kWhite = { 1, 1, 1 };
-const RGB Image::kRed = { 1, 0, 0 };
-const RGB Image::kGreen = { 0, 1, 0 };
-const RGB Image::kBlue = { 0, 0, 1 };
+template <typename Format> const RGB ImageT<Format>::kBlack = { 0, 0, 0 };
+template <typename Format> const RGB ImageT<Format>::kWhite = { 1, 1, 1 };
+template <typename Format> const RGB ImageT<Format>::kRed = { 1, 0, 0 };
+template <typename Format> const RGB ImageT<Format>::kGreen = { 0, 1, 0 };
+template <typename Format> const RGB ImageT<Format>::kBlue = { 0, 0, 1 };
 
-//Tries to read a PPM image file.
-//string = path to file
-//returns a Image pointer on success and a NULL reference if failure
-//TODO: add error handling (e.g getImageIOError())
-Image* readPPM(const char* string)
+typedef ImageT<PixelFormatF32> Image;
+typedef ImageT<PixelFormatF16> ImageF16;
+typedef ImageT<PixelFormatU8> Image8;
+typedef ImageT<PixelFormatU16> Image16;
+
+//A PPM (P3, P6) or PGM (P2, P5) image file, memory-mapped. open() only parses the header
+//in place, the samples stay in the mapping until they are converted, so loading costs
+//little more than reading the file. Samples of binary files are one byte if maxval is
+//below 256 and two big-endian bytes otherwise; the one byte kind can be used as it is
+//through view8().
+class PNMImage
 {
-	if (!string)
-		return nullptr;
+public:
+    PNMImage() : width(0), height(0), channels(0), maxval(0), binary(false), samples(NULL) {}
 
-	FILE* file = fopen(string, "rb");
-	if (!file)
-		return nullptr;
-	/*char magic[3] = { 0 };
-	fread(magic, sizeof(char), sizeof(magic), file);
+    PNMImage(const PNMImage&) = delete;
+    PNMImage& operator = (const PNMImage&) = delete;
 
-	if (ferror)
-		return nullptr;
+    //Maps [path] and parses its header.
+    //returns false if the file cannot be read, is not a P2, P3, P5 or P6 file or is truncated
+    bool open(const char* path)
+    {
+        close();
+        if (!path || !file.open(path) || !parseHeader())
+        {
+            close();
+            return false;
+        }
+        return true;
+    }
 
-	if ((magic[0] != 'P' || magic[1] != '6'))
-		return nullptr;*/
-	unsigned long size = 0;
-	fseek(file, 0L, SEEK_END);
-	size = ftell(file);
-	fseek(file, 0L, SEEK_SET);
-	char* buffer = (char*)malloc(sizeof(char) * size);
-	if (!buffer)
-		return nullptr;
+    void close()
+    {
+        file.close();
+        width = height = channels = maxval = 0;
+        samples = NULL;
+    }
 
-	fread(buffer, sizeof(char), size, file);
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    //1 for gray (PGM), 3 for RGB (PPM)
+    int getChannels() const { return channels; }
+    int getMaxval() const { return maxval; }
+    bool isBinary() const { return binary; }
 
-	if (buffer[0] != 'P' || buffer[1] != '6') {
-		fclose(file);
-		free((void*)buffer);
-		return nullptr;
-	}
+    //bytes per sample and per row of a binary file
+    int getSampleSize() const { return maxval < 256 ? 1 : 2; }
+    size_t getRowSize() const { return (size_t)width * channels * getSampleSize(); }
 
-	char* size_offset = buffer + 3;
-	char* p = size_offset;
-	while (*p != '\n' && *p != ' ' && *p != '\t' && *p != '\0') {	
-		p++;
-	}
+    //The samples of a binary file with one byte samples as they are in the file, interleaved
+    //RGB or gray, getRowSize() bytes per row.
+    //returns NULL for ASCII and 16-bit files
+    const uint8_t* view8() const { return (binary && maxval < 256) ? samples : NULL; }
 
-	int width = atoi(size_offset);
-	int height = atoi(p);
+    //hints how the samples will be read, e.g. random for tiles
+    void advise(MappedFile::Access access) const
+    {
+        if (samples)
+            file.advise(access, samples - file.data());
+    }
 
-	p++;
-	while (*p != '\n' && *p != ' ' && *p != '\t' && *p != '\0') {
-		p++;
-	}
+    //Converts the image into [img], which must be getWidth() x getHeight(). Samples are
+    //divided by maxval and gray is replicated to RGB. Binary files are converted in bands of
+    //rows on [numThreads] threads, ASCII files are parsed serially.
+    //returns false if an ASCII file has a missing or malformed sample
+    template <typename Format>
+    bool convert(ImageT<Format>& img, unsigned numThreads = 0) const
+    {
+        if (!samples || img.getWidth() != width || img.getHeight() != height)
+            return false;
 
-	int maxval = atoi(p);
-	if (maxval > 255) {
-		fclose(file);
-		free((void*)buffer);
+        if (!binary)
+            return convertASCII(img);
+
+        //the faults of the first touch are the I/O, let the kernel read ahead of the threads
+        advise(MappedFile::kAccessSequential);
+
+        float lut[256];
+        for (int i = 0; i < 256; i++)
+            lut[i] = (float)i / maxval;
+
+        parallelFor(0, height, 16, [&](int y)
+        {
+            convertRow(y, lut, img);
+        }, numThreads);
+        return true;
+    }
+
+    //Reads [count] pixels of row [y] of a binary file starting at column [x] as 8-bit RGB,
+    //rescaled from maxval to 255
+    void readRow8(int y, int x, int count, RGB8* out) const
+    {
+        const uint8_t* row = samples + (size_t)y * getRowSize() + (size_t)x * channels * getSampleSize();
+        const int n = count * channels;
+        uint8_t* bytes = &out[0].r;
+
+        if (maxval == 255 && channels == 3)
+        {
+            memcpy(bytes, row, n);
+            return;
+        }
+
+        //rescaled and rounded in integers, the result is exact for maxval 255
+        const uint32_t half = maxval / 2;
+        if (channels == 3)
+        {
+            for (int i = 0; i < n; i++)
+                bytes[i] = rescale8(sample(row, i), half);
+        }
+        else
+        {
+            for (int i = 0; i < n; i++)
+                bytes[i * 3] = bytes[i * 3 + 1] = bytes[i * 3 + 2] = rescale8(sample(row, i), half);
+        }
+    }
+
+private:
+    //PNM does not limit numbers, capping them keeps every size computation inside 64 bits
+    static const uint32_t kMaxSize = 1 << 24;
+
+    bool parseHeader()
+    {
+        const uint8_t* p = file.data();
+        const uint8_t* end = p + file.size();
+        if (file.size() < 2 || p[0] != 'P')
+            return false;
+
+        switch (p[1])
+        {
+            case '2': channels = 1; binary = false; break;
+            case '3': channels = 3; binary = false; break;
+            case '5': channels = 1; binary = true; break;
+            case '6': channels = 3; binary = true; break;
+            default: return false;
+        }
+        p += 2;
+
+        uint32_t values[3];
+        for (int i = 0; i < 3; i++)
+        {
+            if (!parseNumber(p, end, values[i]))
+                return false;
+        }
+
+        //exactly one whitespace separates maxval from the samples
+        if (p == end || !isspace(*p))
+            return false;
+        p++;
+
+        if (values[0] == 0 || values[1] == 0 || values[2] == 0 || values[2] > 65535)
+            return false;
+
+        width = (int)values[0];
+        height = (int)values[1];
+        maxval = (int)values[2];
+        samples = p;
+
+        return !binary || (size_t)(end - samples) / height >= getRowSize();
+    }
+
+    //skips whitespace and comments, then reads a decimal number no larger than kMaxSize
+    static bool parseNumber(const uint8_t*& p, const uint8_t* end, uint32_t& value)
+    {
+        while (p != end && (*p == '#' || isspace(*p)))
+        {
+            if (*p == '#')
+                while (p != end && *p != '\n' && *p != '\r')
+                    p++;
+            else
+                p++;
+        }
+
+        if (p == end || !isdigit(*p))
+            return false;
+
+        value = 0;
+        while (p != end && isdigit(*p))
+        {
+            value = value * 10 + (*p++ - '0');
+            if (value > kMaxSize)
+                return false;
+        }
+        return true;
+    }
+
+    uint32_t sample(const uint8_t* row, int i) const
+    {
+        return maxval < 256 ? row[i] : ((uint32_t)row[2 * i] << 8) | row[2 * i + 1];
+    }
+
+    uint8_t rescale8(uint32_t v, uint32_t half) const
+    {
+        v = (v * 255 + half) / maxval;
+        return (uint8_t)(v > 255 ? 255 : v);
+    }
+
+    //row [y] as normalized floats, 3 per pixel, into [out]
+    void rowFloats(int y, const float* lut, float* out) const
+    {
+        const uint8_t* row = samples + (size_t)y * getRowSize();
+        const int n = width * channels;
+        const float scale = 1.0f / maxval;
+
+        if (channels == 3)
+        {
+            if (maxval < 256)
+                for (int i = 0; i < n; i++)
+                    out[i] = lut[row[i]];
+            else
+                for (int i = 0; i < n; i++)
+                    out[i] = (((uint32_t)row[2 * i] << 8) | row[2 * i + 1]) * scale;
+        }
+        else
+        {
+            for (int i = 0; i < n; i++)
+                out[i * 3] = out[i * 3 + 1] = out[i * 3 + 2] = maxval < 256 ? lut[row[i]] : sample(row, i) * scale;
+        }
+    }
+
+    template <typename Format>
+    void convertRow(int y, const float* lut, ImageT<Format>& img) const
+    {
+        std::vector<float> buffer((size_t)width * 3);
+        rowFloats(y, lut, &buffer[0]);
+        for (int x = 0; x < width; x++)
+        {
+            RGB c = { buffer[x * 3], buffer[x * 3 + 1], buffer[x * 3 + 2] };
+            img.set(y * width + x, c);
+        }
+    }
+
+    //float pixels are written in place
+    void convertRow(int y, const float* lut, Image& img) const
+    {
+        static_assert(sizeof(RGB) == 3 * sizeof(float), "RGB must be tightly packed");
+        rowFloats(y, lut, &img.pixels[(size_t)y * width].r);
+    }
+
+    //8-bit pixels are rescaled in integers, a byte copy for the common maxval of 255
+    void convertRow(int y, const float*, Image8& img) const
+    {
+        readRow8(y, 0, width, img.pixels + (size_t)y * width);
+    }
+
+    //P2 and P3, whitespace separated decimal samples
+    template <typename Format>
+    bool convertASCII(ImageT<Format>& img) const
+    {
+        const uint8_t* p = samples;
+        const uint8_t* end = file.data() + file.size();
+        const float scale = 1.0f / maxval;
+
+        for (size_t i = 0; i < (size_t)width * height; i++)
+        {
+            uint32_t v[3] = {};
+            for (int c = 0; c < channels; c++)
+            {
+                if (!parseNumber(p, end, v[c]))
+                    return false;
+            }
+            if (channels == 1)
+                v[1] = v[2] = v[0];
+
+            RGB color = { v[0] * scale, v[1] * scale, v[2] * scale };
+            img.set((unsigned int)i, color);
+        }
+        return true;
+    }
+
+    MappedFile file;
+    int width, height, channels, maxval;
+    bool binary;
+    const uint8_t* samples;
+};
+
+//Tries to read a PPM or PGM image file (P2, P3, P5 or P6, 8 or 16-bit samples).
+//string = path to file
+//returns a Image pointer on success and a NULL reference if failure, the caller owns the image
+inline Image* readPPM(const char* string, unsigned numThreads = 0)
+{
+	PNMImage pnm;
+	if (!pnm.open(string))
 		return nullptr;
-	}
 
-	p++;
-	while (*p != '\n' && *p != ' ' && *p != '\t' && *p != '\0') {
-		p++;
+	Image* img = new Image(pnm.getWidth(), pnm.getHeight());
+	if (!pnm.convert(*img, numThreads))
+	{
+		delete img;
+		return nullptr;
 	}
 
-	Image* img = new Image(width, height);
-	if (!img)
+	return img;
+}
+
+//Tries to read a PFM image file, color (PF) or gray (Pf), with the samples as they are, so
+//HDR radiance survives. PFM stores the rows bottom to top, the image is top to bottom.
+//returns a Image pointer on success and NULL on failure, the caller owns the image
+inline Image* readPFM(const char* path)
+{
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return nullptr;
+
+	char magic[3] = { 0 };
+	int w = 0, h = 0;
+	float scale = 0;
+	//exactly one whitespace separates the scale from the samples
+	if (fscanf(file, "%2s %d %d %f", magic, &w, &h, &scale) != 4 || !isspace(fgetc(file)) ||
+	    magic[0] != 'P' || (magic[1] != 'F' && magic[1] != 'f') || w <= 0 || h <= 0 || w > (1 << 16) || h > (1 << 16) || scale == 0)
 	{
 		fclose(file);
-		free((void*)buffer);
 		return nullptr;
 	}
 
-	char* pixel_buff = p+1;
-	for (int i = 0; i < (width*height*3); i+=3)
+	const int channels = magic[1] == 'F' ? 3 : 1;
+	//a negative scale marks little-endian samples
+	const uint16_t one = 1;
+	const bool swap = (scale < 0) != (*(const uint8_t*)&one == 1);
+
+	Image* img = new Image(w, h);
+	std::vector<float> row((size_t)w * channels);
+	for (int y = h - 1; y >= 0; y--)
 	{
-		unsigned char r = pixel_buff[i];
-		unsigned char g = pixel_buff[i + 1];
-		unsigned char b = pixel_buff[i + 2];
-		RGB pixel = { (float)(r/maxval), (float)(g/maxval), (float)(b/maxval) };
-		img->pixels[i/3] = pixel;
+		if (fread(&row[0], sizeof(float), row.size(), file) != row.size())
+		{
+			delete img;
+			fclose(file);
+			return nullptr;
+		}
+
+		for (size_t i = 0; swap && i < row.size(); i++)
+		{
+			uint32_t v;
+			memcpy(&v, &row[i], sizeof(v));
+			v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+			memcpy(&row[i], &v, sizeof(v));
+		}
+
+		for (int x = 0; x < w; x++)
+		{
+			const float* s = &row[(size_t)x * channels];
+			RGB c = { s[0], s[channels > 1 ? 1 : 0], s[channels > 1 ? 2 : 0] };
+			img->set(y * w + x, c);
+		}
 	}
 
 	fclose(file);
-
 	return img;
 }
 
+//converts [n] pixels of a row to 8-bit RGB bytes as PPM, QOI and PNG store them,
+//returns the bytes, which is either [buffer] or the row itself
+template <typename Format>
+inline const unsigned char* rowToBytes(const typename Format::Pixel* row, int n, unsigned char* buffer)
+{
+	for (int i = 0; i < n; i++)
+	{
+		RGB8 p = PixelFormatU8::encode(Format::decode(row[i]));
+		buffer[i * 3] = p.r;
+		buffer[i * 3 + 1] = p.g;
+		buffer[i * 3 + 2] = p.b;
+	}
+	return buffer;
+}
+
+//8-bit pixels are already laid out as PPM bytes
+template <>
+inline const unsigned char* rowToBytes<PixelFormatU8>(const RGB8* row, int, unsigned char*)
+{
+	static_assert(sizeof(RGB8) == 3, "RGB8 must be tightly packed");
+	return (const unsigned char*)row;
+}
+
 //tries to write a PPM file from an Image class
 //writes with 255 maxval (1-byte per color component)
 //returns 0 if success, otherwise non-zero.
-int writePPM(const char* dest, const Image& img) {
+template <typename Format>
+int writePPM(const char* dest, const ImageT<Format>& img) {
     
 	FILE* file = fopen(dest, "wb+");
 	if (!file)
@@ -170,24 +602,340 @@ int writePPM(const char* dest, const Image& img) {
     char maxval[4] = { '2', '5', '5', ' '};
     fwrite(maxval, sizeof(char), sizeof(maxval), file);
     
-    char pixel_buff[3] = { 0 };
-    for(int i = 0; i < w * h; i++)
-    {
-        RGB pixel = img.pixels[i];
-        
-        clamp<float>(pixel.r, 0, 1);
-        clamp<float>(pixel.g, 0, 1);
-        clamp<float>(pixel.b, 0, 1);
-        
-        pixel_buff[0] = pixel.r * 255;
-        pixel_buff[1] = pixel.g * 255;
-        pixel_buff[2] = pixel.b * 255;
-        fwrite(pixel_buff, sizeof(char), sizeof(pixel_buff), file);
+    //one row at a time, converted into a row sized buffer
+    unsigned char* row_buff = new unsigned char[w * 3];
+    int result = 0;
+    for(int y = 0; y < h; y++)
+    {
+        const unsigned char* bytes = rowToBytes<Format>(img.pixels + (size_t)y * w, w, row_buff);
+        if (fwrite(bytes, sizeof(char), w * 3, file) != (size_t)w * 3)
+        {
+            result = -1;
+            break;
+        }
     }
+    delete[] row_buff;
     
-	fclose(file);
+	if (fclose(file) != 0)
+		result = -1;
+
+	return result;
+}
+
+//Splits [height] rows into strips for parallel encoding, a few per thread so uneven
+//strips balance out, but never so small that compression suffers
+inline int numEncodeStrips(int height, unsigned numThreads)
+{
+    int strips = (int)resolveThreadCount(numThreads) * 2;
+    return std::max(1, std::min(strips, height / 16));
+}
+
+inline void putBE32(std::vector<uint8_t>& out, uint32_t v)
+{
+    out.push_back((uint8_t)(v >> 24));
+    out.push_back((uint8_t)(v >> 16));
+    out.push_back((uint8_t)(v >> 8));
+    out.push_back((uint8_t)v);
+}
+
+//writes all pieces in order, returns 0 if success, otherwise non-zero.
+inline int writePieces(const char* dest, const std::vector<std::vector<uint8_t> >& pieces)
+{
+    FILE* file = fopen(dest, "wb");
+    if (!file)
+        return -1;
+
+    int result = 0;
+    for (size_t i = 0; i < pieces.size() && result == 0; i++)
+    {
+        if (!pieces[i].empty() && fwrite(&pieces[i][0], 1, pieces[i].size(), file) != pieces[i].size())
+            result = -1;
+    }
 
-	return 0;
+    if (fclose(file) != 0)
+        result = -1;
+    return result;
 }
 
+//tries to write a QOI file ("Quite OK Image" format, qoiformat.org) from an Image class.
+//Strips of rows are encoded on separate threads. A strip starts in the decoder state the
+//previous strips leave behind: the previous pixel is the last pixel before the strip, and
+//the color index is rebuilt from the pixels before it. Slots not found within one strip
+//length are left unknown and never referenced, so the output stays valid.
+//returns 0 if success, otherwise non-zero.
+template <typename Format>
+int writeQOI(const char* dest, const ImageT<Format>& img, unsigned numThreads = 0)
+{
+    const int w = img.getWidth();
+    const int h = img.getHeight();
+    const int numStrips = numEncodeStrips(h, numThreads);
+
+    //pixels as bytes, 8-bit images are used in place
+    auto pixelBytes = [&](int y, std::vector<unsigned char>& buffer)
+    {
+        buffer.resize((size_t)w * 3);
+        return rowToBytes<Format>(img.pixels + (size_t)y * w, w, &buffer[0]);
+    };
+
+    std::vector<std::vector<uint8_t> > pieces(numStrips + 2);
+
+    std::vector<uint8_t>& header = pieces[0];
+    const char magic[4] = { 'q', 'o', 'i', 'f' };
+    header.insert(header.end(), magic, magic + 4);
+    putBE32(header, w);
+    putBE32(header, h);
+    header.push_back(3);
+    header.push_back(0);
+
+    parallelFor(0, numStrips, 1, [&](int strip)
+    {
+        int y0 = h * strip / numStrips;
+        int y1 = h * (strip + 1) / numStrips;
+        std::vector<uint8_t>& out = pieces[strip + 1];
+        out.reserve((size_t)(y1 - y0) * w * 2);
+
+        //the alpha of every pixel is 255, the index holds RGB
+        uint8_t index[64][3];
+        bool known[64] = { false };
+        uint8_t prev[3] = { 0, 0, 0 };
+
+        std::vector<unsigned char> buffer;
+        if (y0 > 0)
+        {
+            memcpy(prev, pixelBytes(y0 - 1, buffer) + (w - 1) * 3, 3);
+            int found = 0;
+            for (int y = y0 - 1; y >= std::max(0, y0 - (y1 - y0)) && found < 64; y--)
+            {
+                const unsigned char* row = pixelBytes(y, buffer);
+                for (int x = w - 1; x >= 0 && found < 64; x--)
+                {
+                    const unsigned char* p = row + x * 3;
+                    int slot = (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+                    if (!known[slot])
+                    {
+                        memcpy(index[slot], p, 3);
+                        known[slot] = true;
+                        found++;
+                    }
+                }
+            }
+        }
+
+        int run = 0;
+        for (int y = y0; y < y1; y++)
+        {
+            const unsigned char* row = pixelBytes(y, buffer);
+            for (int x = 0; x < w; x++)
+            {
+                const unsigned char* p = row + x * 3;
+                if (p[0] == prev[0] && p[1] == prev[1] && p[2] == prev[2])
+                {
+                    if (++run == 62)
+                    {
+                        out.push_back((uint8_t)(0xc0 | (run - 1)));
+                        run = 0;
+                    }
+                    continue;
+                }
+
+                if (run > 0)
+                {
+                    out.push_back((uint8_t)(0xc0 | (run - 1)));
+                    run = 0;
+                }
+
+                int slot = (p[0] * 3 + p[1] * 5 + p[2] * 7 + 255 * 11) % 64;
+                if (known[slot] && index[slot][0] == p[0] && index[slot][1] == p[1] && index[slot][2] == p[2])
+                {
+                    out.push_back((uint8_t)slot);
+                }
+                else
+                {
+                    memcpy(index[slot], p, 3);
+                    known[slot] = true;
+
+                    int8_t dr = (int8_t)(p[0] - prev[0]);
+                    int8_t dg = (int8_t)(p[1] - prev[1]);
+                    int8_t db = (int8_t)(p[2] - prev[2]);
+                    int8_t drg = (int8_t)(dr - dg);
+                    int8_t dbg = (int8_t)(db - dg);
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                    {
+                        out.push_back((uint8_t)(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                    }
+                    else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7)
+                    {
+                        out.push_back((uint8_t)(0x80 | (dg + 32)));
+                        out.push_back((uint8_t)((drg + 8) << 4 | (dbg + 8)));
+                    }
+                    else
+                    {
+                        out.push_back(0xfe);
+                        out.insert(out.end(), p, p + 3);
+                    }
+                }
+                memcpy(prev, p, 3);
+            }
+        }
+
+        //a run never continues into the next strip
+        if (run > 0)
+            out.push_back((uint8_t)(0xc0 | (run - 1)));
+    }, numThreads);
+
+    const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    pieces.back().assign(end, end + 8);
+
+    return writePieces(dest, pieces);
+}
+
+//appends a PNG chunk of [type] and [data] to [out]
+inline void appendPNGChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t size)
+{
+    putBE32(out, (uint32_t)size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    if (size)
+        out.insert(out.end(), data, data + size);
+    putBE32(out, crc32(&out[start], size + 4));
+}
+
+//PNG filter of one row of [n] bytes with 3 bytes per pixel. Every filter type is tried and
+//the one with the smallest sum of absolute residuals wins (the heuristic of the PNG spec).
+//[above] is the previous row or NULL for the first row, [scratch] holds 5 * n bytes.
+//[out] receives the filter type byte followed by the residuals.
+inline void filterPNGRow(const unsigned char* row, const unsigned char* above, int n,
+                         uint8_t* scratch, uint8_t* out)
+{
+    //None, Sub, Up, Average and Paeth; left of the first pixel and above the first row is 0
+    uint8_t* r[5];
+    for (int type = 0; type < 5; type++)
+        r[type] = scratch + (size_t)type * n;
+
+    for (int i = 0; i < n; i++)
+    {
+        int a = i >= 3 ? row[i - 3] : 0;
+        int b = above ? above[i] : 0;
+        int c = (above && i >= 3) ? above[i - 3] : 0;
+
+        int p = a + b - c;
+        int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        int paeth = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+
+        r[0][i] = row[i];
+        r[1][i] = (uint8_t)(row[i] - a);
+        r[2][i] = (uint8_t)(row[i] - b);
+        r[3][i] = (uint8_t)(row[i] - ((a + b) >> 1));
+        r[4][i] = (uint8_t)(row[i] - paeth);
+    }
+
+    uint8_t* best = r[0];
+    uint32_t bestCost = 0xffffffff;
+    for (int type = 0; type < 5; type++)
+    {
+        //residuals as signed bytes, the cost is their magnitude
+        uint32_t cost = 0;
+        for (int i = 0; i < n; i++)
+            cost += (uint32_t)abs((int8_t)r[type][i]);
+        if (cost < bestCost)
+        {
+            bestCost = cost;
+            best = r[type];
+            out[0] = (uint8_t)type;
+        }
+    }
+    memcpy(out + 1, best, n);
+}
+
+//tries to write a PNG file (8-bit RGB) from an Image class, compressed with the built-in
+//deflate (deflate.h). Strips of rows are filtered and compressed on separate threads into
+//independent pieces of one zlib stream, each piece in its own IDAT chunk; the Adler-32 of
+//the whole stream is combined from the checksums of the pieces.
+//returns 0 if success, otherwise non-zero.
+template <typename Format>
+int writePNG(const char* dest, const ImageT<Format>& img, unsigned numThreads = 0)
+{
+    const int w = img.getWidth();
+    const int h = img.getHeight();
+    const int n = w * 3;
+    const int numStrips = numEncodeStrips(h, numThreads);
+
+    std::vector<std::vector<uint8_t> > pieces(numStrips + 2);
+    std::vector<uint32_t> adlers(numStrips);
+    std::vector<size_t> lengths(numStrips);
+
+    std::vector<uint8_t>& header = pieces[0];
+    const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    header.assign(signature, signature + 8);
+    std::vector<uint8_t> ihdr;
+    putBE32(ihdr, w);
+    putBE32(ihdr, h);
+    //8 bits per channel, RGB, deflate, adaptive filtering, no interlace
+    const uint8_t format[5] = { 8, 2, 0, 0, 0 };
+    ihdr.insert(ihdr.end(), format, format + 5);
+    appendPNGChunk(header, "IHDR", &ihdr[0], ihdr.size());
+
+    parallelFor(0, numStrips, 1, [&](int strip)
+    {
+        int y0 = h * strip / numStrips;
+        int y1 = h * (strip + 1) / numStrips;
+
+        std::vector<uint8_t> filtered((size_t)(y1 - y0) * (n + 1));
+        std::vector<unsigned char> rowBuffer(n), aboveBuffer(n);
+        std::vector<uint8_t> scratch((size_t)n * 5);
+        const unsigned char* above = y0 > 0 ? rowToBytes<Format>(img.pixels + (size_t)(y0 - 1) * w, w, &aboveBuffer[0]) : NULL;
+        for (int y = y0; y < y1; y++)
+        {
+            const unsigned char* row = rowToBytes<Format>(img.pixels + (size_t)y * w, w, &rowBuffer[0]);
+            filterPNGRow(row, above, n, &scratch[0], &filtered[(size_t)(y - y0) * (n + 1)]);
+            //the converted row becomes the row above, 8-bit rows are read in place
+            if (row == &rowBuffer[0])
+            {
+                rowBuffer.swap(aboveBuffer);
+                above = &aboveBuffer[0];
+            }
+            else
+                above = row;
+        }
+
+        adlers[strip] = adler32(filtered.empty() ? NULL : &filtered[0], filtered.size());
+        lengths[strip] = filtered.size();
+
+        std::vector<uint8_t> compressed;
+        if (strip == 0)
+        {
+            //zlib header: deflate with a 32K window, no preset dictionary, fastest level
+            compressed.push_back(0x78);
+            compressed.push_back(0x01);
+        }
+        Deflate::compress(filtered.empty() ? NULL : &filtered[0], filtered.size(), strip == numStrips - 1, compressed);
+        appendPNGChunk(pieces[strip + 1], "IDAT", &compressed[0], compressed.size());
+    }, numThreads);
+
+    uint32_t adler = 1;
+    for (int strip = 0; strip < numStrips; strip++)
+        adler = adler32Combine(adler, adlers[strip], lengths[strip]);
+
+    std::vector<uint8_t> trailer;
+    putBE32(trailer, adler);
+    appendPNGChunk(pieces.back(), "IDAT", &trailer[0], trailer.size());
+    appendPNGChunk(pieces.back(), "IEND", NULL, 0);
+
+    return writePieces(dest, pieces);
+}
+
+//writes [img] in the format given by the extension of [dest], .png, .qoi or otherwise PPM
+//returns 0 if success, otherwise non-zero.
+template <typename Format>
+int writeImage(const char* dest, const ImageT<Format>& img, unsigned numThreads = 0)
+{
+    const char* ext = strrchr(dest, '.');
+    if (ext && (!strcmp(ext, ".png") || !strcmp(ext, ".PNG")))
+        return writePNG(dest, img, numThreads);
+    if (ext && (!strcmp(ext, ".qoi") || !strcmp(ext, ".QOI")))
+        return writeQOI(dest, img, numThreads);
+    return writePPM(dest, img);
+}
+
+
 #endif
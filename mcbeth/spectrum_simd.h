@@ -0,0 +1,233 @@
+//
+//  spectrum_simd.h
+//  theraytracer
+//
+//  Hero-wavelength spectral integration kernel. One uniform number
+//  places a group of 4 (SSE) or 8 (AVX2) stratified wavelengths
+//  (Wilkie et al. 2014, "Hero Wavelength Spectral Sampling"), which
+//  are evaluated together in SIMD lanes from padded, aligned tables.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef spectrum_simd_h
+#define spectrum_simd_h
+
+#include <stdint.h>
+#include <math.h>
+#include "spectrum.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HERO_SSE 1
+#endif
+
+//A group of single-precision lanes, one hero wavelength per lane in the spectral
+//kernel, also the vector type of the image finalization pass (tonemap.h) and of the
+//camworks rasterizer
+#if defined(__AVX2__)
+
+struct HeroFloat
+{
+    static const int kLanes = 8;
+    
+    HeroFloat() {}
+    HeroFloat(__m256 vv) : v(vv) {}
+    HeroFloat(float f) : v(_mm256_set1_ps(f)) {}
+    
+    static HeroFloat lanes() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+    
+    HeroFloat operator + (const HeroFloat& r) const { return _mm256_add_ps(v, r.v); }
+    HeroFloat operator - (const HeroFloat& r) const { return _mm256_sub_ps(v, r.v); }
+    HeroFloat operator * (const HeroFloat& r) const { return _mm256_mul_ps(v, r.v); }
+    HeroFloat operator / (const HeroFloat& r) const { return _mm256_div_ps(v, r.v); }
+    
+    static HeroFloat min(const HeroFloat& a, const HeroFloat& b) { return _mm256_min_ps(a.v, b.v); }
+    static HeroFloat max(const HeroFloat& a, const HeroFloat& b) { return _mm256_max_ps(a.v, b.v); }
+    
+    static HeroFloat load(const float* f) { return _mm256_loadu_ps(f); }
+    void store(float* f) const { _mm256_storeu_ps(f, v); }
+    //bit i is set if lane i has its sign bit set (negative or -0)
+    int signMask() const { return _mm256_movemask_ps(v); }
+    
+    HeroFloat floor() const { return _mm256_floor_ps(v); }
+    //linear interpolation in table [f] at continuous indices [b], f must be padded by one entry
+    static HeroFloat lerpGather(const float* f, const HeroFloat& b)
+    {
+        HeroFloat fl = b.floor();
+        __m256i i = _mm256_cvttps_epi32(fl.v);
+        HeroFloat a = _mm256_i32gather_ps(f, i, 4);
+        HeroFloat c = _mm256_i32gather_ps(f + 1, i, 4);
+        HeroFloat t = b - fl;
+        return a + (c - a) * t;
+    }
+    
+    float sum() const
+    {
+        __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+    
+    __m256 v;
+};
+
+#elif defined(HERO_SSE)
+
+struct HeroFloat
+{
+    static const int kLanes = 4;
+    
+    HeroFloat() {}
+    HeroFloat(__m128 vv) : v(vv) {}
+    HeroFloat(float f) : v(_mm_set1_ps(f)) {}
+    
+    static HeroFloat lanes() { return _mm_setr_ps(0, 1, 2, 3); }
+    
+    HeroFloat operator + (const HeroFloat& r) const { return _mm_add_ps(v, r.v); }
+    HeroFloat operator - (const HeroFloat& r) const { return _mm_sub_ps(v, r.v); }
+    HeroFloat operator * (const HeroFloat& r) const { return _mm_mul_ps(v, r.v); }
+    HeroFloat operator / (const HeroFloat& r) const { return _mm_div_ps(v, r.v); }
+    
+    static HeroFloat min(const HeroFloat& a, const HeroFloat& b) { return _mm_min_ps(a.v, b.v); }
+    static HeroFloat max(const HeroFloat& a, const HeroFloat& b) { return _mm_max_ps(a.v, b.v); }
+    
+    static HeroFloat load(const float* f) { return _mm_loadu_ps(f); }
+    void store(float* f) const { _mm_storeu_ps(f, v); }
+    int signMask() const { return _mm_movemask_ps(v); }
+    
+    //inputs are non-negative, so truncation is floor
+    HeroFloat floor() const { return _mm_cvtepi32_ps(_mm_cvttps_epi32(v)); }
+    //linear interpolation in table [f] at continuous indices [b], f must be padded by one entry.
+    //SSE has no gather, the two neighbours of each lane are loaded as one unaligned pair
+    static HeroFloat lerpGather(const float* f, const HeroFloat& b)
+    {
+        __m128i i = _mm_cvttps_epi32(b.v);
+        HeroFloat t = b - HeroFloat(_mm_cvtepi32_ps(i));
+        
+        alignas(16) int32_t idx[4];
+        _mm_store_si128((__m128i*)idx, i);
+        __m128 p01 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(f + idx[0])), (const __m64*)(f + idx[1]));
+        __m128 p23 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(f + idx[2])), (const __m64*)(f + idx[3]));
+        HeroFloat a = _mm_shuffle_ps(p01, p23, _MM_SHUFFLE(2, 0, 2, 0));
+        HeroFloat c = _mm_shuffle_ps(p01, p23, _MM_SHUFFLE(3, 1, 3, 1));
+        return a + (c - a) * t;
+    }
+    
+    float sum() const
+    {
+        __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+        return _mm_cvtss_f32(s);
+    }
+    
+    __m128 v;
+};
+
+#else
+
+struct HeroFloat
+{
+    static const int kLanes = 4;
+    
+    HeroFloat() {}
+    HeroFloat(float f) { for (int i = 0; i < kLanes; i++) v[i] = f; }
+    
+    static HeroFloat lanes() { HeroFloat r; for (int i = 0; i < kLanes; i++) r.v[i] = (float)i; return r; }
+    
+    HeroFloat operator + (const HeroFloat& r) const { HeroFloat o; for (int i = 0; i < kLanes; i++) o.v[i] = v[i] + r.v[i]; return o; }
+    HeroFloat operator - (const HeroFloat& r) const { HeroFloat o; for (int i = 0; i < kLanes; i++) o.v[i] = v[i] - r.v[i]; return o; }
+    HeroFloat operator * (const HeroFloat& r) const { HeroFloat o; for (int i = 0; i < kLanes; i++) o.v[i] = v[i] * r.v[i]; return o; }
+    HeroFloat operator / (const HeroFloat& r) const { HeroFloat o; for (int i = 0; i < kLanes; i++) o.v[i] = v[i] / r.v[i]; return o; }
+    
+    static HeroFloat min(const HeroFloat& a, const HeroFloat& b) { HeroFloat o; for (int i = 0; i < kLanes; i++) o.v[i] = std::min(a.v[i], b.v[i]); return o; }
+    static HeroFloat max(const HeroFloat& a, const HeroFloat& b) { HeroFloat o; for (int i = 0; i < kLanes; i++) o.v[i] = std::max(a.v[i], b.v[i]); return o; }
+    
+    static HeroFloat load(const float* f) { HeroFloat o; for (int i = 0; i < kLanes; i++) o.v[i] = f[i]; return o; }
+    void store(float* f) const { for (int i = 0; i < kLanes; i++) f[i] = v[i]; }
+    int signMask() const { int m = 0; for (int i = 0; i < kLanes; i++) m |= (signbit(v[i]) ? 1 : 0) << i; return m; }
+    
+    HeroFloat floor() const { HeroFloat o; for (int i = 0; i < kLanes; i++) o.v[i] = floorf(v[i]); return o; }
+    static HeroFloat lerpGather(const float* f, const HeroFloat& b)
+    {
+        HeroFloat o;
+        for (int i = 0; i < kLanes; i++)
+        {
+            int j = (int)b.v[i];
+            float t = b.v[i] - j;
+            o.v[i] = f[j] + (f[j + 1] - f[j]) * t;
+        }
+        return o;
+    }
+    
+    float sum() const { float s = 0; for (int i = 0; i < kLanes; i++) s += v[i]; return s; }
+    
+    float v[kLanes];
+};
+
+#endif
+
+//The tables of SpectralTables premultiplied by the illuminant, laid out for the
+//hero kernel: 32-byte aligned rows padded so the upper neighbour of the last
+//sample (and whole vectors past it) can always be read
+class HeroTables
+{
+public:
+    static const int kNumSamples = SpectralTables::kNumSamples;
+    static const int kStride = (kNumSamples + 1 + 7) & ~7;
+    
+    HeroTables(Illuminant illuminant = kIlluminantE)
+    {
+        SpectralTables tables;
+        for (int i = 0; i < kStride; i++)
+        {
+            int j = std::min(i, kNumSamples - 1);
+            float light = (illuminant == kIlluminantD65) ? tables.illuminant[j] / 100.0f : 1.0f;
+            for (int c = 0; c < 3; c++)
+                cmf[c][i] = tables.cmf[c][j] * light;
+            for (int p = 0; p < 24; p++)
+                reflectance[p][i] = tables.reflectance[p][j];
+        }
+    }
+    
+    alignas(32) float cmf[3][kStride];
+    alignas(32) float reflectance[24][kStride];
+};
+
+//Monte Carlo estimate of the XYZ color of patch [patch] from [numGroups] groups of
+//HeroFloat::kLanes wavelengths. Group g is placed by the uniform number u[g]: lane k
+//gets wavelength (u[g] + k / kLanes) mod 1 over the spectral range, so every group
+//covers the whole spectrum with one stratified wavelength per lane.
+//Normalized like PatchColorCache, a perfect white reflector has Y = 1.
+inline void spectrumToXYZHero(const HeroTables& tables, int patch, const float* u, int numGroups,
+                              float& X, float& Y, float& Z)
+{
+    const float kIndexScale = (kLambdaMax - kLambdaMin) / SpectralTables::kStep;
+    const HeroFloat laneOffsets = HeroFloat::lanes() * HeroFloat(1.0f / HeroFloat::kLanes);
+    
+    HeroFloat accX(0.0f), accY(0.0f), accZ(0.0f), accS(0.0f);
+    for (int g = 0; g < numGroups; g++)
+    {
+        HeroFloat r = HeroFloat(u[g]) + laneOffsets;
+        r = r - r.floor();
+        HeroFloat b = r * HeroFloat(kIndexScale);
+        
+        HeroFloat refl = HeroFloat::lerpGather(tables.reflectance[patch], b);
+        HeroFloat ybar = HeroFloat::lerpGather(tables.cmf[1], b);
+        accX = accX + HeroFloat::lerpGather(tables.cmf[0], b) * refl;
+        accY = accY + ybar * refl;
+        accZ = accZ + HeroFloat::lerpGather(tables.cmf[2], b) * refl;
+        accS = accS + ybar;
+    }
+    
+    //the (range / N) factor of every sum cancels in the normalization by S
+    float invS = 1.0f / accS.sum();
+    X = accX.sum() * invS;
+    Y = accY.sum() * invS;
+    Z = accZ.sum() * invS;
+}
+
+#endif /* spectrum_simd_h */
@@ -0,0 +1,192 @@
+//
+//  tonemap.h
+//  theraytracer
+//
+//  Image finalization: turns a linear float framebuffer into displayable
+//  8-bit pixels with exposure, a tone curve, the sRGB transfer function
+//  and ordered dithering, in one vectorized and multithreaded pass
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef tonemap_h
+#define tonemap_h
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include "image.h"
+#include "parallel.h"
+#include "spectrum_simd.h"
+
+//Compresses linear values (after exposure) into [0, 1], per channel
+enum ToneCurve
+{
+    //values above 1 saturate, the identity below
+    kToneCurveClamp,
+    //x / (1 + x)
+    kToneCurveReinhard,
+    //Narkowicz 2015 fit of the ACES filmic curve
+    kToneCurveACES,
+};
+
+//Encoding of the tone mapped values in the output bytes
+enum TransferFunction
+{
+    kTransferLinear,
+    kTransferSRGB,
+};
+
+struct FinalizeOptions
+{
+    //in stops, the framebuffer is scaled by 2^exposure
+    float exposure = 0;
+    ToneCurve toneCurve = kToneCurveClamp;
+    TransferFunction transfer = kTransferSRGB;
+    //adds an 8x8 Bayer threshold before quantizing instead of rounding, hides banding
+    bool dither = true;
+};
+
+//returns false if [name] (clamp, reinhard or aces) is not a tone curve
+inline bool parseToneCurve(const char* name, ToneCurve& curve)
+{
+    if (!strcmp(name, "clamp"))
+        curve = kToneCurveClamp;
+    else if (!strcmp(name, "reinhard"))
+        curve = kToneCurveReinhard;
+    else if (!strcmp(name, "aces"))
+        curve = kToneCurveACES;
+    else
+        return false;
+    return true;
+}
+
+//The finalization pass. The transfer function is a table of kLUTSize intervals over
+//[0, 1] in units of output codes, interpolated linearly, which keeps the steep start
+//of the sRGB curve accurate to well below a code.
+//The channels of a pixel are independent, so a row is processed as one flat array of
+//floats, HeroFloat::kLanes at a time; the dither thresholds repeat every 8 pixels, 24
+//floats, which is a whole number of vectors for both 4 and 8 lanes.
+class Finalizer
+{
+public:
+    static const int kLUTSize = 4096;
+    static const int kDitherPeriod = 24;
+
+    Finalizer(const FinalizeOptions& o = FinalizeOptions()) : options(o)
+    {
+        //one entry of padding for the upper neighbour of 1.0
+        for (int i = 0; i <= kLUTSize + 1; i++)
+        {
+            float v = std::min(1.0f, (float)i / kLUTSize);
+            transfer[i] = 255 * (options.transfer == kTransferSRGB ? linearToSRGB(v) : v);
+        }
+
+        for (int y = 0; y < 8; y++)
+        {
+            for (int i = 0; i < kDitherPeriod; i++)
+            {
+                int x = i / 3;
+                //bit interleaved Bayer index, the low bits of x and y are the most significant
+                int index = 0;
+                for (int bit = 0; bit < 3; bit++)
+                {
+                    int xb = (x >> bit) & 1, yb = (y >> bit) & 1;
+                    index |= (((xb ^ yb) << 1) | yb) << (2 * (2 - bit));
+                }
+                //thresholds in (-0.5, 0.5), plus the 0.5 that turns the floor into rounding
+                threshold[y][i] = options.dither ? (index + 0.5f) / 64 : 0.5f;
+            }
+        }
+    }
+
+    //Finalizes [src] into [dst], which must have the same size
+    template <typename Format>
+    void run(const ImageT<Format>& src, Image8& dst, unsigned numThreads = 0) const
+    {
+        const int width = src.getWidth();
+        const int n = width * 3;
+        const float scale = powf(2.0f, options.exposure);
+
+        parallelFor(0, src.getHeight(), 8, [&](int y)
+        {
+            std::vector<float> decoded;
+            const float* in = rowFloats(src, y, decoded);
+            uint8_t* out = (uint8_t*)(dst.pixels + (size_t)y * width);
+            const float* dither = threshold[y & 7];
+
+            alignas(32) float codes[HeroFloat::kLanes];
+            for (int i = 0; i < n; i += HeroFloat::kLanes)
+            {
+                int count = (n - i < HeroFloat::kLanes) ? n - i : HeroFloat::kLanes;
+                HeroFloat v;
+                if (count == HeroFloat::kLanes)
+                    v = HeroFloat::load(in + i);
+                else
+                {
+                    alignas(32) float tail[HeroFloat::kLanes] = { 0 };
+                    memcpy(tail, in + i, count * sizeof(float));
+                    v = HeroFloat::load(tail);
+                }
+
+                v = toneMap(v * HeroFloat(scale));
+                HeroFloat code = HeroFloat::lerpGather(transfer, v * HeroFloat((float)kLUTSize));
+                (code + HeroFloat::load(dither + i % kDitherPeriod)).store(codes);
+
+                //codes are in [0, 256), truncation is the floor
+                for (int k = 0; k < count; k++)
+                    out[i + k] = (uint8_t)codes[k];
+            }
+        }, numThreads);
+    }
+
+    FinalizeOptions options;
+
+private:
+    //[v] is scaled linear radiance, returns it tone mapped and clamped to [0, 1]
+    HeroFloat toneMap(HeroFloat v) const
+    {
+        v = HeroFloat::max(v, HeroFloat(0.0f));
+        switch (options.toneCurve)
+        {
+            case kToneCurveReinhard:
+                v = v / (v + HeroFloat(1.0f));
+                break;
+
+            case kToneCurveACES:
+                v = (v * (v * HeroFloat(2.51f) + HeroFloat(0.03f))) /
+                    (v * (v * HeroFloat(2.43f) + HeroFloat(0.59f)) + HeroFloat(0.14f));
+                break;
+
+            default:
+                break;
+        }
+        return HeroFloat::min(v, HeroFloat(1.0f));
+    }
+
+    //row [y] of [img] as 3 * width floats, float32 images are read in place
+    template <typename Format>
+    static const float* rowFloats(const ImageT<Format>& img, int y, std::vector<float>& buffer)
+    {
+        buffer.resize((size_t)img.getWidth() * 3);
+        for (int x = 0; x < img.getWidth(); x++)
+        {
+            RGB c = img.get(y * img.getWidth() + x);
+            buffer[x * 3] = c.r;
+            buffer[x * 3 + 1] = c.g;
+            buffer[x * 3 + 2] = c.b;
+        }
+        return &buffer[0];
+    }
+
+    static const float* rowFloats(const Image& img, int y, std::vector<float>&)
+    {
+        static_assert(sizeof(RGB) == 3 * sizeof(float), "RGB must be tightly packed");
+        return &img.pixels[(size_t)y * img.getWidth()].r;
+    }
+
+    alignas(32) float transfer[kLUTSize + 2];
+    alignas(32) float threshold[8][kDitherPeriod];
+};
+
+#endif /* tonemap_h */
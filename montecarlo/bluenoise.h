@@ -0,0 +1,135 @@
+//
+//  bluenoise.h
+//  theraytracer
+//
+//  Generates a tileable blue-noise threshold mask with the
+//  void-and-cluster method (Ulichney 1993)
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef bluenoise_h
+#define bluenoise_h
+
+#include <stdint.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include "random.h"
+
+//A [size] x [size] toroidal mask where every pixel holds its rank in [0, 1).
+//Thresholding it at any level gives evenly spread pixels without low-frequency clumps.
+class BlueNoiseMask
+{
+public:
+    BlueNoiseMask(uint32_t s = 64, float sigma = 1.5f) : size(s), rank(s * s)
+    {
+        generate(sigma);
+    }
+    
+    float get(uint32_t x, uint32_t y) const { return rank[(x % size) + (y % size) * size]; }
+    
+    uint32_t size;
+    std::vector<float> rank;
+    
+private:
+    //adds (or removes with sign -1) the gaussian splat of pixel [p] to the energy field
+    void splat(std::vector<float>& energy, const std::vector<float>& kernel, uint32_t p, float sign) const
+    {
+        int px = p % size;
+        int py = p / size;
+        for (uint32_t y = 0; y < size; y++)
+        {
+            uint32_t dy = std::min<uint32_t>((y - py + size) % size, (py - y + size) % size);
+            for (uint32_t x = 0; x < size; x++)
+            {
+                uint32_t dx = std::min<uint32_t>((x - px + size) % size, (px - x + size) % size);
+                energy[x + y * size] += sign * kernel[dx + dy * size];
+            }
+        }
+    }
+    
+    //returns the tightest cluster (set pixel with most energy) or largest void (empty pixel with least energy)
+    uint32_t find(const std::vector<float>& energy, const std::vector<uint8_t>& set, bool cluster) const
+    {
+        uint32_t best = 0;
+        float bestEnergy = cluster ? -INFINITY : INFINITY;
+        for (uint32_t i = 0; i < size * size; i++)
+        {
+            if (set[i] != cluster)
+                continue;
+            if (cluster ? energy[i] > bestEnergy : energy[i] < bestEnergy)
+            {
+                best = i;
+                bestEnergy = energy[i];
+            }
+        }
+        return best;
+    }
+    
+    void generate(float sigma)
+    {
+        uint32_t n = size * size;
+        std::vector<float> kernel(n);
+        for (uint32_t y = 0; y < size; y++)
+            for (uint32_t x = 0; x < size; x++)
+                kernel[x + y * size] = expf(-(float)(x * x + y * y) / (2 * sigma * sigma));
+        
+        //initial binary pattern: ~10% random pixels, relaxed until the
+        //tightest cluster and the largest void are the same pixel
+        std::vector<uint8_t> set(n, 0);
+        std::vector<float> energy(n, 0.0f);
+        uint32_t numInitial = std::max<uint32_t>(1, n / 10);
+        for (uint32_t i = 0, placed = 0; placed < numInitial; i++)
+        {
+            uint32_t p = sampleUInt(i, 0, 0, 0xb1e) % n;
+            if (set[p])
+                continue;
+            set[p] = 1;
+            splat(energy, kernel, p, 1);
+            placed++;
+        }
+        
+        for (;;)
+        {
+            uint32_t cluster = find(energy, set, true);
+            set[cluster] = 0;
+            splat(energy, kernel, cluster, -1);
+            
+            uint32_t voidPixel = find(energy, set, false);
+            set[voidPixel] = 1;
+            splat(energy, kernel, voidPixel, 1);
+            
+            if (voidPixel == cluster)
+                break;
+        }
+        
+        std::vector<uint8_t> initialSet = set;
+        std::vector<float> initialEnergy = energy;
+        
+        //phase 1: rank the initial pattern by removing its tightest clusters
+        for (uint32_t r = numInitial; r-- > 0;)
+        {
+            uint32_t cluster = find(energy, set, true);
+            set[cluster] = 0;
+            splat(energy, kernel, cluster, -1);
+            rank[cluster] = (float)r;
+        }
+        
+        //phase 2 and 3: fill the largest voids until every pixel is ranked
+        set = initialSet;
+        energy = initialEnergy;
+        for (uint32_t r = numInitial; r < n; r++)
+        {
+            uint32_t voidPixel = find(energy, set, false);
+            set[voidPixel] = 1;
+            splat(energy, kernel, voidPixel, 1);
+            rank[voidPixel] = (float)r;
+        }
+        
+        for (uint32_t i = 0; i < n; i++)
+            rank[i] = (rank[i] + 0.5f) / n;
+    }
+};
+
+#endif /* bluenoise_h */
@@ -2,13 +2,105 @@
 //  main.cpp
 //  theraytracer
 //
+//  Convergence benchmark for the samplers in sampler.h.
+//  Integrates functions with known values over the unit hypercube
+//  and prints RMS error and time per estimate for growing sample
+//  counts as CSV, one error-vs-time curve per sampler and integrand.
+//
 //  Created by Klas Henriksson on 2017-03-01.
 //  Copyright © 2017 bajsko. All rights reserved.
 //
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "sampler.h"
+
+struct Integrand
+{
+    const char* name;
+    uint32_t dimensions;
+    double (*f)(const float* x);
+    double reference;
+};
+
+//indicator of the quarter disk, discontinuous
+double quarterDisk(const float* x) { return (x[0] * x[0] + x[1] * x[1] < 1) ? 1 : 0; }
+//smooth 2D gaussian
+double gaussian(const float* x) { return exp(-(x[0] * x[0] + x[1] * x[1])); }
+//smooth 4D product of half sine waves, integrates to 1
+double sineProduct(const float* x)
+{
+    double v = 1;
+    for (int i = 0; i < 4; i++)
+        v *= M_PI * 0.5 * sin(M_PI * x[i]);
+    return v;
+}
+//soft 8D function where only the lower dimensions matter much, typical for light transport
+double pathLike(const float* x)
+{
+    double v = 1;
+    for (int i = 0; i < 8; i++)
+        v *= 1 + (x[i] - 0.5) / (i + 1);
+    return v;
+}
 
 int main(int argc, const char** argv)
 {
+    //usage: montecarlo [maxSamples] [trials]
+    uint32_t maxSamples = argc > 1 ? atoi(argv[1]) : 4096;
+    uint32_t trials = argc > 2 ? atoi(argv[2]) : 64;
+    
+    const double erf1 = erf(1.0);
+    const Integrand integrands[] =
+    {
+        { "quarter_disk", 2, quarterDisk, M_PI / 4 },
+        { "gaussian", 2, gaussian, (M_PI / 4) * erf1 * erf1 },
+        { "sine_product_4d", 4, sineProduct, 1 },
+        { "path_like_8d", 8, pathLike, 1 },
+    };
+    const char* samplerNames[] = { "independent", "stratified", "halton", "sobol", "bluenoise" };
+    
+    printf("sampler,integrand,samples,rmse,ns_per_estimate\n");
+    
+    for (const char* samplerName : samplerNames)
+    {
+        for (const Integrand& integrand : integrands)
+        {
+            for (uint32_t n = 16; n <= maxSamples; n *= 2)
+            {
+                //stratification is only meaningful when it knows the sample count up front
+                Sampler* sampler = createSampler(samplerName, n, trials);
+                
+                double sqError = 0;
+                auto start = std::chrono::high_resolution_clock::now();
+                
+                //every trial is an independent estimate in a different "pixel"
+                for (uint32_t trial = 0; trial < trials; trial++)
+                {
+                    double sum = 0;
+                    float x[8];
+                    for (uint32_t i = 0; i < n; i++)
+                    {
+                        for (uint32_t d = 0; d < integrand.dimensions; d++)
+                            x[d] = sampler->get(trial, i, d);
+                        sum += integrand.f(x);
+                    }
+                    
+                    double error = sum / n - integrand.reference;
+                    sqError += error * error;
+                }
+                
+                auto end = std::chrono::high_resolution_clock::now();
+                double ns = std::chrono::duration<double, std::nano>(end - start).count() / trials;
+                
+                printf("%s,%s,%u,%.6e,%.1f\n", samplerName, integrand.name, n, sqrt(sqError / trials), ns);
+                delete sampler;
+            }
+        }
+    }
     
+    return 0;
 }
@@ -0,0 +1,286 @@
+//
+//  sampler.h
+//  theraytracer
+//
+//  Sample generators for Monte Carlo integration. Every sampler
+//  answers "dimension d of sample i in pixel p" without any shared
+//  mutable state, so the raytracer and mcbeth can query them from
+//  any number of threads.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef sampler_h
+#define sampler_h
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "random.h"
+#include "bluenoise.h"
+
+//The largest float below 1, samplers clamp to it so values stay in [0, 1)
+const float kOneMinusEpsilon = 0.99999994f;
+
+class Sampler
+{
+public:
+    virtual ~Sampler() {}
+    
+    //Returns dimension [dim] of sample [index] in pixel [pixel], in [0, 1)
+    virtual float get(uint32_t pixel, uint32_t index, uint32_t dim) const = 0;
+    virtual const char* name() const = 0;
+};
+
+//Walks the dimensions of one (pixel, sample) pair of a sampler,
+//each call to next01() consumes the next dimension
+class SampleStream
+{
+public:
+    SampleStream(const Sampler& s, uint32_t pixel, uint32_t index) :
+    sampler(s), pixelIndex(pixel), sampleIndex(index), dimension(0) {}
+    
+    float next01() { return sampler.get(pixelIndex, sampleIndex, dimension++); }
+    
+    const Sampler& sampler;
+    uint32_t pixelIndex;
+    uint32_t sampleIndex;
+    uint32_t dimension;
+};
+
+//Reverses the bits of a 32-bit integer
+inline uint32_t reverseBits(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+//Returns element [i] of a pseudo-random permutation of [0, l) selected by [p]
+//(Kensler 2013, "Correlated Multi-Jittered Sampling")
+inline uint32_t permuteIndex(uint32_t i, uint32_t l, uint32_t p)
+{
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do
+    {
+        i ^= p; i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8; i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1; i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11; i *= 0x74dcb303;
+        i ^= (i & w) >> 2; i *= 0x9e501cc3;
+        i ^= (i & w) >> 2; i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+//Plain uncorrelated random numbers, the baseline every other sampler is measured against
+class IndependentSampler : public Sampler
+{
+public:
+    float get(uint32_t pixel, uint32_t index, uint32_t dim) const
+    {
+        return sampleUniform(pixel, index, dim);
+    }
+    
+    const char* name() const { return "independent"; }
+};
+
+//Jittered 1D strata per dimension. The strata of each dimension are visited in
+//a different random order per pixel, so dimensions stay uncorrelated.
+//Sample counts past [samplesPerPixel] start a new, independently permuted round.
+class StratifiedSampler : public Sampler
+{
+public:
+    StratifiedSampler(uint32_t spp) : samplesPerPixel(spp ? spp : 1) {}
+    
+    float get(uint32_t pixel, uint32_t index, uint32_t dim) const
+    {
+        uint32_t round = index / samplesPerPixel;
+        uint32_t stratum = permuteIndex(index % samplesPerPixel, samplesPerPixel,
+                                        sampleUInt(pixel, round, dim, 0x57a7));
+        float jitter = sampleUniform(pixel, index, dim);
+        return std::min((stratum + jitter) / samplesPerPixel, kOneMinusEpsilon);
+    }
+    
+    const char* name() const { return "stratified"; }
+    
+    uint32_t samplesPerPixel;
+};
+
+//The Halton sequence, dimension d is the radical inverse in the d-th prime base.
+//Each pixel gets its own Cranley-Patterson rotation so neighbouring pixels decorrelate.
+//Dimensions past the prime table fall back to independent samples.
+class HaltonSampler : public Sampler
+{
+public:
+    float get(uint32_t pixel, uint32_t index, uint32_t dim) const
+    {
+        if (dim >= kNumPrimes)
+            return sampleUniform(pixel, index, dim);
+        
+        double value = radicalInverse(prime(dim), index) + sampleUniform(pixel, 0, dim, 0x4a17);
+        value -= (value >= 1) ? 1 : 0;
+        return std::min((float)value, kOneMinusEpsilon);
+    }
+    
+    const char* name() const { return "halton"; }
+    
+    static double radicalInverse(uint32_t base, uint32_t index)
+    {
+        double invBase = 1.0 / base;
+        double invBaseN = 1;
+        uint64_t reversed = 0;
+        while (index)
+        {
+            uint32_t next = index / base;
+            reversed = reversed * base + (index - next * base);
+            invBaseN *= invBase;
+            index = next;
+        }
+        return reversed * invBaseN;
+    }
+    
+    static uint32_t prime(uint32_t i)
+    {
+        static const uint32_t kPrimes[kNumPrimes] =
+        {
+            2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+            59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+        };
+        return kPrimes[i];
+    }
+    
+    static const uint32_t kNumPrimes = 32;
+};
+
+//The first four dimensions of the Sobol sequence with Owen scrambling and index
+//shuffling (Burley 2020, "Practical Hash-based Owen Scrambling"). Higher dimensions
+//are padded with further independently scrambled 4D Sobol sets.
+class SobolSampler : public Sampler
+{
+public:
+    SobolSampler()
+    {
+        //primitive polynomials and initial direction numbers of Joe & Kuo's table
+        //for dimensions 2-4, dimension 1 is the van der Corput sequence
+        const uint32_t degree[3] = { 1, 2, 3 };
+        const uint32_t coeffs[3] = { 0, 1, 1 };
+        const uint32_t initial[3][3] = { { 1 }, { 1, 3 }, { 1, 3, 1 } };
+        
+        for (uint32_t bit = 0; bit < 32; bit++)
+            directions[0][bit] = 1u << (31 - bit);
+        
+        for (uint32_t d = 1; d < 4; d++)
+        {
+            uint32_t s = degree[d - 1];
+            uint32_t a = coeffs[d - 1];
+            uint32_t v[32];
+            for (uint32_t i = 0; i < s; i++)
+                v[i] = initial[d - 1][i] << (31 - i);
+            for (uint32_t i = s; i < 32; i++)
+            {
+                v[i] = v[i - s] ^ (v[i - s] >> s);
+                for (uint32_t k = 1; k < s; k++)
+                    v[i] ^= ((a >> (s - 1 - k)) & 1) * v[i - k];
+            }
+            memcpy(directions[d], v, sizeof(v));
+        }
+    }
+    
+    float get(uint32_t pixel, uint32_t index, uint32_t dim) const
+    {
+        uint32_t seed = sampleUInt(pixel, 0, dim / 4, 0x50b0);
+        uint32_t shuffled = nestedUniformScramble(index, seed);
+        uint32_t value = nestedUniformScramble(sobol(shuffled, dim % 4), pcgHash(seed ^ (dim % 4)));
+        return uintToFloat01(value);
+    }
+    
+    const char* name() const { return "sobol"; }
+    
+    uint32_t sobol(uint32_t index, uint32_t dim) const
+    {
+        uint32_t value = 0;
+        for (uint32_t bit = 0; index; index >>= 1, bit++)
+        {
+            if (index & 1)
+                value ^= directions[dim][bit];
+        }
+        return value;
+    }
+    
+    //Owen scrambling of the bits of [v], implemented as a hash that only
+    //mixes lower bits into higher ones applied to the bit reversed value
+    static uint32_t nestedUniformScramble(uint32_t v, uint32_t seed)
+    {
+        v = reverseBits(v);
+        v ^= v * 0x3d20adeau;
+        v += seed;
+        v *= (seed >> 16) | 1;
+        v ^= v * 0x05526c56u;
+        v ^= v * 0x53a22864u;
+        return reverseBits(v);
+    }
+    
+    uint32_t directions[4][32];
+};
+
+//Distributes the error of a low-discrepancy sequence as blue noise in screen space:
+//every pixel offsets a shared scrambled Sobol sequence by a toroidal shift read from
+//a blue-noise mask, with a different mask offset per dimension.
+//Needs the image width to recover pixel coordinates from pixel indices.
+class BlueNoiseSampler : public Sampler
+{
+public:
+    BlueNoiseSampler(uint32_t width) : imageWidth(width ? width : 1) {}
+    
+    float get(uint32_t pixel, uint32_t index, uint32_t dim) const
+    {
+        //shift the mask by the R2 sequence per dimension so dimensions see unrelated offsets
+        uint32_t offsetX = (uint32_t)(dim * 0.7548776662f * mask.size);
+        uint32_t offsetY = (uint32_t)(dim * 0.5698402910f * mask.size);
+        float shift = mask.get(pixel % imageWidth + offsetX, pixel / imageWidth + offsetY);
+        
+        float value = sequence.get(0, index, dim) + shift;
+        value -= (value >= 1) ? 1 : 0;
+        return std::min(value, kOneMinusEpsilon);
+    }
+    
+    const char* name() const { return "bluenoise"; }
+    
+    uint32_t imageWidth;
+    SobolSampler sequence;
+    BlueNoiseMask mask;
+};
+
+//Creates a sampler by name ("independent", "stratified", "halton", "sobol" or "bluenoise").
+//returns NULL for an unknown name
+inline Sampler* createSampler(const char* name, uint32_t samplesPerPixel, uint32_t imageWidth)
+{
+    if (!strcmp(name, "independent"))
+        return new IndependentSampler();
+    if (!strcmp(name, "stratified"))
+        return new StratifiedSampler(samplesPerPixel);
+    if (!strcmp(name, "halton"))
+        return new HaltonSampler();
+    if (!strcmp(name, "sobol"))
+        return new SobolSampler();
+    if (!strcmp(name, "bluenoise"))
+        return new BlueNoiseSampler(imageWidth);
+    
+    return NULL;
+}
+
+#endif /* sampler_h */
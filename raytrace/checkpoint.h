@@ -0,0 +1,139 @@
+//
+//  checkpoint.h
+//  theraytracer
+//
+//  Saving and restoring the accumulation state of a render
+//  so that a killed render can resume from its last checkpoint
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef checkpoint_h
+#define checkpoint_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include "vec3.h"
+
+//Describes the render a checkpoint belongs to, a checkpoint is only
+//resumed if this matches the current render exactly
+struct CheckpointHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t cropX0, cropY0, cropX1, cropY1;
+    uint32_t passes;
+    //the integrator, a hash of the sampler's name and 1 for spectral renders
+    uint32_t integrator, sampler, spectral;
+    //hash of everything else the samples depend on, the scene and the render options
+    uint64_t sceneHash;
+};
+
+//FNV-1a of [size] bytes, continued from [hash]
+inline uint64_t checkpointHash(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+inline CheckpointHeader makeCheckpointHeader(uint32_t width, uint32_t height,
+                                             uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1,
+                                             uint32_t integrator, const char* samplerName, bool spectral,
+                                             uint64_t sceneHash)
+{
+    CheckpointHeader header;
+    memcpy(header.magic, "TRCK", 4);
+    header.version = 2;
+    header.width = width;
+    header.height = height;
+    header.cropX0 = x0;
+    header.cropY0 = y0;
+    header.cropX1 = x1;
+    header.cropY1 = y1;
+    header.passes = 0;
+    header.integrator = integrator;
+    header.sampler = (uint32_t)checkpointHash(samplerName, strlen(samplerName));
+    header.spectral = spectral ? 1 : 0;
+    header.sceneHash = sceneHash;
+    return header;
+}
+
+//Writes the accumulated radiance and per-pixel sample counts of the crop window to [path].
+//The file is written next to [path] first and renamed over it, so a render killed
+//while checkpointing never leaves a torn checkpoint behind.
+//returns true on success
+inline bool saveCheckpoint(const char* path, const CheckpointHeader& header,
+                           const vec3f* accum, const uint32_t* counts)
+{
+    size_t numPixels = (size_t)(header.cropX1 - header.cropX0) * (header.cropY1 - header.cropY0);
+    std::string tmpPath = std::string(path) + ".tmp";
+
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (size_t i = 0; ok && i < numPixels; i++)
+    {
+        float rgb[3] = { accum[i].x, accum[i].y, accum[i].z };
+        ok = fwrite(rgb, sizeof(rgb), 1, file) == 1;
+    }
+    ok = ok && fwrite(counts, sizeof(uint32_t), numPixels, file) == numPixels;
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path) != 0)
+    {
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+//Restores a checkpoint written by saveCheckpoint into [accum] and [counts].
+//[header] describes the current render, on success its pass count is set to
+//the number of passes already stored in the checkpoint.
+//returns false if there is no checkpoint or it belongs to a different render
+inline bool loadCheckpoint(const char* path, CheckpointHeader& header,
+                           vec3f* accum, uint32_t* counts)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    CheckpointHeader stored;
+    if (fread(&stored, sizeof(stored), 1, file) != 1 ||
+        memcmp(stored.magic, header.magic, 4) != 0 || stored.version != header.version ||
+        stored.width != header.width || stored.height != header.height ||
+        stored.cropX0 != header.cropX0 || stored.cropY0 != header.cropY0 ||
+        stored.cropX1 != header.cropX1 || stored.cropY1 != header.cropY1 ||
+        stored.integrator != header.integrator || stored.sampler != header.sampler ||
+        stored.spectral != header.spectral || stored.sceneHash != header.sceneHash)
+    {
+        fclose(file);
+        return false;
+    }
+
+    size_t numPixels = (size_t)(header.cropX1 - header.cropX0) * (header.cropY1 - header.cropY0);
+    bool ok = true;
+    for (size_t i = 0; ok && i < numPixels; i++)
+    {
+        float rgb[3];
+        ok = fread(rgb, sizeof(rgb), 1, file) == 1;
+        accum[i] = vec3f(rgb[0], rgb[1], rgb[2]);
+    }
+    ok = ok && fread(counts, sizeof(uint32_t), numPixels, file) == numPixels;
+    fclose(file);
+
+    if (ok)
+        header.passes = stored.passes;
+
+    return ok;
+}
+
+#endif /* checkpoint_h */
@@ -0,0 +1,656 @@
+//
+//  compressed_mesh.cpp
+//  theraytracer
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "compressed_mesh.h"
+
+//file layout: CompressedMeshHeader, the nodes from kNodeOffset with the root first, then from
+//the page at triangleOffset nine floats per triangle. Everything is in the byte order of the writer
+struct CompressedMeshHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t triangleCount;
+    uint64_t nodeCount;
+    uint64_t triangleOffset;
+    float boundsMin[3];
+    float boundsMax[3];
+    float texCoordScale;
+    uint32_t reserved;
+};
+
+const uint32_t kCompressedMeshVersion = 1;
+const uint64_t kNodeOffset = 64;
+const uint64_t kTrianglePage = 4096;
+
+const uint32_t kMaxLeafSize = 4;
+const int kNumBins = 16;
+//deeper nodes split at the median, so no hierarchy is deeper than kMaxDepth
+const int kMaxSAHDepth = 48;
+const int kMaxDepth = kMaxSAHDepth + 32;
+//a node pops one entry and pushes at most kWidth, open() rejects deeper files
+const int kStackSize = CompressedNode::kWidth * kMaxDepth;
+//widens the far side of a slab by the rounding error of the slab distances
+const float kSlabRounding = 1.0000004f;
+
+//2^[exponent] for an exponent in [-126, 127], built straight from the bits
+inline float exponentScale(int8_t exponent)
+{
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+//An axis aligned box indexed by axis, empty when created
+struct BuildBox
+{
+    BuildBox()
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            min[a] = INFINITY;
+            max[a] = -INFINITY;
+        }
+    }
+
+    void grow(const float* p)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            min[a] = std::min(min[a], p[a]);
+            max[a] = std::max(max[a], p[a]);
+        }
+    }
+
+    void grow(const BuildBox& box)
+    {
+        grow(box.min);
+        grow(box.max);
+    }
+
+    //half the surface area, 0 if empty
+    float area() const
+    {
+        float dx = max[0] - min[0], dy = max[1] - min[1], dz = max[2] - min[2];
+        return dx < 0 ? 0 : dx * dy + dy * dz + dz * dx;
+    }
+
+    float min[3], max[3];
+};
+
+//A node of the binary hierarchy the wide one is collapsed from
+struct BuildNode
+{
+    BuildBox box;
+    uint32_t left, right;
+    //the range of MeshBuilder::order of a leaf, count is 0 for an inner node
+    uint32_t first, count;
+};
+
+//Builds a binary hierarchy by binned SAH over the triangle centroids, then collapses it into
+//wide nodes by repeatedly opening the child of largest area until a node has kWidth children
+class MeshBuilder
+{
+public:
+    MeshBuilder(const float* tris, uint32_t count) : triangles(tris), order(count), centroids((size_t)3 * count)
+    {
+        double sumCross = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            order[i] = i;
+            BuildBox box = triangleBox(i);
+            for (int a = 0; a < 3; a++)
+                centroids[(size_t)3 * i + a] = 0.5f * (box.min[a] + box.max[a]);
+
+            const float* p = triangles + (size_t)9 * i;
+            vec3f p0(p[0], p[1], p[2]), p1(p[3], p[4], p[5]), p2(p[6], p[7], p[8]);
+            //length() is the squared length
+            sumCross += sqrtf(Vec3Util::cross(p1 - p0, p2 - p0).length());
+        }
+        //the average of what Triangle::texCoordScale() would be
+        texCoordScale = (float)sqrt(sumCross / count);
+
+        build(0, count, 0);
+        wide.push_back(CompressedNode());
+        collapse(0, 0);
+    }
+
+    BuildBox triangleBox(uint32_t tri) const
+    {
+        BuildBox box;
+        const float* p = triangles + (size_t)9 * tri;
+        for (int k = 0; k < 3; k++)
+            box.grow(p + 3 * k);
+        return box;
+    }
+
+    float centroid(uint32_t tri, int axis) const { return centroids[(size_t)3 * tri + axis]; }
+
+    uint32_t build(uint32_t first, uint32_t count, int depth)
+    {
+        uint32_t index = (uint32_t)nodes.size();
+        nodes.push_back(BuildNode());
+
+        BuildBox box, centroidBox;
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            box.grow(triangleBox(order[i]));
+            float c[3] = { centroid(order[i], 0), centroid(order[i], 1), centroid(order[i], 2) };
+            centroidBox.grow(c);
+        }
+        nodes[index].box = box;
+
+        if (count <= kMaxLeafSize)
+        {
+            nodes[index].first = first;
+            nodes[index].count = count;
+            return index;
+        }
+
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+        {
+            if (centroidBox.max[a] - centroidBox.min[a] > centroidBox.max[axis] - centroidBox.min[axis])
+                axis = a;
+        }
+        float centroidMin = centroidBox.min[axis];
+        float centroidExtent = centroidBox.max[axis] - centroidMin;
+
+        uint32_t* begin = &order[first];
+        uint32_t* end = begin + count;
+        uint32_t* mid = NULL;
+        if (centroidExtent > 0 && depth < kMaxSAHDepth)
+        {
+            auto binOf = [&](uint32_t tri)
+            {
+                int bin = (int)((centroid(tri, axis) - centroidMin) / centroidExtent * kNumBins);
+                return std::min(bin, kNumBins - 1);
+            };
+
+            BuildBox bins[kNumBins];
+            uint32_t binCounts[kNumBins] = {};
+            for (uint32_t* it = begin; it != end; it++)
+            {
+                int bin = binOf(*it);
+                bins[bin].grow(triangleBox(*it));
+                binCounts[bin]++;
+            }
+
+            //the cost of the split before every bin is its area times count on either side
+            float rightCost[kNumBins];
+            BuildBox right;
+            uint32_t rightCount = 0;
+            for (int b = kNumBins - 1; b > 0; b--)
+            {
+                right.grow(bins[b]);
+                rightCount += binCounts[b];
+                rightCost[b] = right.area() * rightCount;
+            }
+
+            int split = 1;
+            float bestCost = INFINITY;
+            BuildBox left;
+            uint32_t leftCount = 0;
+            for (int b = 1; b < kNumBins; b++)
+            {
+                left.grow(bins[b - 1]);
+                leftCount += binCounts[b - 1];
+                float cost = left.area() * leftCount + rightCost[b];
+                if (leftCount > 0 && leftCount < count && cost < bestCost)
+                {
+                    bestCost = cost;
+                    split = b;
+                }
+            }
+
+            mid = std::partition(begin, end, [&](uint32_t tri) { return binOf(tri) < split; });
+        }
+        if (mid == NULL || mid == begin || mid == end)
+        {
+            mid = begin + count / 2;
+            std::nth_element(begin, mid, end, [&](uint32_t a, uint32_t b) { return centroid(a, axis) < centroid(b, axis); });
+        }
+
+        uint32_t leftCount = (uint32_t)(mid - begin);
+        uint32_t left = build(first, leftCount, depth + 1);
+        uint32_t right = build(first + leftCount, count - leftCount, depth + 1);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        nodes[index].count = 0;
+        return index;
+    }
+
+    //Fills wide[index] with the children of the binary node [node], its inner children are
+    //appended depth first so that a subtree is contiguous in the file
+    void collapse(uint32_t node, uint32_t index)
+    {
+        const int kWidth = CompressedNode::kWidth;
+        uint32_t children[kWidth];
+        int childCount = 0;
+        if (nodes[node].count)
+        {
+            children[childCount++] = node;
+        }
+        else
+        {
+            children[childCount++] = nodes[node].left;
+            children[childCount++] = nodes[node].right;
+        }
+
+        while (childCount < kWidth)
+        {
+            int largest = -1;
+            float largestArea = -1;
+            for (int c = 0; c < childCount; c++)
+            {
+                const BuildNode& child = nodes[children[c]];
+                if (child.count == 0 && child.box.area() > largestArea)
+                {
+                    largest = c;
+                    largestArea = child.box.area();
+                }
+            }
+            if (largest < 0)
+                break;
+
+            uint32_t inner = children[largest];
+            children[largest] = nodes[inner].left;
+            children[childCount++] = nodes[inner].right;
+        }
+
+        CompressedNode out;
+        memset(&out, 0, sizeof(out));
+        out.childCount = (uint8_t)childCount;
+
+        const BuildBox& box = nodes[node].box;
+        for (int a = 0; a < 3; a++)
+        {
+            //the smallest power of two that spans the node in 255 steps
+            float origin = box.min[a];
+            int exponent = -126;
+            if (box.max[a] > origin)
+                frexpf((box.max[a] - origin) / 255, &exponent);
+            exponent = std::max(-126, std::min(127, exponent));
+            while (exponent < 127 && origin + 255 * exponentScale((int8_t)exponent) < box.max[a])
+                exponent++;
+
+            out.origin[a] = origin;
+            out.exponent[a] = (int8_t)exponent;
+            float scale = exponentScale(out.exponent[a]);
+
+            //rounded outwards as the traversal decodes them
+            for (int c = 0; c < childCount; c++)
+            {
+                const BuildBox& childBox = nodes[children[c]].box;
+                int lo = std::max(0, std::min(255, (int)floorf((childBox.min[a] - origin) / scale)));
+                while (lo > 0 && origin + lo * scale > childBox.min[a])
+                    lo--;
+                int hi = std::max(0, std::min(255, (int)ceilf((childBox.max[a] - origin) / scale)));
+                while (hi < 255 && origin + hi * scale < childBox.max[a])
+                    hi++;
+                out.lo[a][c] = (uint8_t)lo;
+                out.hi[a][c] = (uint8_t)hi;
+            }
+        }
+
+        for (int c = 0; c < childCount; c++)
+        {
+            const BuildNode& child = nodes[children[c]];
+            if (child.count)
+            {
+                out.triangleCount[c] = (uint8_t)child.count;
+                out.child[c] = child.first;
+            }
+            else
+            {
+                uint32_t childIndex = (uint32_t)wide.size();
+                wide.push_back(CompressedNode());
+                out.child[c] = childIndex;
+                collapse(children[c], childIndex);
+            }
+        }
+        wide[index] = out;
+    }
+
+    const float* triangles;
+    //the triangles in leaf order
+    std::vector<uint32_t> order;
+    std::vector<float> centroids;
+    std::vector<BuildNode> nodes;
+    std::vector<CompressedNode> wide;
+    float texCoordScale;
+};
+
+bool CompressedMesh::build(const float* triangles, uint64_t count, const char* path)
+{
+    //leaves address triangles with 32 bits
+    if (count == 0 || count > 0xffffffffu)
+        return false;
+
+    MeshBuilder builder(triangles, (uint32_t)count);
+
+    CompressedMeshHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "CBVH", 4);
+    header.version = kCompressedMeshVersion;
+    header.triangleCount = count;
+    header.nodeCount = builder.wide.size();
+    uint64_t nodeEnd = kNodeOffset + header.nodeCount * sizeof(CompressedNode);
+    header.triangleOffset = (nodeEnd + kTrianglePage - 1) / kTrianglePage * kTrianglePage;
+    const BuildBox& bounds = builder.nodes[0].box;
+    for (int a = 0; a < 3; a++)
+    {
+        header.boundsMin[a] = bounds.min[a];
+        header.boundsMax[a] = bounds.max[a];
+    }
+    header.texCoordScale = builder.texCoordScale;
+
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return false;
+
+    std::vector<uint8_t> padding(std::max(kNodeOffset, kTrianglePage), 0);
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(&padding[0], 1, kNodeOffset - sizeof(header), file) == kNodeOffset - sizeof(header);
+    ok = ok && fwrite(&builder.wide[0], sizeof(CompressedNode), builder.wide.size(), file) == builder.wide.size();
+    ok = ok && fwrite(&padding[0], 1, header.triangleOffset - nodeEnd, file) == header.triangleOffset - nodeEnd;
+
+    //in chunks, the triangles may be larger than memory
+    const size_t kChunk = 4096;
+    std::vector<float> chunk((size_t)9 * kChunk);
+    for (uint64_t first = 0; ok && first < count; first += kChunk)
+    {
+        size_t n = (size_t)std::min<uint64_t>(kChunk, count - first);
+        for (size_t i = 0; i < n; i++)
+            memcpy(&chunk[9 * i], triangles + (size_t)9 * builder.order[first + i], 9 * sizeof(float));
+        ok = fwrite(&chunk[0], 9 * sizeof(float), n, file) == n;
+    }
+    ok = (fclose(file) == 0) && ok;
+
+    return ok;
+}
+
+bool CompressedMesh::open(const char* path)
+{
+    close();
+
+    if (!file.open(path) || file.size() < kNodeOffset)
+    {
+        close();
+        return false;
+    }
+
+    CompressedMeshHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    uint64_t maxNodes = file.size() / sizeof(CompressedNode);
+    uint64_t nodeEnd = kNodeOffset + header.nodeCount * sizeof(CompressedNode);
+    if (memcmp(header.magic, "CBVH", 4) != 0 || header.version != kCompressedMeshVersion ||
+        header.nodeCount == 0 || header.nodeCount > maxNodes || header.triangleCount == 0 ||
+        header.triangleOffset < nodeEnd || header.triangleOffset > file.size() ||
+        (file.size() - header.triangleOffset) / (9 * sizeof(float)) != header.triangleCount)
+    {
+        close();
+        return false;
+    }
+
+    nodes = (const CompressedNode*)(file.data() + kNodeOffset);
+    triangles = (const float*)(file.data() + header.triangleOffset);
+    triangleCount = header.triangleCount;
+    if (!validateNodes(header.nodeCount))
+    {
+        close();
+        return false;
+    }
+
+    coordScale = header.texCoordScale;
+    extent = 0;
+    for (int a = 0; a < 3; a++)
+        extent = std::max(extent, header.boundsMax[a] - header.boundsMin[a]);
+
+    //every ray starts at the root, but only reaches the triangles along its way
+    file.advise(MappedFile::kAccessSequential, kNodeOffset, nodeEnd - kNodeOffset);
+    file.advise(MappedFile::kAccessRandom, header.triangleOffset);
+    return true;
+}
+
+//The traversal trusts the nodes, they are checked once: scales in range, leaves inside the
+//triangles, and inner children after their parent in the array, which rules out cycles and
+//gives the depth in one pass
+bool CompressedMesh::validateNodes(uint64_t nodeCount) const
+{
+    std::vector<uint8_t> depth(nodeCount, 0);
+    depth[0] = 1;
+    for (uint64_t i = 0; i < nodeCount; i++)
+    {
+        const CompressedNode& node = nodes[i];
+        if (node.childCount == 0 || node.childCount > CompressedNode::kWidth)
+            return false;
+        for (int a = 0; a < 3; a++)
+        {
+            if (node.exponent[a] < -126)
+                return false;
+        }
+
+        for (int c = 0; c < node.childCount; c++)
+        {
+            if (node.triangleCount[c])
+            {
+                if ((uint64_t)node.child[c] + node.triangleCount[c] > triangleCount)
+                    return false;
+                continue;
+            }
+
+            if (node.child[c] <= i || node.child[c] >= nodeCount || depth[i] >= kMaxDepth)
+                return false;
+            depth[node.child[c]] = std::max<uint8_t>(depth[node.child[c]], depth[i] + 1);
+        }
+    }
+    return true;
+}
+
+void CompressedMesh::close()
+{
+    file.close();
+    nodes = NULL;
+    triangles = NULL;
+    triangleCount = 0;
+}
+
+bool CompressedMesh::intersects(const Ray& ray, float& t) const
+{
+    uint64_t primitive;
+    return intersectPrimitive(ray, t, primitive);
+}
+
+bool CompressedMesh::intersectPrimitive(const Ray& ray, float& t, uint64_t& primitive) const
+{
+    if (!nodes)
+        return false;
+
+    //an axis the ray is parallel to gets a huge but finite slab distance instead of 0 * infinity
+    float pos[3] = { ray.pos.x, ray.pos.y, ray.pos.z };
+    float dir[3] = { ray.dir.x, ray.dir.y, ray.dir.z };
+    float invDir[3];
+    for (int a = 0; a < 3; a++)
+        invDir[a] = 1 / (dir[a] != 0 ? dir[a] : 1e-30f);
+
+    //any hit occludes, shadow rays stop at the first
+    const bool anyHit = ray.type == kRayTypeShadow;
+    float closest = ray.tMax;
+    bool hit = false;
+
+    struct Entry
+    {
+        uint32_t node;
+        float distance;
+    };
+    Entry stack[kStackSize];
+    int size = 0;
+    stack[size].node = 0;
+    stack[size++].distance = 0;
+
+    while (size > 0)
+    {
+        Entry entry = stack[--size];
+        if (entry.distance >= closest)
+            continue;
+
+        const CompressedNode& node = nodes[entry.node];
+        float scale[3];
+        for (int a = 0; a < 3; a++)
+            scale[a] = exponentScale(node.exponent[a]);
+
+        //the inner children the ray enters before the closest hit, farthest first
+        Entry inner[CompressedNode::kWidth];
+        int innerCount = 0;
+        for (int c = 0; c < node.childCount; c++)
+        {
+            float tNear = 0, tFar = closest;
+            for (int a = 0; a < 3; a++)
+            {
+                float t0 = (node.origin[a] + node.lo[a][c] * scale[a] - pos[a]) * invDir[a];
+                float t1 = (node.origin[a] + node.hi[a][c] * scale[a] - pos[a]) * invDir[a];
+                if (t0 > t1)
+                    std::swap(t0, t1);
+                tNear = std::max(tNear, t0);
+                tFar = std::min(tFar, t1 * kSlabRounding);
+            }
+            if (tNear > tFar)
+                continue;
+
+            if (node.triangleCount[c] == 0)
+            {
+                int i = innerCount++;
+                for (; i > 0 && inner[i - 1].distance < tNear; i--)
+                    inner[i] = inner[i - 1];
+                inner[i].node = node.child[c];
+                inner[i].distance = tNear;
+                continue;
+            }
+
+            for (uint32_t i = 0; i < node.triangleCount[c]; i++)
+            {
+                vec3f p0, p1, p2;
+                getTriangle(node.child[c] + i, p0, p1, p2);
+                float tTriangle;
+                if (intersectTriangle(ray, p0, p1, p2, tTriangle) && tTriangle < closest)
+                {
+                    closest = tTriangle;
+                    primitive = node.child[c] + i;
+                    hit = true;
+                    if (anyHit)
+                    {
+                        t = closest;
+                        return true;
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < innerCount; i++)
+            stack[size++] = inner[i];
+    }
+
+    if (hit)
+        t = closest;
+    return hit;
+}
+
+//The hit point is not exactly on the triangle, every triangle in reach of it is scored by its
+//distance from the plane plus how far outside the edges the point lies
+uint64_t CompressedMesh::findTriangle(const vec3f& point) const
+{
+    const float tolerance = extent * 1e-4f;
+    float p[3] = { point.x, point.y, point.z };
+
+    uint64_t best = 0;
+    float bestScore = INFINITY;
+
+    uint32_t stack[kStackSize];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0)
+    {
+        const CompressedNode& node = nodes[stack[--size]];
+        float scale[3];
+        for (int a = 0; a < 3; a++)
+            scale[a] = exponentScale(node.exponent[a]);
+
+        for (int c = 0; c < node.childCount; c++)
+        {
+            bool inside = true;
+            for (int a = 0; a < 3 && inside; a++)
+            {
+                inside = p[a] >= node.origin[a] + node.lo[a][c] * scale[a] - tolerance &&
+                         p[a] <= node.origin[a] + node.hi[a][c] * scale[a] + tolerance;
+            }
+            if (!inside)
+                continue;
+
+            if (node.triangleCount[c] == 0)
+            {
+                stack[size++] = node.child[c];
+                continue;
+            }
+
+            for (uint32_t i = 0; i < node.triangleCount[c]; i++)
+            {
+                uint64_t index = node.child[c] + i;
+                vec3f p0, p1, p2;
+                getTriangle(index, p0, p1, p2);
+
+                //length() is the squared length
+                vec3f n = Vec3Util::cross(p1 - p0, p2 - p0);
+                float cross2 = n.length();
+                if (!(cross2 > 0))
+                    continue;
+
+                float u, v;
+                triangleBarycentrics(point, p0, p1, p2, u, v);
+                float outside = std::max(std::max(-u, -v), std::max(u + v - 1, 0.0f));
+                float score = fabsf((point - p0).dot(n)) / sqrtf(cross2) + outside * sqrtf(sqrtf(cross2));
+                if (score < bestScore)
+                {
+                    bestScore = score;
+                    best = index;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+void CompressedMesh::getPrimitiveSurfaceData(const vec3f& hit, uint64_t primitive, vec3f& normal, vec3f& texCoord) const
+{
+    vec3f p0, p1, p2;
+    getTriangle(primitive, p0, p1, p2);
+    normal = Vec3Util::cross(p1 - p0, p2 - p0).normalize();
+    triangleBarycentrics(hit, p0, p1, p2, texCoord.x, texCoord.y);
+    texCoord.z = 0;
+}
+
+vec3f CompressedMesh::getPrimitiveNormal(const vec3f&, uint64_t primitive) const
+{
+    vec3f p0, p1, p2;
+    getTriangle(primitive, p0, p1, p2);
+    return Vec3Util::cross(p1 - p0, p2 - p0).normalize();
+}
+
+void CompressedMesh::getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const
+{
+    getPrimitiveSurfaceData(hit, findTriangle(hit), normal, texCoord);
+}
+
+vec3f CompressedMesh::getNormal(const vec3f& hit) const
+{
+    return getPrimitiveNormal(hit, findTriangle(hit));
+}
@@ -0,0 +1,91 @@
+//
+//  compressed_mesh.h
+//  theraytracer
+//
+//  A triangle mesh traced through a compressed bounding volume hierarchy
+//  that is read straight from a memory-mapped file. Nodes have up to eight
+//  children whose boxes are quantized to a byte per side relative to the
+//  box of the node, and leaves are ranges of triangles, which the file
+//  stores in leaf order. Pages are read when a ray first reaches them and
+//  the system drops them again under memory pressure, so meshes larger
+//  than memory render, only slower.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include "geometry.h"
+#include "mapped_file.h"
+
+//One node as it is stored in the file
+struct CompressedNode
+{
+    static const int kWidth = 8;
+
+    //the sides of the child boxes are origin + q * 2^exponent on every axis, rounded outwards
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t childCount;
+    uint8_t lo[3][kWidth];
+    uint8_t hi[3][kWidth];
+    //the triangles of a leaf child, 0 for an inner child
+    uint8_t triangleCount[kWidth];
+    //the first triangle of a leaf child, the node of an inner child
+    uint32_t child[kWidth];
+};
+
+//The mesh has a single material. Texture coordinates are the barycentric coordinates of
+//the triangle hit, as for Triangle. It has no raster proxy and is always ray traced.
+class CompressedMesh : public Object
+{
+public:
+    CompressedMesh() { hasPrimitives = true; }
+    CompressedMesh(const vec3f& alb) : Object(alb) { hasPrimitives = true; }
+
+    //Maps a mesh written by build()
+    //returns false if the file does not exist or is not a valid mesh
+    bool open(const char* path);
+    void close();
+    bool isOpen() const { return nodes != NULL; }
+
+    //Builds the hierarchy over [count] triangles of nine floats each and writes the mesh to
+    //[path]. [triangles] may be a mapping itself, besides it the build holds about 60 bytes
+    //per triangle.
+    static bool build(const float* triangles, uint64_t count, const char* path);
+
+    //the primitive is the index of the triangle in the file
+    bool intersectPrimitive(const Ray& ray, float& t, uint64_t& primitive) const;
+    void getPrimitiveSurfaceData(const vec3f& hit, uint64_t primitive, vec3f& normal, vec3f& texCoord) const;
+    vec3f getPrimitiveNormal(const vec3f& hit, uint64_t primitive) const;
+    //Without the triangle the hit point is matched against the triangles near it, a second
+    //traversal that can settle on a neighbour where triangles meet or cross
+    bool intersects(const Ray& ray, float& t) const;
+    void getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const;
+    vec3f getNormal(const vec3f& hit) const;
+    float texCoordScale() const { return coordScale; }
+
+    uint64_t getTriangleCount() const { return triangleCount; }
+
+private:
+    //false if the [nodeCount] nodes could lead a traversal out of the file or overflow its stack
+    bool validateNodes(uint64_t nodeCount) const;
+    //the triangle a ray that hit the mesh at [point] has hit
+    uint64_t findTriangle(const vec3f& point) const;
+    void getTriangle(uint64_t index, vec3f& p0, vec3f& p1, vec3f& p2) const
+    {
+        const float* p = triangles + 9 * index;
+        p0 = vec3f(p[0], p[1], p[2]);
+        p1 = vec3f(p[3], p[4], p[5]);
+        p2 = vec3f(p[6], p[7], p[8]);
+    }
+
+    MappedFile file;
+    const CompressedNode* nodes = NULL;
+    const float* triangles = NULL;
+    uint64_t triangleCount = 0;
+    //the largest side of the box around the mesh
+    float extent = 0;
+    float coordScale = 1;
+};
@@ -33,4 +33,35 @@ bool Disk::intersects(const Ray &ray, float &t) const
 void Disk::getSurfaceData(const vec3f &hit, vec3f &normal, vec3f &texCoord) const
 {
     normal = Vec3Util::normalize(this->normal);
+    
+    //the disk spans [0, 1]^2 of an orthonormal basis in its plane
+    vec3f tangent, bitangent;
+    Vec3Util::orthonormalBasis(normal, tangent, bitangent);
+    vec3f diskPos = hit - center;
+    texCoord.x = diskPos.dot(tangent) / (2 * radius) + 0.5f;
+    texCoord.y = diskPos.dot(bitangent) / (2 * radius) + 0.5f;
+}
+
+//A fan around the center, pushed out so that its edges lie outside the rim
+bool Disk::tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const
+{
+    const int segments = 64;
+    float r = radius / cosf(M_PI / segments);
+    vec3f tangent, bitangent;
+    Vec3Util::orthonormalBasis(Vec3Util::normalize(normal), tangent, bitangent);
+    
+    uint32_t first = (uint32_t)positions.size();
+    positions.push_back(center);
+    for (int i = 0; i < segments; i++)
+    {
+        float phi = 2 * M_PI * i / segments;
+        positions.push_back(center + (tangent * cosf(phi) + bitangent * sinf(phi)) * r);
+    }
+    
+    for (int i = 0; i < segments; i++)
+    {
+        uint32_t tri[3] = { first, first + 1 + i, first + 1 + (i + 1) % segments };
+        indices.insert(indices.end(), tri, tri + 3);
+    }
+    return true;
 }
@@ -0,0 +1,185 @@
+//
+//  gbuffer.h
+//  theraytracer
+//
+//  Primary visibility by rasterization for hybrid rendering. The objects
+//  are rasterized as triangle proxies with the camworks vertex pipeline
+//  and rasterizer; the id buffer then tells which object a primary ray
+//  hits, so only that object is intersected exactly to fill the G-buffer.
+//  Pixels where the raster result is ambiguous are left to the ray tracer.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef gbuffer_h
+#define gbuffer_h
+
+#include <math.h>
+#include <vector>
+#include "vec3.h"
+#include "transform.h"
+#include "parallel.h"
+#include "geometry.h"
+#include "vertex_pipeline.h"
+#include "rasterizer.h"
+
+//The surface seen through the center of one pixel
+struct GBufferSample
+{
+    //the visible object, NULL for the background
+    const Object* object = NULL;
+    //the primitive of the object seen
+    uint64_t primitive = 0;
+    //distance along the primary ray
+    float distance = INFINITY;
+    vec3f normal;
+    vec3f texCoord;
+    //rasterization could not decide the visible object, the primary ray must be traced
+    bool traced = false;
+};
+
+class GBuffer
+{
+public:
+    //proxies closer than this to the camera are clipped away, they would cover the view
+    static constexpr float kNear = 1e-3f;
+    static constexpr float kFar = 1e7f;
+
+    //[camToWorld] and [fov] describe the camera of computeRay() for a [width] x [height] frame
+    GBuffer(int w, int h, float fieldOfView, const Transform& c2w) : width(w), height(h), fov(fieldOfView), camToWorld(c2w) {}
+
+    //Rasterizes [objects] and fills the samples of the pixels in [x0, x1) x [y0, y1).
+    //primaryRay(x, y, ray) must set [ray] to the primary ray through the center of pixel (x, y).
+    template <typename RayFunc>
+    void build(const std::vector<Object*>& objects, int x0, int y0, int x1, int y1,
+               const RayFunc& primaryRay, unsigned numThreads = 0)
+    {
+        cropX0 = x0;
+        cropY0 = y0;
+        cropWidth = x1 - x0;
+        samples.assign((size_t)cropWidth * (y1 - y0), GBufferSample());
+
+        //one mesh of all proxies, each triangle remembers its object
+        std::vector<vec3f> positions;
+        std::vector<uint32_t> indices;
+        std::vector<uint32_t> triangleObjects;
+        std::vector<const Object*> traced;
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            if (!objects[i]->tessellate(positions, indices))
+            {
+                traced.push_back(objects[i]);
+                continue;
+            }
+            triangleObjects.resize(indices.size() / 3, (uint32_t)i);
+        }
+
+        Mesh mesh;
+        for (size_t i = 0; i < positions.size(); i++)
+            mesh.addVertex(positions[i].x, positions[i].y, positions[i].z);
+        mesh.indices = indices;
+
+        //the canvas of computeRay() at distance 1, scaled to the near plane
+        float tanfov = tanf(fov * 0.5f);
+        float aspect = (float)width / height;
+        Projection projection;
+        projection.zNear = kNear;
+        projection.zFar = kFar;
+        projection.left = -aspect * tanfov * kNear;
+        projection.right = aspect * tanfov * kNear;
+        projection.bottom = -tanfov * kNear;
+        projection.top = tanfov * kNear;
+        projection.imgWidth = width;
+        projection.imgHeight = height;
+
+        VertexPipeline pipeline;
+        pipeline.transform(mesh, camToWorld.inverse(), projection, numThreads);
+        std::vector<AssembledTriangle> assembled;
+        pipeline.assemble(mesh, kCullNone, assembled);
+
+        std::vector<RasterTriangle> triangles(assembled.size());
+        for (size_t i = 0; i < assembled.size(); i++)
+        {
+            for (int k = 0; k < 3; k++)
+                triangles[i].v[k] = assembled[i].v[k];
+            triangles[i].color = Image::kBlack;
+            triangles[i].id = triangleObjects[assembled[i].source];
+        }
+
+        Rasterizer rasterizer(width, height);
+        rasterizer.draw(triangles, numThreads);
+
+        parallelFor(y0, y1, 1, [&](int y)
+        {
+            for (int x = x0; x < x1; x++)
+            {
+                Ray ray;
+                primaryRay(x, y, ray);
+                resolve(rasterizer, objects, traced, x, y, ray, samples[(size_t)(y - y0) * cropWidth + (x - x0)]);
+            }
+        }, numThreads);
+    }
+
+    //the sample of pixel (x, y), which must be inside the window given to build()
+    const GBufferSample& at(int x, int y) const { return samples[(size_t)(y - cropY0) * cropWidth + (x - cropX0)]; }
+
+private:
+    void resolve(const Rasterizer& rasterizer, const std::vector<Object*>& objects,
+                 const std::vector<const Object*>& traced, int x, int y, const Ray& ray, GBufferSample& sample) const
+    {
+        //a proxy only approximates its object, next to a change of id (silhouettes, contacts
+        //and intersections) the raster can disagree with the exact surfaces
+        uint32_t id = rasterizer.getId(x, y);
+        for (int dy = -1; dy <= 1; dy++)
+        {
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                int nx = clamp_nv(x + dx, 0, width - 1), ny = clamp_nv(y + dy, 0, height - 1);
+                if (rasterizer.getId(nx, ny) != id)
+                {
+                    sample.traced = true;
+                    return;
+                }
+            }
+        }
+
+        float t = INFINITY;
+        uint64_t primitive = 0;
+        if (id != Rasterizer::kNoId)
+        {
+            //the proxy encloses the object, a miss means the pixel is not what it seems
+            if (!objects[id]->intersectPrimitive(ray, t, primitive) || !(t < ray.tMax))
+            {
+                sample.traced = true;
+                return;
+            }
+            sample.object = objects[id];
+            sample.primitive = primitive;
+            sample.distance = t;
+        }
+
+        //objects without a proxy are intersected at every pixel
+        for (size_t i = 0; i < traced.size(); i++)
+        {
+            if (traced[i]->intersectPrimitive(ray, t, primitive) && t < sample.distance && t < ray.tMax)
+            {
+                sample.object = traced[i];
+                sample.primitive = primitive;
+                sample.distance = t;
+            }
+        }
+
+        if (sample.object)
+            sample.object->getPrimitiveSurfaceData(ray.pos + ray.dir * sample.distance, sample.primitive, sample.normal,
+                                          sample.texCoord);
+    }
+
+    int width, height;
+    float fov;
+    Transform camToWorld;
+
+    int cropX0 = 0, cropY0 = 0, cropWidth = 0;
+    std::vector<GBufferSample> samples;
+};
+
+#endif /* gbuffer_h */
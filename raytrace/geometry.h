@@ -10,7 +10,12 @@
 
 #pragma once
 
+#include <vector>
+#include <stdint.h>
 #include "ray.h"
+#include "transform.h"
+
+class Texture;
 
 enum ObjectType
 {
@@ -29,9 +34,38 @@ public:
 	virtual ~Object() {}
 	virtual bool intersects(const Ray& ray, float& t) const = 0;
     virtual void getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const = 0;
+    //the normal of getSurfaceData() alone, for shading that reads no texture coordinates
+    virtual vec3f getNormal(const vec3f& hit) const
+    {
+        vec3f normal, texCoord;
+        getSurfaceData(hit, normal, texCoord);
+        return normal;
+    }
+    //Objects made of many primitives, which set hasPrimitives, report which one a ray hit and
+    //take it back to shade the hit without searching for it again. Single surfaces report 0
+    //and ignore it
+    virtual bool intersectPrimitive(const Ray& ray, float& t, uint64_t& primitive) const
+    {
+        primitive = 0;
+        return intersects(ray, t);
+    }
+    virtual void getPrimitiveSurfaceData(const vec3f& hit, uint64_t /*primitive*/, vec3f& normal, vec3f& texCoord) const
+    {
+        getSurfaceData(hit, normal, texCoord);
+    }
+    virtual vec3f getPrimitiveNormal(const vec3f& hit, uint64_t /*primitive*/) const { return getNormal(hit); }
+    //world space length of one unit of texCoord, relates footprints on the surface to texture space
+    virtual float texCoordScale() const { return 1; }
+    //Appends a triangle mesh that encloses the surface, the proxy the object is rasterized
+    //as. returns false if the object has no proxy and must always be ray traced
+    virtual bool tessellate(std::vector<vec3f>&, std::vector<uint32_t>&) const { return false; }
 
 	vec3f albedo;
     ObjectType type = kDiffuse;
+    //intersectPrimitive() reports more than primitive 0, trace() only asks these objects
+    bool hasPrimitives = false;
+    //multiplies the albedo at texCoord if not NULL, owned by a TextureCache
+    const Texture* texture = NULL;
 };
 
 class Sphere : public Object
@@ -43,6 +77,9 @@ public:
 
 	bool intersects(const Ray& ray, float& t) const;
     void getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const;
+    vec3f getNormal(const vec3f& hit) const { return (hit - center).normalize(); }
+    float texCoordScale() const { return M_PI * radius; }
+    bool tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const;
 	float radius2() const;
 
 	float radius;
@@ -58,6 +95,9 @@ public:
     
     bool intersects(const Ray& ray, float& t) const;
     void getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const;
+    vec3f getNormal(const vec3f&) const { return Vec3Util::normalize(normal); }
+    float texCoordScale() const { return 1000; }
+    bool tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const;
     
     vec3f center;
     vec3f normal;
@@ -73,8 +113,102 @@ public:
     
     bool intersects(const Ray& ray, float& t) const;
     void getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const;
+    vec3f getNormal(const vec3f&) const { return Vec3Util::normalize(normal); }
+    float texCoordScale() const { return 2 * radius; }
+    bool tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const;
     
     vec3f center;
     vec3f normal;
     float radius;
 };
+
+//Moller-Trumbore, t and the barycentric coordinates straight from the edge vectors.
+//returns false if the ray misses the triangle p0 p1 p2 or hits it behind its origin
+inline bool intersectTriangle(const Ray& ray, const vec3f& p0, const vec3f& p1, const vec3f& p2, float& t)
+{
+    vec3f e1 = p1 - p0;
+    vec3f e2 = p2 - p0;
+    vec3f p = Vec3Util::cross(ray.dir, e2);
+    float det = e1.dot(p);
+    if (fabs(det) < 1e-12f)
+        return false;
+    
+    float invDet = 1 / det;
+    vec3f s = ray.pos - p0;
+    float u = s.dot(p) * invDet;
+    if (u < 0 || u > 1)
+        return false;
+    
+    vec3f q = Vec3Util::cross(s, e1);
+    float v = ray.dir.dot(q) * invDet;
+    if (v < 0 || u + v > 1)
+        return false;
+    
+    t = e2.dot(q) * invDet;
+    return t >= 0;
+}
+
+//The barycentric coordinates of p1 and p2 at [point] in the plane of the triangle p0 p1 p2,
+//from the areas of the sub triangles opposite them relative to the whole
+inline void triangleBarycentrics(const vec3f& point, const vec3f& p0, const vec3f& p1, const vec3f& p2, float& u, float& v)
+{
+    vec3f e1 = p1 - p0;
+    vec3f e2 = p2 - p0;
+    vec3f d = point - p0;
+    float d11 = e1.dot(e1), d12 = e1.dot(e2), d22 = e2.dot(e2);
+    float d1 = d.dot(e1), d2 = d.dot(e2);
+    float denom = d11 * d22 - d12 * d12;
+    u = denom != 0 ? (d22 * d1 - d12 * d2) / denom : 0;
+    v = denom != 0 ? (d11 * d2 - d12 * d1) / denom : 0;
+}
+
+//A single triangle, hit from both sides. Texture coordinates are the barycentric
+//coordinates of p1 and p2
+class Triangle : public Object
+{
+public:
+    Triangle(const vec3f& a, const vec3f& b, const vec3f& c) : p0(a), p1(b), p2(c)
+    {
+        normal = Vec3Util::cross(p1 - p0, p2 - p0).normalize();
+    }
+    Triangle(const vec3f& a, const vec3f& b, const vec3f& c, const vec3f& alb) : Triangle(a, b, c)
+    {
+        albedo = alb;
+    }
+    
+    bool intersects(const Ray& ray, float& t) const;
+    void getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const;
+    vec3f getNormal(const vec3f&) const { return normal; }
+    float texCoordScale() const;
+    bool tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const;
+    
+    vec3f p0, p1, p2;
+    //unit normal, p0 p1 p2 wind counter clockwise around it
+    vec3f normal;
+};
+
+//Places another object in the world with an arbitrary transform. Rays are moved into the
+//object's space with the cached inverse and normals back with the inverse transpose, so
+//the wrapped object only ever sees its own space. The wrapped object is not owned, its
+//albedo, type and texture are copied when the instance is created.
+class Instance : public Object
+{
+public:
+    Instance(const Object* obj, const Transform& o2w);
+    
+    bool intersects(const Ray& ray, float& t) const;
+    void getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const;
+    vec3f getNormal(const vec3f& hit) const;
+    //the primitive is the wrapped object's
+    bool intersectPrimitive(const Ray& ray, float& t, uint64_t& primitive) const;
+    void getPrimitiveSurfaceData(const vec3f& hit, uint64_t primitive, vec3f& normal, vec3f& texCoord) const;
+    vec3f getPrimitiveNormal(const vec3f& hit, uint64_t primitive) const;
+    float texCoordScale() const { return object->texCoordScale() * scale; }
+    bool tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const;
+    
+    const Object* object;
+    Transform objectToWorld;
+    Transform worldToObject;
+    //average world space length of one unit in object space
+    float scale;
+};
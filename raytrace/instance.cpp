@@ -0,0 +1,81 @@
+//
+//  instance.cpp
+//  theraytracer
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#include "geometry.h"
+
+Instance::Instance(const Object* obj, const Transform& o2w) : Object(obj->albedo), object(obj),
+objectToWorld(o2w), worldToObject(o2w.inverse())
+{
+    type = obj->type;
+    texture = obj->texture;
+    hasPrimitives = obj->hasPrimitives;
+    
+    //a volume scales by the determinant, its cube root is the average length scale
+    const mat44f& m = objectToWorld.getMatrix();
+    vec3f r0(m[0][0], m[0][1], m[0][2]), r1(m[1][0], m[1][1], m[1][2]), r2(m[2][0], m[2][1], m[2][2]);
+    scale = cbrtf(fabsf(r0.dot(r1.cross(r2))));
+}
+
+bool Instance::intersects(const Ray& ray, float& t) const
+{
+    uint64_t primitive;
+    return intersectPrimitive(ray, t, primitive);
+}
+
+void Instance::getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const
+{
+    vec3f localNormal;
+    object->getSurfaceData(worldToObject.point(hit), localNormal, texCoord);
+    normal = Vec3Util::normalize(objectToWorld.normal(localNormal));
+}
+
+vec3f Instance::getNormal(const vec3f& hit) const
+{
+    return Vec3Util::normalize(objectToWorld.normal(object->getNormal(worldToObject.point(hit))));
+}
+
+bool Instance::intersectPrimitive(const Ray& ray, float& t, uint64_t& primitive) const
+{
+    //the objects expect a unit direction, the object space distances are rescaled by its length.
+    //Objects return their nearest hit and the caller clips it to the world ray's tMax, so the
+    //local ray needs no range of its own
+    vec3f dir = worldToObject.vector(ray.dir);
+    float len = sqrtf(dir.dot(dir));
+    if (!(len > 0))
+        return false;
+    
+    Ray local(worldToObject.point(ray.pos), dir * (1 / len));
+    local.type = ray.type;
+    if (!object->intersectPrimitive(local, t, primitive))
+        return false;
+    
+    t /= len;
+    return true;
+}
+
+void Instance::getPrimitiveSurfaceData(const vec3f& hit, uint64_t primitive, vec3f& normal, vec3f& texCoord) const
+{
+    vec3f localNormal;
+    object->getPrimitiveSurfaceData(worldToObject.point(hit), primitive, localNormal, texCoord);
+    normal = Vec3Util::normalize(objectToWorld.normal(localNormal));
+}
+
+vec3f Instance::getPrimitiveNormal(const vec3f& hit, uint64_t primitive) const
+{
+    return Vec3Util::normalize(objectToWorld.normal(object->getPrimitiveNormal(worldToObject.point(hit), primitive)));
+}
+
+bool Instance::tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const
+{
+    size_t first = positions.size();
+    if (!object->tessellate(positions, indices))
+        return false;
+    
+    for (size_t i = first; i < positions.size(); i++)
+        positions[i] = objectToWorld.point(positions[i]);
+    return true;
+}
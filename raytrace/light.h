@@ -10,31 +10,44 @@
 #define light_hpp
 
 #include <stdio.h>
+#include <vector>
 #include "vec3.h"
 #include "matrix4x4.h"
+#include "transform.h"
+#include "alias_table.h"
+#include "image.h"
 
 class Light
 {
 public:
-    Light(const mat44f& l2w) : lightToWorld(l2w) {}
-    Light(const mat44f& l2w, const vec3f& c, const float& i) : lightToWorld(l2w),
+    Light(const Transform& l2w) : lightToWorld(l2w) {}
+    Light(const Transform& l2w, const vec3f& c, const float& i) : lightToWorld(l2w),
     color(c.x, c.y, c.z), intensity(i) {}
     virtual ~Light() {}
     
     virtual void getShadingInfo(const vec3f& hitPoint, vec3f& lightDir, vec3f& lightIntensity, float& dist) const = 0;
     
-    mat44f lightToWorld;
+    //Samples the light arriving at hitPoint with the random numbers (u1, u2) in [0, 1), for
+    //next-event estimation. The results mean what they mean for getShadingInfo(), with
+    //lightIntensity already divided by the pdf of the sampled direction. Lights that arrive
+    //from a single direction ignore (u1, u2).
+    virtual void sample(const vec3f& hitPoint, float /*u1*/, float /*u2*/, vec3f& lightDir, vec3f& lightIntensity, float& dist) const
+    {
+        getShadingInfo(hitPoint, lightDir, lightIntensity, dist);
+    }
+    
+    Transform lightToWorld;
     vec3f color;
     float intensity;
 };
 
-class DistantLight : public Light
+class DistantLight final : public Light
 {
 public:
-    DistantLight(const mat44f& l2w, const vec3f& c, const float& i) :
+    DistantLight(const Transform& l2w, const vec3f& c, const float& i) :
     Light(l2w, c, i)
     {
-        lightToWorld.multDirVec(vec3f(0,0,-1), dir);
+        dir = lightToWorld.vector(vec3f(0,0,-1));
         dir.normalize();
         //dir = vec3f(0,-5,-5).normalize();
     }
@@ -49,12 +62,12 @@ public:
     vec3f dir;
 };
 
-class PointLight : public Light
+class PointLight final : public Light
 {
 public:
-    PointLight(const mat44f& l2w, const vec3f& c, const float& i) : Light(l2w, c, i)
+    PointLight(const Transform& l2w, const vec3f& c, const float& i) : Light(l2w, c, i)
     {
-        l2w.multVec(vec3f(0,0,0), pos);
+        pos = lightToWorld.point(vec3f(0,0,0));
     }
     
     void getShadingInfo(const vec3f& P, vec3f& lightDir,
@@ -70,4 +83,105 @@ public:
     vec3f pos;
 };
 
+//Light from infinitely far away in every direction, the radiance of an HDR lat-long image.
+//The image is mapped around the y axis of light space, its top row straight up, and scaled
+//by color * intensity. Directions are importance sampled in constant time from an alias
+//table of the pixels weighted by luminance * sin(theta), which is their share of the sphere.
+class EnvironmentLight final : public Light
+{
+public:
+    EnvironmentLight(const Transform& l2w, const Image& image, const vec3f& c, const float& i) :
+    Light(l2w, c, i), worldToLight(l2w.inverse()), width(image.getWidth()), height(image.getHeight())
+    {
+        const vec3f scale = color * intensity;
+        std::vector<float> weights((size_t)width * height);
+        texels.resize((size_t)width * height);
+        for (int y = 0; y < height; y++)
+        {
+            float sinTheta = sinf((y + 0.5f) / height * M_PI);
+            for (int x = 0; x < width; x++)
+            {
+                size_t index = (size_t)y * width + x;
+                RGB pixel = image.get((unsigned int)index);
+                vec3f& texel = texels[index];
+                texel = vec3f(pixel.r * scale.x, pixel.g * scale.y, pixel.b * scale.z);
+                float luminance = 0.2126f * texel.x + 0.7152f * texel.y + 0.0722f * texel.z;
+                weights[index] = std::max(0.0f, luminance) * sinTheta;
+            }
+        }
+        distribution = AliasTable2D(weights, width, height);
+    }
+    
+    //the environment has no single direction, it only arrives through sample()
+    void getShadingInfo(const vec3f& /*hitPoint*/, vec3f& lightDir, vec3f& lightIntensity, float& dist) const
+    {
+        lightDir = vec3f(0, -1, 0);
+        lightIntensity = vec3f(0);
+        dist = INFINITY;
+    }
+    
+    void sample(const vec3f& /*hitPoint*/, float u1, float u2, vec3f& lightDir, vec3f& lightIntensity, float& dist) const
+    {
+        int x, y;
+        float fx, fy;
+        distribution.sample(u1, u2, x, y, fx, fy);
+        
+        float theta = (y + fy) / height * M_PI;
+        float phi = (x + fx) / width * 2 * M_PI - M_PI;
+        float sinTheta = sinf(theta);
+        vec3f dir = lightToWorld.vector(vec3f(sinTheta * cosf(phi), cosf(theta), sinTheta * sinf(phi))).normalize();
+        
+        //the pdf over the image is constant inside a pixel, over solid angle it is divided by
+        //the area of the lat-long mapping, 2 pi^2 sin(theta)
+        float pdf = distribution.pdf(x, y) * width * height / (2 * M_PI * M_PI * sinTheta);
+        lightDir = dir * -1;
+        dist = INFINITY;
+        //a lambertian surface reflects albedo / pi of it
+        lightIntensity = pdf > 0 ? texels[(size_t)y * width + x] * (1 / (M_PI * pdf)) : vec3f(0);
+    }
+    
+    //the radiance arriving from direction [dir], towards -dir
+    vec3f radiance(const vec3f& dir) const
+    {
+        vec3f d = worldToLight.vector(dir).normalize();
+        float theta = acosf(std::max(-1.0f, std::min(1.0f, d.y)));
+        float phi = atan2f(d.z, d.x) + M_PI;
+        int x = std::min(width - 1, (int)(phi / (2 * M_PI) * width));
+        int y = std::min(height - 1, (int)(theta / M_PI * height));
+        return texels[(size_t)y * width + x];
+    }
+    
+private:
+    Transform worldToLight;
+    int width, height;
+    std::vector<vec3f> texels;
+    AliasTable2D distribution;
+};
+
+//The lights of a scene grouped by type. Shading loops over each group on its own, where
+//the calls are direct and inlined; lights of other types go through the virtual interface
+struct LightList
+{
+    explicit LightList(const std::vector<Light*>& lights)
+    {
+        for (size_t i = 0; i < lights.size(); i++)
+        {
+            if (const DistantLight* light = dynamic_cast<const DistantLight*>(lights[i]))
+                distant.push_back(light);
+            else if (const PointLight* light = dynamic_cast<const PointLight*>(lights[i]))
+                point.push_back(light);
+            else if (const EnvironmentLight* light = dynamic_cast<const EnvironmentLight*>(lights[i]))
+                environment.push_back(light);
+            else
+                other.push_back(lights[i]);
+        }
+    }
+    
+    std::vector<const DistantLight*> distant;
+    std::vector<const PointLight*> point;
+    //sampled by the path integrator and seen by rays that miss everything
+    std::vector<const EnvironmentLight*> environment;
+    std::vector<const Light*> other;
+};
+
 #endif /* light_h */
@@ -8,230 +8,333 @@
 
 #include <iostream>
 #include <vector>
-#include <time.h>
 #include <algorithm>
-#include <utility>
-#include <limits>
+#include <string>
+#include <chrono>
 
 #include "vec3.h"
 #include "matrix4x4.h"
+#include "transform.h"
 #include "math_macros.h"
-#include "ray.h"
 #include "image.h"
+#include "tonemap.h"
 #include "geometry.h"
+#include "compressed_mesh.h"
 #include "light.h"
+#include "sampler.h"
+#include "rgb2spec.h"
+#include "texture_cache.h"
+#include "render_engine.h"
+#include "scenes.h"
 
-struct Options
+//Renders the crop window into a framebuffer of pixel format [Format], finalizes
+//it to 8-bit pixels with [finalizer] and writes those to [path] (PPM, PNG or QOI by extension)
+template <typename Format>
+int renderToFile(const char* path, const Options& options, const Scene& scene, const Finalizer& finalizer)
 {
-    uint32_t width;
-    uint32_t height;
-    uint32_t maxDepth;
-    float fov;
-    vec3f backgroundColor;
-};
-
-struct IHitInfo
-{
-    const Object* hitObject = NULL;
-    float distance = INFINITY;
-};
-
-inline vec3f mix(const vec3f& a, const vec3f& b, const float& t)
-{
-    return vec3f(a.x*(1 - t) + b.x*t, a.y*(1 - t) + b.y*t, a.z*(1 - t) + b.z*t);
-}
-
-inline vec3f reflect(const vec3f& N, const vec3f& I)
-{
-    vec3f B = N * N.dot(I);
-    vec3f A = I - B;
-    return A - B;
-}
-
-void computeRay(Ray& ray, const uint32_t x, const uint32_t y, const Options& options, const vec3f& camOrig, const mat44f& camToWorld)
-{
-    float aspect = (float)options.width / (float)options.height;
-    float tanfov = tan(options.fov * 0.5f);
-    
-    
-    float xx = (2 * (x + 0.5) / (float)options.width - 1) * aspect * tanfov;
-    float yy = (1 - 2 * (y + 0.5) / (float)options.height) * tanfov;
-    
-    vec3f camWorldPos;
-    vec3f rayWorldPos;
+    CropWindow crop = resolveCrop(options);
+    if (crop.empty())
+        return -1;
     
-    camToWorld.multVec(camOrig, camWorldPos);
-    camToWorld.multVec(vec3f(xx, yy, -1), rayWorldPos);
-    
-    ray.pos = camWorldPos;
-    ray.dir = (rayWorldPos - camWorldPos).normalize();
-}
-
-bool trace(const Ray& ray, const std::vector<Object*>& objects, IHitInfo& hitInfo)
-{
-    std::vector<Object*>::const_iterator it = objects.begin();
-    float t = INFINITY;
-    hitInfo.distance = INFINITY;
-    for(; it != objects.end(); it++)
+    ImageT<Format> framebuffer(crop.x1 - crop.x0, crop.y1 - crop.y0);
+    if (options.timeBudget > 0)
     {
-        if((*it)->intersects(ray, t) && t < hitInfo.distance && t < ray.tMax)
-        {
-            hitInfo.hitObject = (*it);
-            hitInfo.distance = t;
-        }
+        RenderQuality quality = renderWithBudget(options, scene, crop, framebuffer);
+        if (quality.empty())
+            std::cout << "time budget of " << options.timeBudget << " ms: no level finished in "
+                      << quality.milliseconds << " ms" << std::endl;
+        else
+            std::cout << "time budget of " << options.timeBudget << " ms: reached 1/" << quality.resolutionDivisor
+                      << " resolution, " << quality.samplesPerPixel << " spp in " << quality.milliseconds << " ms" << std::endl;
     }
+    else
+        render(options, scene, crop, framebuffer);
     
-    return (hitInfo.hitObject != NULL);
+    Image8 img(framebuffer.getWidth(), framebuffer.getHeight());
+    finalizer.run(framebuffer, img, options.numThreads);
+    return writeImage(path, img, options.numThreads);
 }
 
-vec3f castRay(const Ray& ray, const std::vector<Object*>& objects,
-              const std::vector<Light*>& lights, const Options& options, const float& depth = 0)
+//Renders the crop window ray traced and hybrid and compares the two. The hybrid image
+//passes if the RMS difference of its channels is at most [tolerance]. Options that render
+//both images ray traced fail, there would be nothing to compare.
+bool verifyHybrid(const Options& options, const Scene& scene, float tolerance)
 {
+    if (options.integrator != kIntegratorWhitted || options.samplesPerPixel != 1)
+    {
+        std::cout << "FAIL (hybrid rendering needs the whitted integrator and --spp 1)" << std::endl;
+        return false;
+    }
     
-    if(depth > options.maxDepth)
-        return options.backgroundColor;
+    CropWindow crop = resolveCrop(options);
+    if (crop.empty())
+        return false;
     
-    float bias = 1e-5;
-    vec3f hitColor = options.backgroundColor;
-    IHitInfo info;
+    Image traced(crop.x1 - crop.x0, crop.y1 - crop.y0), hybrid(crop.x1 - crop.x0, crop.y1 - crop.y0);
+    Image* images[2] = { &traced, &hybrid };
+    double ms[2];
+    for (int i = 0; i < 2; i++)
+    {
+        Options o = options;
+        o.hybrid = (i == 1);
+        auto start = std::chrono::high_resolution_clock::now();
+        render(o, scene, crop, *images[i]);
+        ms[i] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
     
-    if (trace(ray, objects, info))
+    size_t numPixels = (size_t)traced.getWidth() * traced.getHeight();
+    double sumSquares = 0;
+    float maxDiff = 0;
+    size_t numDiffering = 0;
+    for (size_t i = 0; i < numPixels; i++)
     {
-        hitColor = vec3f();
-        
-        vec3f pHit = ray.pos + (ray.dir * info.distance);
-        vec3f norm;
-        vec3f texCoord;
-        
-        info.hitObject->getSurfaceData(pHit, norm, texCoord);
-        
-        switch (info.hitObject->type) {
-            case kDiffuse:
-            {
-                for(int i = 0; i < lights.size(); i++)
-                {
-                    vec3f lightDir;
-                    vec3f lightIntensity;
-                    float lightDist = 0;
-                    
-                    lights[i]->getShadingInfo(pHit, lightDir, lightIntensity, lightDist);
-                    
-                    IHitInfo shadowInfo;
-                    Ray shadowRay = Ray(pHit + norm * bias, lightDir * -1);
-                    shadowRay.type = kRayTypeShadow;
-                    shadowRay.tMax = lightDist;
-                    
-                    bool vis = !trace(shadowRay, objects, shadowInfo);
-                    
-                    hitColor += info.hitObject->albedo * lightIntensity * vis * std::max(0.0f, norm.dot(lightDir * -1));
-                }
-                
-                break;
-            }
-                
-            case kReflection:
-            {
-                vec3f R = reflect(norm, ray.dir);
-                Ray reflectionRay(pHit + norm * bias, R);
-                hitColor += castRay(reflectionRay, objects, lights, options, depth + 1) * 0.6f;
-                break;
-            }
-                
-            default:
-                break;
-        }
+        const RGB& a = traced.pixels[i];
+        const RGB& b = hybrid.pixels[i];
+        float d[3] = { fabsf(a.r - b.r), fabsf(a.g - b.g), fabsf(a.b - b.b) };
+        sumSquares += d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+        maxDiff = std::max(maxDiff, std::max(d[0], std::max(d[1], d[2])));
+        numDiffering += (d[0] > 0 || d[1] > 0 || d[2] > 0);
     }
+    double rmse = sqrt(sumSquares / (3 * numPixels));
     
-    clamp<float>(hitColor.x, 0.0f, 1);
-    clamp<float>(hitColor.y, 0.0f, 1);
-    clamp<float>(hitColor.z, 0.0f, 1);
+    std::cout << "ray traced " << ms[0] << " ms, hybrid " << ms[1] << " ms" << std::endl;
+    std::cout << "hybrid vs ray traced: rmse " << rmse << ", max difference " << maxDiff << ", "
+              << numDiffering << " of " << numPixels << " pixels differ" << std::endl;
     
-    return hitColor;
+    bool pass = rmse <= tolerance;
+    std::cout << (pass ? "PASS" : "FAIL") << " (tolerance " << tolerance << ")" << std::endl;
+    return pass;
 }
 
-void render(const Options& options, const std::vector<Object*>& objects,
-            const std::vector<Light*>& lights)
-{
-    vec3f* frameBuffer = new vec3f[options.width * options.height];
-    if (!frameBuffer)
-        return;
+int main(int argc, const char * argv[]) {
+    
+    Scene scene;
+    Disk* disk = buildDefaultScene(scene);
+    const std::vector<Object*>& objects = scene.objects;
+    std::vector<Light*>& lights = scene.lights;
     
-    vec3f* pix = frameBuffer;
+    std::cout << "num objects: " << objects.size() << std::endl;
+    
+    Options options;
+    options.width = 1920;
+    options.height = 1080;
+    options.fov = 70 * DEG_TO_RAD;
+    options.backgroundColor = vec3f(/*66/255.0f, 134/255.0f, 244/255.0f*/0);
+    options.maxDepth = 3;
     
-    mat44f camToWorld = Mat44Util::look_at(vec3f(0, 10, -20), vec3f(0, 0, -1));
+    const char* samplerName = "independent";
     
-    for (uint32_t y = 0; y < options.height; y++)
+    //usage: raytrace [--spp n] [--crop x0 y0 x1 y1] [--checkpoint path] [--checkpoint-interval n] [--threads n]
+    //                [--sampler independent|stratified|halton|sobol|bluenoise]
+    //                [--integrator whitted|path] [--rr-depth n] [--spectral [rgb2spec table]]
+    //                [--format f32|f16|u16|u8] [--exposure stops] [--tonemap clamp|reinhard|aces]
+    //                [--linear] [--no-dither] [--output path.ppm|.png|.qoi]
+    //                [--texture floor.ppm] [--texture-budget megabytes]
+    //                [--hybrid] [--verify-hybrid [rms tolerance]] [--time-budget ms]
+    //                [--envmap sky.pfm [intensity]] [--mesh mesh.cbvh] [--build-mesh triangles.bin mesh.cbvh]
+    //the format is the pixel format of the framebuffer in memory, f32 and f16 keep the radiance
+    //above 1 for the tone curve. The output is 8 bits per channel, sRGB encoded unless --linear,
+    //and written as PNG or QOI for a .png or .qoi path and as PPM otherwise.
+    //--build-mesh turns a file of nine floats per triangle into a compressed mesh and exits,
+    //--mesh adds such a mesh to the scene, read on demand however large it is
+    bool spectral = false;
+    const char* rgb2specPath = "rgb2spec.bin";
+    std::string pixelFormat = "f32";
+    const char* outputPath = "output_raytrace.ppm";
+    const char* texturePath = NULL;
+    size_t textureBudget = 256;
+    const char* envmapPath = NULL;
+    float envmapIntensity = 1;
+    const char* meshPath = NULL;
+    const char* meshSourcePath = NULL;
+    bool verify = false;
+    float verifyTolerance = 1e-3f;
+    FinalizeOptions finalizeOptions;
+    for (int i = 1; i < argc; i++)
     {
-        for (uint32_t x = 0; x < options.width; x++)
+        std::string arg = argv[i];
+        if (arg == "--spp" && i + 1 < argc)
+            options.samplesPerPixel = std::max(1, atoi(argv[++i]));
+        else if (arg == "--crop" && i + 4 < argc)
+        {
+            options.crop.x0 = atoi(argv[++i]);
+            options.crop.y0 = atoi(argv[++i]);
+            options.crop.x1 = atoi(argv[++i]);
+            options.crop.y1 = atoi(argv[++i]);
+        }
+        else if (arg == "--checkpoint" && i + 1 < argc)
+            options.checkpointPath = argv[++i];
+        else if (arg == "--checkpoint-interval" && i + 1 < argc)
+            options.checkpointInterval = atoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            options.numThreads = atoi(argv[++i]);
+        else if (arg == "--sampler" && i + 1 < argc)
+            samplerName = argv[++i];
+        else if (arg == "--integrator" && i + 1 < argc)
+        {
+            std::string name = argv[++i];
+            options.integrator = (name == "path") ? kIntegratorPath : kIntegratorWhitted;
+        }
+        else if (arg == "--rr-depth" && i + 1 < argc)
+            options.rouletteDepth = atoi(argv[++i]);
+        else if (arg == "--spectral")
+        {
+            spectral = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                rgb2specPath = argv[++i];
+        }
+        else if (arg == "--format" && i + 1 < argc)
+            pixelFormat = argv[++i];
+        else if (arg == "--exposure" && i + 1 < argc)
+            finalizeOptions.exposure = (float)atof(argv[++i]);
+        else if (arg == "--tonemap" && i + 1 < argc)
+        {
+            if (!parseToneCurve(argv[++i], finalizeOptions.toneCurve))
+            {
+                std::cout << "unknown tone curve " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--linear")
+            finalizeOptions.transfer = kTransferLinear;
+        else if (arg == "--no-dither")
+            finalizeOptions.dither = false;
+        else if (arg == "--output" && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (arg == "--texture" && i + 1 < argc)
+            texturePath = argv[++i];
+        else if (arg == "--texture-budget" && i + 1 < argc)
+            textureBudget = std::max(1, atoi(argv[++i]));
+        else if (arg == "--envmap" && i + 1 < argc)
         {
-            Ray primRay;
-            computeRay(primRay, x, y, options, vec3f(0), camToWorld);
-            *(pix++) = castRay(primRay, objects, lights, options);
+            envmapPath = argv[++i];
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                envmapIntensity = (float)atof(argv[++i]);
+        }
+        else if (arg == "--mesh" && i + 1 < argc)
+            meshPath = argv[++i];
+        else if (arg == "--build-mesh" && i + 2 < argc)
+        {
+            meshSourcePath = argv[++i];
+            meshPath = argv[++i];
+        }
+        else if (arg == "--hybrid")
+            options.hybrid = true;
+        else if (arg == "--time-budget" && i + 1 < argc)
+            options.timeBudget = std::max(0.0, atof(argv[++i]));
+        else if (arg == "--verify-hybrid")
+        {
+            verify = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                verifyTolerance = (float)atof(argv[++i]);
         }
     }
     
-    Image img(options.width, options.height);
-    
-    for (int i = 0; i < options.width * options.height; i++)
+    if (meshSourcePath)
     {
-        vec3f color = frameBuffer[i];
-        img.pixels[i].r = color.x;
-        img.pixels[i].g = color.y;
-        img.pixels[i].b = color.z;
+        MappedFile source;
+        if (!source.open(meshSourcePath) || source.size() % (9 * sizeof(float)) != 0)
+        {
+            std::cout << "failed to read triangles from " << meshSourcePath << std::endl;
+            return 1;
+        }
+        //the build visits the triangles in no particular order
+        source.advise(MappedFile::kAccessRandom);
+        uint64_t count = source.size() / (9 * sizeof(float));
+        if (!CompressedMesh::build((const float*)source.data(), count, meshPath))
+        {
+            std::cout << "failed to build " << meshPath << std::endl;
+            return 1;
+        }
+        std::cout << "built " << meshPath << " of " << count << " triangles" << std::endl;
+        return 0;
     }
     
-    writePPM("output_raytrace.ppm", img);
-    delete[] frameBuffer;
-}
-
-inline float rand01()
-{
-    return (float)rand() / (float)RAND_MAX;
-}
-
-int main(int argc, const char * argv[]) {
-    
-    srand((unsigned int)(time(NULL)));
-    vec3f v(5,12,12);
-    std::vector<Object*> objects;
-    std::vector<Light*> lights;
-    
-    Disk* disk = new Disk(vec3f(0,-1.0f,0), vec3f(0,1,0), 30, vec3f(0.3f));
-    disk->type = kDiffuse;
+    Sampler* sampler = createSampler(samplerName, options.samplesPerPixel, options.width);
+    if (!sampler)
+    {
+        std::cout << "unknown sampler " << samplerName << std::endl;
+        return 1;
+    }
+    options.sampler = sampler;
     
-    objects.push_back(disk);
-    objects.push_back(new Sphere(vec3f(-5,2,10), 3, vec3f(0.5f)));
-    objects.push_back(new Sphere(vec3f(5,2,5), 3, vec3f(0.18f)));
+    //the upsampling table is generated on first use and memory-mapped from then on
+    RGB2Spec rgb2spec;
+    if (spectral)
+    {
+        if (!rgb2spec.load(rgb2specPath))
+        {
+            std::cout << "generating " << rgb2specPath << std::endl;
+            if (!RGB2Spec::generate(rgb2specPath, 32, options.numThreads) || !rgb2spec.load(rgb2specPath))
+            {
+                std::cout << "failed to create " << rgb2specPath << std::endl;
+                return 1;
+            }
+        }
+        options.rgb2spec = &rgb2spec;
+    }
     
-    Sphere* refletionSphere = new Sphere(vec3f(0,2,5), 2.0f, vec3f(0.8f));
-    refletionSphere->type = kReflection;
-    objects.push_back(refletionSphere);
+    //textures are paged in tile by tile, the budget bounds their memory however large they are
+    TextureCache textureCache(textureBudget << 20);
+    if (texturePath)
+    {
+        disk->texture = textureCache.addTexture(texturePath);
+        if (!disk->texture)
+        {
+            std::cout << "failed to open texture " << texturePath << std::endl;
+            return 1;
+        }
+    }
     
-    mat44f distLightMat;
-    distLightMat[2][0] = 3;
-    distLightMat[2][1] = 5;
-    distLightMat[2][2] = 4;
-    lights.push_back(new DistantLight(distLightMat, vec3f(1.0f, 1.0f, 1.0f), 0.0f));
+    //the environment replaces the background color, diffuse surfaces are lit by it in path traced renders
+    if (envmapPath)
+    {
+        Image* envmap = readPFM(envmapPath);
+        if (!envmap)
+        {
+            std::cout << "failed to read environment map " << envmapPath << std::endl;
+            return 1;
+        }
+        lights.push_back(new EnvironmentLight(Transform(), *envmap, vec3f(1), envmapIntensity));
+        delete envmap;
+    }
     
-    distLightMat[3][0] = -10;
-    distLightMat[3][1] = 3;
-    distLightMat[3][2] = 3.0f;
-    lights.push_back(new PointLight(distLightMat, vec3f(0.3f, 0.3f, 1.0f), 2000));
+    if (meshPath)
+    {
+        CompressedMesh* mesh = new CompressedMesh(vec3f(0.18f));
+        scene.objects.push_back(mesh);
+        if (!mesh->open(meshPath))
+        {
+            std::cout << "failed to open mesh " << meshPath << std::endl;
+            return 1;
+        }
+        std::cout << "mesh of " << mesh->getTriangleCount() << " triangles" << std::endl;
+    }
     
-    distLightMat[3][0] = 8;
-    distLightMat[3][1] = 5
-    ;
-    distLightMat[3][2] = -2.5f;
-    lights.push_back(new PointLight(distLightMat, vec3f(0.3f, 1.0f, 0.4f), 1500));
+    if (options.hybrid && !verify && (options.integrator != kIntegratorWhitted || options.samplesPerPixel != 1))
+        std::cout << "hybrid rendering needs the whitted integrator and --spp 1, ray tracing everything" << std::endl;
     
-    std::cout << "num objects: " << objects.size() << std::endl;
+    if (verify)
+    {
+        bool pass = verifyHybrid(options, scene, verifyTolerance);
+        delete sampler;
+        return pass ? 0 : 1;
+    }
     
-    Options options;
-    options.width = 1920;
-    options.height = 1080;
-    options.fov = 70 * DEG_TO_RAD;
-    options.backgroundColor = vec3f(/*66/255.0f, 134/255.0f, 244/255.0f*/0);
-    options.maxDepth = 3;
+    Finalizer finalizer(finalizeOptions);
+    if (pixelFormat == "f16")
+        renderToFile<PixelFormatF16>(outputPath, options, scene, finalizer);
+    else if (pixelFormat == "u16")
+        renderToFile<PixelFormatU16>(outputPath, options, scene, finalizer);
+    else if (pixelFormat == "u8")
+        renderToFile<PixelFormatU8>(outputPath, options, scene, finalizer);
+    else
+        renderToFile<PixelFormatF32>(outputPath, options, scene, finalizer);
     
-    render(options, objects, lights);
+    if (texturePath)
+    {
+        std::cout << "texture cache: " << textureCache.hits << " hits, " << textureCache.misses << " misses, "
+                  << textureCache.evictions << " evictions, peak " << (textureCache.peakBytes >> 10) << " KB" << std::endl;
+    }
+    delete sampler;
 }
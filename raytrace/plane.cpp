@@ -31,3 +31,21 @@ void Plane::getSurfaceData(const vec3f &hit, vec3f &normal, vec3f &texCoord) con
     texCoord.x = fmodf(planePos.x, bounds)/bounds;
     texCoord.y = fmodf(planePos.y, bounds)/bounds;
 }
+
+//A square far beyond anything in view, the part of the horizon it leaves out is below a pixel
+bool Plane::tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const
+{
+    const float extent = 1e6f;
+    vec3f tangent, bitangent;
+    Vec3Util::orthonormalBasis(Vec3Util::normalize(normal), tangent, bitangent);
+    
+    uint32_t first = (uint32_t)positions.size();
+    positions.push_back(center + (tangent + bitangent) * -extent);
+    positions.push_back(center + (tangent - bitangent) * extent);
+    positions.push_back(center + (tangent + bitangent) * extent);
+    positions.push_back(center + (bitangent - tangent) * extent);
+    
+    uint32_t quad[6] = { first, first + 1, first + 2, first, first + 2, first + 3 };
+    indices.insert(indices.end(), quad, quad + 6);
+    return true;
+}
@@ -16,6 +16,8 @@ enum RayType
 {
     kRayTypePrimary,
     kRayTypeShadow,
+    //reflections and path bounces
+    kRayTypeSecondary,
 };
 
 class Ray
@@ -0,0 +1,1493 @@
+//
+//  render_engine.cpp
+//  theraytracer
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#include "render_engine.h"
+
+#include <iostream>
+#include <algorithm>
+#include <limits>
+
+#include "math_macros.h"
+#include "ray.h"
+#include "checkpoint.h"
+#include "sampler.h"
+#include "parallel.h"
+#include "sampled_spectrum.h"
+#include "texture_cache.h"
+#include "gbuffer.h"
+
+struct IHitInfo
+{
+    const Object* hitObject = NULL;
+    float distance = INFINITY;
+    //the primitive of hitObject that was hit
+    uint64_t primitive = 0;
+};
+
+//fraction of the incoming radiance a kReflection surface reflects
+const float kMirrorReflectance = 0.6f;
+//offset along the normal for rays leaving a surface, avoids self intersection
+const float kRayBias = 1e-5f;
+
+inline vec3f mix(const vec3f& a, const vec3f& b, const float& t)
+{
+    return vec3f(a.x*(1 - t) + b.x*t, a.y*(1 - t) + b.y*t, a.z*(1 - t) + b.z*t);
+}
+
+inline vec3f reflect(const vec3f& N, const vec3f& I)
+{
+    vec3f B = N * N.dot(I);
+    vec3f A = I - B;
+    return A - B;
+}
+
+//Maps (u1, u2) in [0, 1)^2 to a direction in the hemisphere around N with pdf cos(theta) / pi
+inline vec3f sampleCosineHemisphere(const vec3f& N, const float u1, const float u2)
+{
+    vec3f T, B;
+    Vec3Util::orthonormalBasis(N, T, B);
+    
+    float r = sqrtf(u1);
+    float phi = 2 * M_PI * u2;
+    float z = sqrtf(std::max(0.0f, 1 - u1));
+    return T * (r * cosf(phi)) + B * (r * sinf(phi)) + N * z;
+}
+
+//x and y are continuous raster coordinates, (x + 0.5, y + 0.5) is the center of pixel (x, y)
+void computeRay(Ray& ray, const float x, const float y, const Options& options, const vec3f& camOrig, const Transform& camToWorld)
+{
+    float aspect = (float)options.width / (float)options.height;
+    float tanfov = tan(options.fov * 0.5f);
+    
+    
+    float xx = (2 * (double)x / (float)options.width - 1) * aspect * tanfov;
+    float yy = (1 - 2 * (double)y / (float)options.height) * tanfov;
+    
+    ray.pos = camToWorld.point(camOrig);
+    ray.dir = camToWorld.vector(vec3f(xx, yy, -1)).normalize();
+}
+
+//What the rays of the tile the thread renders depend on, which RenderEngine uses to find
+//the tiles an edit affects. NULL outside of engine tiles
+thread_local TileFootprint* footprint = NULL;
+//rays trace() was called for on this thread, renders add what they traced to Options::rayCount
+thread_local uint64_t raysTraced = 0;
+
+bool trace(const Ray& ray, const std::vector<Object*>& objects, IHitInfo& hitInfo)
+{
+    raysTraced++;
+
+    std::vector<Object*>::const_iterator it = objects.begin();
+    float t = INFINITY;
+    uint64_t primitive = 0;
+    hitInfo.distance = INFINITY;
+    for(; it != objects.end(); it++)
+    {
+        //one virtual call per object for single surfaces
+        bool hit = (*it)->hasPrimitives ? (*it)->intersectPrimitive(ray, t, primitive) : (*it)->intersects(ray, t);
+        if(hit && t < hitInfo.distance && t < ray.tMax)
+        {
+            hitInfo.hitObject = (*it);
+            hitInfo.distance = t;
+            hitInfo.primitive = (*it)->hasPrimitives ? primitive : 0;
+        }
+    }
+    
+    if (footprint)
+    {
+        if (hitInfo.hitObject)
+            footprint->objects.insert(hitInfo.hitObject);
+        //primary rays are covered by the screen bounds of an edit
+        if (ray.type != kRayTypePrimary)
+            footprint->addSegment(ray.pos, ray.dir, std::min(hitInfo.distance, ray.tMax));
+    }
+    return (hitInfo.hitObject != NULL);
+}
+
+//Angle between the primary rays of neighbouring pixels
+inline float pixelSpreadAngle(const Options& options)
+{
+    return 2 * tanf(options.fov * 0.5f) / options.height;
+}
+
+//The albedo of [object] at [texCoord]. A texture is filtered over the footprint of a pixel
+//cone that has spread over [pathLength] (a lower bound past curved or diffuse bounces).
+inline vec3f surfaceAlbedo(const Object* object, const vec3f& texCoord, float pathLength, const Options& options)
+{
+    if (!object->texture)
+        return object->albedo;
+    
+    float footprint = pathLength * pixelSpreadAngle(options) / object->texCoordScale();
+    return object->albedo * object->texture->sample(texCoord.x, texCoord.y, footprint);
+}
+
+//Adds the light [lightIntensity] arriving along [lightDir] from [lightDist] away, as
+//getShadingInfo() describes it, reflected towards the viewer by the diffuse surface point
+//pHit with reflectance [albedo]. The light is tested for visibility with a shadow ray
+template<typename ColorModel>
+inline void addLight(typename ColorModel::Color& hitColor, const vec3f& lightDir, const vec3f& lightIntensity,
+                     float lightDist, const vec3f& pHit, const vec3f& norm, const typename ColorModel::Color& albedo,
+                     const std::vector<Object*>& objects, const ColorModel& colorModel)
+{
+    //a switched off light adds nothing, not even a shadow ray
+    if (lightIntensity.x == 0 && lightIntensity.y == 0 && lightIntensity.z == 0)
+        return;
+    
+    IHitInfo shadowInfo;
+    Ray shadowRay = Ray(pHit + norm * kRayBias, lightDir * -1);
+    shadowRay.type = kRayTypeShadow;
+    shadowRay.tMax = lightDist;
+    
+    bool vis = !trace(shadowRay, objects, shadowInfo);
+    
+    hitColor += albedo * colorModel.illuminant(lightIntensity) * vis * std::max(0.0f, norm.dot(lightDir * -1));
+}
+
+//Adds the radiance reflected towards the viewer by the diffuse surface point pHit with
+//reflectance [albedo] from each light of [lights], all of type LightT
+template<typename LightT, typename ColorModel>
+void addDirectLighting(typename ColorModel::Color& hitColor, const std::vector<const LightT*>& lights,
+                       const vec3f& pHit, const vec3f& norm, const typename ColorModel::Color& albedo,
+                       const std::vector<Object*>& objects, const ColorModel& colorModel)
+{
+    for (size_t i = 0; i < lights.size(); i++)
+    {
+        vec3f lightDir;
+        vec3f lightIntensity;
+        float lightDist = 0;
+        
+        //the light types are final, so only calls through the base class are dispatched
+        lights[i]->getShadingInfo(pHit, lightDir, lightIntensity, lightDist);
+        addLight(hitColor, lightDir, lightIntensity, lightDist, pHit, norm, albedo, objects, colorModel);
+    }
+}
+
+//addDirectLighting() with one sample of each light, drawn from [samples]
+template<typename LightT, typename ColorModel>
+void addSampledLighting(typename ColorModel::Color& hitColor, const std::vector<const LightT*>& lights,
+                        const vec3f& pHit, const vec3f& norm, const typename ColorModel::Color& albedo,
+                        const std::vector<Object*>& objects, const ColorModel& colorModel, SampleStream& samples)
+{
+    for (size_t i = 0; i < lights.size(); i++)
+    {
+        vec3f lightDir;
+        vec3f lightIntensity;
+        float lightDist = 0;
+        
+        float u1 = samples.next01();
+        float u2 = samples.next01();
+        lights[i]->sample(pHit, u1, u2, lightDir, lightIntensity, lightDist);
+        addLight(hitColor, lightDir, lightIntensity, lightDist, pHit, norm, albedo, objects, colorModel);
+    }
+}
+
+//Radiance reflected towards the viewer by the diffuse surface point pHit with reflectance
+//[albedo] from all lights, one specialized loop per light type
+template<typename ColorModel>
+typename ColorModel::Color directLighting(const vec3f& pHit, const vec3f& norm,
+                                          const typename ColorModel::Color& albedo,
+                                          const std::vector<Object*>& objects, const LightList& lights,
+                                          const ColorModel& colorModel)
+{
+    typename ColorModel::Color hitColor;
+    addDirectLighting(hitColor, lights.distant, pHit, norm, albedo, objects, colorModel);
+    addDirectLighting(hitColor, lights.point, pHit, norm, albedo, objects, colorModel);
+    addDirectLighting(hitColor, lights.other, pHit, norm, albedo, objects, colorModel);
+    return hitColor;
+}
+
+//Radiance along [ray] where it leaves the scene: the environment lights, or the background
+//color if there are none
+template<typename ColorModel>
+typename ColorModel::Color missRadiance(const Ray& ray, const LightList& lights, const Options& options,
+                                        const ColorModel& colorModel)
+{
+    if (lights.environment.empty())
+        return colorModel.illuminant(options.backgroundColor);
+    
+    vec3f environment(0);
+    for (size_t i = 0; i < lights.environment.size(); i++)
+        environment += lights.environment[i]->radiance(ray.dir);
+    return colorModel.illuminant(environment);
+}
+
+template<typename ColorModel>
+typename ColorModel::Color castRay(const Ray& ray, const std::vector<Object*>& objects,
+                                   const LightList& lights, const Options& options,
+                                   const ColorModel& colorModel, const float& depth = 0, float pathLength = 0);
+
+//Shading kernels, one per material and whether the material is textured. Everything that
+//depends on them is resolved at compile time, and kReadsTexCoord tells the callers whether
+//to compute texture coordinates at all.
+//shade() is the Whitted-style radiance leaving the point pHit of [object] along -ray.dir,
+//where [ray] hit it after [distance]. scatter() is one vertex of castPath(): it adds the
+//light gathered at the vertex to [radiance] and continues [ray], or returns false if the
+//path ends.
+template<ObjectType kType, bool kTextured>
+struct MaterialKernel;
+
+template<bool kTextured>
+struct MaterialKernel<kDiffuse, kTextured>
+{
+    static const bool kReadsTexCoord = kTextured;
+    
+    template<typename ColorModel>
+    static typename ColorModel::Color albedo(const Object* object, const vec3f& texCoord, float pathLength,
+                                             const Options& options, const ColorModel& colorModel)
+    {
+        return colorModel.reflectance(kTextured ? surfaceAlbedo(object, texCoord, pathLength, options) : object->albedo);
+    }
+    
+    template<typename ColorModel>
+    static typename ColorModel::Color shade(const Ray& /*ray*/, const Object* object, const vec3f& pHit,
+                                            const vec3f& norm, const vec3f& texCoord, float distance,
+                                            const std::vector<Object*>& objects, const LightList& lights,
+                                            const Options& options, const ColorModel& colorModel,
+                                            const float& /*depth*/, float pathLength)
+    {
+        return directLighting(pHit, norm, albedo(object, texCoord, pathLength + distance, options, colorModel),
+                              objects, lights, colorModel);
+    }
+    
+    template<typename ColorModel>
+    static bool scatter(Ray& ray, const Object* object, const vec3f& pHit, const vec3f& norm, const vec3f& texCoord,
+                        float pathLength, typename ColorModel::Color& throughput, typename ColorModel::Color& radiance,
+                        const std::vector<Object*>& objects, const LightList& lights, const Options& options,
+                        const ColorModel& colorModel, SampleStream& samples)
+    {
+        typename ColorModel::Color reflectance = albedo(object, texCoord, pathLength, options, colorModel);
+        radiance += throughput * directLighting(pHit, norm, reflectance, objects, lights, colorModel);
+        if (!lights.environment.empty())
+        {
+            typename ColorModel::Color environment;
+            addSampledLighting(environment, lights.environment, pHit, norm, reflectance, objects, colorModel, samples);
+            radiance += throughput * environment;
+        }
+        
+        //a lambertian brdf (albedo / pi) sampled proportional to cos(theta) has weight albedo
+        float u1 = samples.next01();
+        float u2 = samples.next01();
+        ray = Ray(pHit + norm * kRayBias, sampleCosineHemisphere(norm, u1, u2));
+        ray.type = kRayTypeSecondary;
+        throughput = throughput * reflectance;
+        return true;
+    }
+};
+
+//a perfect mirror ignores its albedo and texture
+template<bool kTextured>
+struct MaterialKernel<kReflection, kTextured>
+{
+    static const bool kReadsTexCoord = false;
+    
+    template<typename ColorModel>
+    static typename ColorModel::Color shade(const Ray& ray, const Object* /*object*/, const vec3f& pHit,
+                                            const vec3f& norm, const vec3f& /*texCoord*/, float distance,
+                                            const std::vector<Object*>& objects, const LightList& lights,
+                                            const Options& options, const ColorModel& colorModel,
+                                            const float& depth, float pathLength)
+    {
+        vec3f R = reflect(norm, ray.dir);
+        Ray reflectionRay(pHit + norm * kRayBias, R);
+        reflectionRay.type = kRayTypeSecondary;
+        return castRay(reflectionRay, objects, lights, options, colorModel, depth + 1,
+                       pathLength + distance) * kMirrorReflectance;
+    }
+    
+    template<typename ColorModel>
+    static bool scatter(Ray& ray, const Object* /*object*/, const vec3f& pHit, const vec3f& norm,
+                        const vec3f& /*texCoord*/, float /*pathLength*/, typename ColorModel::Color& throughput,
+                        typename ColorModel::Color& /*radiance*/, const std::vector<Object*>& /*objects*/,
+                        const LightList& /*lights*/, const Options& /*options*/, const ColorModel& /*colorModel*/,
+                        SampleStream& /*samples*/)
+    {
+        ray = Ray(pHit + norm * kRayBias, reflect(norm, ray.dir));
+        ray.type = kRayTypeSecondary;
+        throughput *= kMirrorReflectance;
+        return true;
+    }
+};
+
+//The kernels hits are dispatched to, mirrors share one whether textured or not
+enum ShadingKernel
+{
+    kKernelDiffuse,
+    kKernelDiffuseTextured,
+    kKernelReflection,
+    kKernelNone,
+};
+
+inline ShadingKernel shadingKernel(const Object* object)
+{
+    switch (object->type)
+    {
+        case kDiffuse: return object->texture ? kKernelDiffuseTextured : kKernelDiffuse;
+        case kReflection: return kKernelReflection;
+        default: return kKernelNone;
+    }
+}
+
+//The normal at the hit of [primitive] of [object], and the texture coordinates if [Material] reads them
+template<typename Material>
+inline void surfaceAttributes(const Object* object, uint64_t primitive, const vec3f& pHit, vec3f& norm, vec3f& texCoord)
+{
+    if (Material::kReadsTexCoord)
+        object->getPrimitiveSurfaceData(pHit, primitive, norm, texCoord);
+    else
+        norm = object->getPrimitiveNormal(pHit, primitive);
+}
+
+//Whitted-style radiance leaving the point pHit of [object] along -ray.dir, where [ray] hit it
+//after [distance]. Shadow and reflection rays start here.
+template<typename ColorModel>
+typename ColorModel::Color shadeSurface(const Ray& ray, const Object* object, const vec3f& pHit,
+                                        const vec3f& norm, const vec3f& texCoord, float distance,
+                                        const std::vector<Object*>& objects, const LightList& lights,
+                                        const Options& options, const ColorModel& colorModel,
+                                        const float& depth, float pathLength)
+{
+    switch (shadingKernel(object))
+    {
+        case kKernelDiffuse:
+            return MaterialKernel<kDiffuse, false>::shade(ray, object, pHit, norm, texCoord, distance, objects, lights,
+                                                          options, colorModel, depth, pathLength);
+        case kKernelDiffuseTextured:
+            return MaterialKernel<kDiffuse, true>::shade(ray, object, pHit, norm, texCoord, distance, objects, lights,
+                                                         options, colorModel, depth, pathLength);
+        case kKernelReflection:
+            return MaterialKernel<kReflection, false>::shade(ray, object, pHit, norm, texCoord, distance, objects, lights,
+                                                             options, colorModel, depth, pathLength);
+        default:
+            return typename ColorModel::Color();
+    }
+}
+
+//shadeSurface() of a hit that still needs its surface attributes
+template<typename Material, typename ColorModel>
+typename ColorModel::Color shadeHit(const Ray& ray, const Object* object, uint64_t primitive, float distance,
+                                    const std::vector<Object*>& objects, const LightList& lights,
+                                    const Options& options, const ColorModel& colorModel,
+                                    const float& depth, float pathLength)
+{
+    vec3f pHit = ray.pos + (ray.dir * distance);
+    vec3f norm;
+    vec3f texCoord;
+    
+    surfaceAttributes<Material>(object, primitive, pHit, norm, texCoord);
+    return Material::shade(ray, object, pHit, norm, texCoord, distance, objects, lights, options, colorModel,
+                           depth, pathLength);
+}
+
+//Whitted-style radiance along [ray], shaded in the color model [colorModel]
+template<typename ColorModel>
+typename ColorModel::Color castRay(const Ray& ray, const std::vector<Object*>& objects,
+                                   const LightList& lights, const Options& options,
+                                   const ColorModel& colorModel, const float& depth, float pathLength)
+{
+    if(depth > options.maxDepth)
+        return missRadiance(ray, lights, options, colorModel);
+    
+    IHitInfo info;
+    if (!trace(ray, objects, info))
+        return missRadiance(ray, lights, options, colorModel);
+    
+    switch (shadingKernel(info.hitObject))
+    {
+        case kKernelDiffuse:
+            return shadeHit<MaterialKernel<kDiffuse, false> >(ray, info.hitObject, info.primitive, info.distance,
+                                                               objects, lights, options, colorModel, depth, pathLength);
+        case kKernelDiffuseTextured:
+            return shadeHit<MaterialKernel<kDiffuse, true> >(ray, info.hitObject, info.primitive, info.distance,
+                                                              objects, lights, options, colorModel, depth, pathLength);
+        case kKernelReflection:
+            return shadeHit<MaterialKernel<kReflection, false> >(ray, info.hitObject, info.primitive, info.distance,
+                                                                  objects, lights, options, colorModel, depth, pathLength);
+        default:
+            return typename ColorModel::Color();
+    }
+}
+
+//One vertex of castPath() at the hit [info] of [ray]
+template<typename Material, typename ColorModel>
+bool scatterHit(Ray& ray, const IHitInfo& info, float pathLength, typename ColorModel::Color& throughput,
+                typename ColorModel::Color& radiance, const std::vector<Object*>& objects, const LightList& lights,
+                const Options& options, const ColorModel& colorModel, SampleStream& samples)
+{
+    vec3f pHit = ray.pos + (ray.dir * info.distance);
+    vec3f norm;
+    vec3f texCoord;
+    
+    surfaceAttributes<Material>(info.hitObject, info.primitive, pHit, norm, texCoord);
+    
+    //shade from the side the ray arrives at
+    if (norm.dot(ray.dir) > 0)
+        norm *= -1;
+    
+    return Material::scatter(ray, info.hitObject, pHit, norm, texCoord, pathLength, throughput, radiance,
+                             objects, lights, options, colorModel, samples);
+}
+
+//Path traced radiance along [ray]. Every diffuse vertex adds the direct lighting of
+//all lights (next-event estimation) and continues along a cosine-weighted bounce;
+//after options.rouletteDepth bounces a path survives with probability proportional
+//to its throughput, and survivors are reweighted, so the estimate stays unbiased.
+//Random numbers are drawn from [samples], shading happens in the color model [colorModel].
+template<typename ColorModel>
+typename ColorModel::Color castPath(const Ray& primaryRay, const std::vector<Object*>& objects,
+                                    const LightList& lights, const Options& options,
+                                    const ColorModel& colorModel, SampleStream& samples)
+{
+    typedef typename ColorModel::Color Color;
+    
+    Color radiance;
+    Color throughput(1);
+    Ray ray = primaryRay;
+    float pathLength = 0;
+    //the last vertex was diffuse, next-event estimation has gathered the environment there
+    bool sampledEnvironment = false;
+    
+    for (uint32_t depth = 0; depth < options.maxPathDepth; depth++)
+    {
+        IHitInfo info;
+        if (!trace(ray, objects, info))
+        {
+            if (!sampledEnvironment)
+                radiance += throughput * missRadiance(ray, lights, options, colorModel);
+            break;
+        }
+        
+        pathLength += info.distance;
+        
+        bool scattered = false;
+        ShadingKernel kernel = shadingKernel(info.hitObject);
+        sampledEnvironment = !lights.environment.empty() && kernel != kKernelReflection;
+        switch (kernel)
+        {
+            case kKernelDiffuse:
+                scattered = scatterHit<MaterialKernel<kDiffuse, false> >(ray, info, pathLength, throughput, radiance,
+                                                                          objects, lights, options, colorModel, samples);
+                break;
+            case kKernelDiffuseTextured:
+                scattered = scatterHit<MaterialKernel<kDiffuse, true> >(ray, info, pathLength, throughput, radiance,
+                                                                         objects, lights, options, colorModel, samples);
+                break;
+            case kKernelReflection:
+                scattered = scatterHit<MaterialKernel<kReflection, false> >(ray, info, pathLength, throughput, radiance,
+                                                                             objects, lights, options, colorModel, samples);
+                break;
+            default:
+                break;
+        }
+        if (!scattered)
+            return radiance;
+        
+        if (depth + 1 >= options.rouletteDepth)
+        {
+            float survival = std::min(0.95f, maxComponent(throughput));
+            if (samples.next01() >= survival)
+                break;
+            
+            throughput *= 1 / survival;
+        }
+    }
+    
+    return radiance;
+}
+
+//Radiance along a primary ray with the integrator and color model selected in [options]
+vec3f radiance(const Ray& primRay, const std::vector<Object*>& objects,
+               const LightList& lights, const Options& options, SampleStream& samples)
+{
+    if (options.rgb2spec)
+    {
+        SpectralColorModel colorModel(*options.rgb2spec, SampledWavelengths::sample(samples.next01()));
+        if (options.integrator == kIntegratorPath)
+            return colorModel.toRGB(castPath(primRay, objects, lights, options, colorModel, samples));
+        else
+            return colorModel.toRGB(castRay(primRay, objects, lights, options, colorModel));
+    }
+    
+    RGBColorModel colorModel;
+    if (options.integrator == kIntegratorPath)
+        return castPath(primRay, objects, lights, options, colorModel, samples);
+    else
+        return castRay(primRay, objects, lights, options, colorModel);
+}
+
+//Radiance along the primary ray [primRay] through a pixel of [gbuffer], the same as
+//radiance() but starting from the G-buffer surface instead of tracing the ray
+vec3f radiance(const Ray& primRay, const GBufferSample& sample, const std::vector<Object*>& objects,
+               const LightList& lights, const Options& options, SampleStream& samples)
+{
+    if (sample.traced)
+        return radiance(primRay, objects, lights, options, samples);
+    
+    //the primary hit, the rasterizer found it instead of trace()
+    if (footprint && sample.object)
+        footprint->objects.insert(sample.object);
+    
+    vec3f pHit = primRay.pos + primRay.dir * sample.distance;
+    if (options.rgb2spec)
+    {
+        SpectralColorModel colorModel(*options.rgb2spec, SampledWavelengths::sample(samples.next01()));
+        if (!sample.object)
+            return colorModel.toRGB(missRadiance(primRay, lights, options, colorModel));
+        return colorModel.toRGB(shadeSurface(primRay, sample.object, pHit, sample.normal, sample.texCoord,
+                                             sample.distance, objects, lights, options, colorModel, 0, 0));
+    }
+    
+    RGBColorModel colorModel;
+    if (!sample.object)
+        return missRadiance(primRay, lights, options, colorModel);
+    return shadeSurface(primRay, sample.object, pHit, sample.normal, sample.texCoord,
+                        sample.distance, objects, lights, options, colorModel, 0, 0);
+}
+
+//A ray of castRayBatch(). Its radiance goes to pixel [pixel] of the batch after [depth]
+//mirror bounces, each scaling it by kMirrorReflectance
+struct BatchRay
+{
+    Ray ray;
+    uint32_t pixel;
+    uint32_t depth;
+    float pathLength;
+    //the closest hit, set by the trace stage unless [resolved] says it is known already
+    const Object* object;
+    uint64_t primitive;
+    float distance;
+    bool resolved;
+};
+
+//the octant of [dir], the sign bits of its components
+inline uint32_t directionOctant(const vec3f& dir)
+{
+    return (dir.x < 0 ? 1 : 0) | (dir.y < 0 ? 2 : 0) | (dir.z < 0 ? 4 : 0);
+}
+
+//[color] seen after [depth] mirror bounces, scaled in the order the recursion of castRay() does
+inline vec3f mirrorAttenuate(vec3f color, uint32_t depth)
+{
+    for (uint32_t i = 0; i < depth; i++)
+        color = color * kMirrorReflectance;
+    return color;
+}
+
+//Whitted-style radiance of a batch of rays, castRay() of each one, in stages. All rays of a
+//bounce are traced first, their hits are sorted by shading kernel and every group of hits on
+//one object is shaded in one loop of its kernel, and the mirror reflections of the bounce are
+//sorted by direction octant to form the next one. Writes the radiance of each ray to
+//out[ray.pixel], exactly what castRay() returns for it.
+void castRayBatch(std::vector<BatchRay>& rays, const std::vector<Object*>& objects,
+                  const LightList& lights, const Options& options, vec3f* out)
+{
+    typedef MaterialKernel<kDiffuse, false> Diffuse;
+    typedef MaterialKernel<kDiffuse, true> DiffuseTextured;
+    typedef MaterialKernel<kReflection, false> Reflection;
+    
+    RGBColorModel colorModel;
+    std::vector<uint8_t> kernels;
+    std::vector<uint32_t> order;
+    std::vector<BatchRay> reflected;
+    
+    while (!rays.empty())
+    {
+        //trace stage, misses count as kKernelNone without an object
+        size_t start[kKernelNone + 2] = { 0 };
+        kernels.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); i++)
+        {
+            BatchRay& r = rays[i];
+            if (r.depth > options.maxDepth)
+                r.object = NULL;
+            else if (!r.resolved)
+            {
+                IHitInfo info;
+                trace(r.ray, objects, info);
+                r.object = info.hitObject;
+                r.primitive = info.primitive;
+                r.distance = info.distance;
+            }
+            
+            kernels[i] = (uint8_t)(r.object ? shadingKernel(r.object) : kKernelNone);
+            start[kernels[i] + 1]++;
+        }
+        
+        //a stable counting sort by kernel, hits on one object stay in runs of neighbouring rays
+        for (int k = 0; k <= kKernelNone; k++)
+            start[k + 1] += start[k];
+        order.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); i++)
+            order[start[kernels[i]]++] = (uint32_t)i;
+        
+        //shade stage
+        reflected.clear();
+        for (size_t first = 0, last; first < order.size(); first = last)
+        {
+            const ShadingKernel kernel = (ShadingKernel)kernels[order[first]];
+            const Object* object = rays[order[first]].object;
+            for (last = first + 1; last < order.size() && rays[order[last]].object == object; last++)
+                ;
+            
+            //one kernel for the whole group
+            switch (kernel)
+            {
+                case kKernelDiffuse:
+                    for (size_t k = first; k < last; k++)
+                    {
+                        const BatchRay& r = rays[order[k]];
+                        out[r.pixel] = mirrorAttenuate(shadeHit<Diffuse>(r.ray, object, r.primitive, r.distance, objects, lights,
+                                                                         options, colorModel, r.depth, r.pathLength),
+                                                       r.depth);
+                    }
+                    break;
+                case kKernelDiffuseTextured:
+                    for (size_t k = first; k < last; k++)
+                    {
+                        const BatchRay& r = rays[order[k]];
+                        out[r.pixel] = mirrorAttenuate(shadeHit<DiffuseTextured>(r.ray, object, r.primitive, r.distance,
+                                                                                 objects, lights, options, colorModel,
+                                                                                 r.depth, r.pathLength),
+                                                       r.depth);
+                    }
+                    break;
+                case kKernelReflection:
+                    for (size_t k = first; k < last; k++)
+                    {
+                        const BatchRay& r = rays[order[k]];
+                        vec3f pHit = r.ray.pos + (r.ray.dir * r.distance);
+                        vec3f norm;
+                        vec3f texCoord;
+                        surfaceAttributes<Reflection>(object, r.primitive, pHit, norm, texCoord);
+                        
+                        //the ray Reflection::shade() would cast
+                        BatchRay next;
+                        next.ray = Ray(pHit + norm * kRayBias, reflect(norm, r.ray.dir));
+                        next.ray.type = kRayTypeSecondary;
+                        next.pixel = r.pixel;
+                        next.depth = r.depth + 1;
+                        next.pathLength = r.pathLength + r.distance;
+                        next.object = NULL;
+                        next.primitive = 0;
+                        next.distance = INFINITY;
+                        next.resolved = false;
+                        reflected.push_back(next);
+                    }
+                    break;
+                default:
+                    for (size_t k = first; k < last; k++)
+                    {
+                        const BatchRay& r = rays[order[k]];
+                        out[r.pixel] = object ? vec3f() : mirrorAttenuate(missRadiance(r.ray, lights, options, colorModel), r.depth);
+                    }
+                    break;
+            }
+        }
+        
+        //the next bounce, grouped by octant so neighbouring rays take similar paths
+        size_t octantStart[9] = { 0 };
+        for (size_t i = 0; i < reflected.size(); i++)
+            octantStart[directionOctant(reflected[i].ray.dir) + 1]++;
+        for (int o = 0; o < 8; o++)
+            octantStart[o + 1] += octantStart[o];
+        rays.resize(reflected.size());
+        for (size_t i = 0; i < reflected.size(); i++)
+            rays[octantStart[directionOctant(reflected[i].ray.dir)]++] = reflected[i];
+    }
+}
+
+//Traces the primary samples of one frame of a scene: camera rays, sample positions and,
+//for hybrid renders, the G-buffer of the crop window
+class FrameTracer
+{
+public:
+    FrameTracer(const Options& opts, const Scene& s, const CropWindow& cropWindow) :
+    options(opts), scene(s), crop(cropWindow), lights(s.lights), sampler(opts.sampler ? *opts.sampler : independentSampler),
+    gbuffer(opts.width, opts.height, opts.fov, s.camToWorld)
+    {
+        //a single sample goes through the pixel center, more are jittered over the pixel
+        jitter = options.samplesPerPixel > 1;
+        //the G-buffer holds what is seen through the pixel centers, so it serves single samples
+        hybrid = options.hybrid && options.integrator == kIntegratorWhitted && !jitter;
+        //spectral samples each carry their own wavelengths, they are shaded one by one
+        batched = options.integrator == kIntegratorWhitted && !options.rgb2spec;
+    }
+    
+    //builds the G-buffer on [numThreads] threads (0 = one per core) if the frame is hybrid
+    void prepare(unsigned numThreads)
+    {
+        if (!hybrid)
+            return;
+        
+        gbuffer.build(scene.objects, crop.x0, crop.y0, crop.x1, crop.y1, [&](int x, int y, Ray& ray)
+        {
+            computeRay(ray, x + 0.5f, y + 0.5f, options, vec3f(0), scene.camToWorld);
+        }, numThreads);
+    }
+    
+    //the radiance of sample [pass] of pixel (x, y), which must be inside the crop window
+    vec3f tracePixel(uint32_t x, uint32_t y, uint32_t pass) const
+    {
+        SampleStream samples(sampler, y * options.width + x, pass);
+        float sx = x + (jitter ? samples.next01() : 0.5f);
+        float sy = y + (jitter ? samples.next01() : 0.5f);
+        
+        Ray primRay;
+        computeRay(primRay, sx, sy, options, vec3f(0), scene.camToWorld);
+        if (hybrid)
+            return radiance(primRay, gbuffer.at(x, y), scene.objects, lights, options, samples);
+        return radiance(primRay, scene.objects, lights, options, samples);
+    }
+    
+    //Sample [pass] of the pixels [x0, x1) of row [y] into out[0, x1 - x0), the same radiance as
+    //tracePixel(). RGB Whitted samples are shaded as one batch by castRayBatch().
+    void traceSpan(uint32_t x0, uint32_t x1, uint32_t y, uint32_t pass, vec3f* out) const
+    {
+        if (!batched)
+        {
+            for (uint32_t x = x0; x < x1; x++)
+                *(out++) = tracePixel(x, y, pass);
+            return;
+        }
+        
+        std::vector<BatchRay> rays(x1 - x0);
+        for (uint32_t x = x0; x < x1; x++)
+        {
+            SampleStream samples(sampler, y * options.width + x, pass);
+            float sx = x + (jitter ? samples.next01() : 0.5f);
+            float sy = y + (jitter ? samples.next01() : 0.5f);
+            
+            BatchRay& r = rays[x - x0];
+            computeRay(r.ray, sx, sy, options, vec3f(0), scene.camToWorld);
+            r.pixel = x - x0;
+            r.depth = 0;
+            r.pathLength = 0;
+            r.object = NULL;
+            r.primitive = 0;
+            r.distance = INFINITY;
+            r.resolved = false;
+            if (hybrid)
+            {
+                //the G-buffer already knows the primary hit of the pixel
+                const GBufferSample& sample = gbuffer.at(x, y);
+                if (!sample.traced)
+                {
+                    if (footprint && sample.object)
+                        footprint->objects.insert(sample.object);
+                    r.object = sample.object;
+                    r.primitive = sample.primitive;
+                    r.distance = sample.distance;
+                    r.resolved = true;
+                }
+            }
+        }
+        castRayBatch(rays, scene.objects, lights, options, out);
+    }
+    
+private:
+    const Options& options;
+    const Scene& scene;
+    CropWindow crop;
+    LightList lights;
+    IndependentSampler independentSampler;
+    const Sampler& sampler;
+    GBuffer gbuffer;
+    bool jitter;
+    bool hybrid;
+    bool batched;
+};
+
+//The crop window of [options] clamped to the frame, the whole frame if it is empty
+CropWindow resolveCrop(const Options& options)
+{
+    CropWindow crop = options.crop;
+    if (crop.empty())
+    {
+        crop.x0 = crop.y0 = 0;
+        crop.x1 = options.width;
+        crop.y1 = options.height;
+    }
+    crop.x1 = std::min(crop.x1, options.width);
+    crop.y1 = std::min(crop.y1, options.height);
+    return crop;
+}
+
+//the pixels render() traces between two looks at the deadline
+static const uint32_t kDeadlineSpan = 64;
+
+//Hashes the options and the scene a checkpoint's samples depend on: the camera, the lights,
+//the materials and the geometry through its proxy. Objects without a proxy add their material
+static uint64_t checkpointSceneHash(const Options& options, const Scene& scene)
+{
+    uint32_t depths[3] = { options.maxDepth, options.rouletteDepth, options.maxPathDepth };
+    float view[4] = { options.fov, options.backgroundColor.x, options.backgroundColor.y, options.backgroundColor.z };
+    uint64_t hash = checkpointHash(depths, sizeof(depths));
+    hash = checkpointHash(view, sizeof(view), hash);
+    hash = checkpointHash(&options.hybrid, sizeof(options.hybrid), hash);
+    hash = checkpointHash(scene.camToWorld.getMatrix().m, sizeof(float) * 16, hash);
+    
+    for (size_t i = 0; i < scene.lights.size(); i++)
+    {
+        const Light* light = scene.lights[i];
+        float emission[4] = { light->color.x, light->color.y, light->color.z, light->intensity };
+        hash = checkpointHash(light->lightToWorld.getMatrix().m, sizeof(float) * 16, hash);
+        hash = checkpointHash(emission, sizeof(emission), hash);
+    }
+    
+    std::vector<vec3f> positions;
+    std::vector<uint32_t> indices;
+    for (size_t i = 0; i < scene.objects.size(); i++)
+    {
+        const Object* object = scene.objects[i];
+        uint32_t material[2] = { (uint32_t)object->type, object->texture ? 1u : 0u };
+        float albedo[4] = { object->albedo.x, object->albedo.y, object->albedo.z, object->texCoordScale() };
+        hash = checkpointHash(material, sizeof(material), hash);
+        hash = checkpointHash(albedo, sizeof(albedo), hash);
+        
+        positions.clear();
+        indices.clear();
+        if (!object->tessellate(positions, indices))
+            continue;
+        for (size_t j = 0; j < positions.size(); j++)
+        {
+            float p[3] = { positions[j].x, positions[j].y, positions[j].z };
+            hash = checkpointHash(p, sizeof(p), hash);
+        }
+        if (!indices.empty())
+            hash = checkpointHash(&indices[0], sizeof(uint32_t) * indices.size(), hash);
+    }
+    return hash;
+}
+
+template <typename Format>
+uint32_t render(const Options& options, const Scene& scene, const CropWindow& crop, ImageT<Format>& img)
+{
+    uint32_t cropWidth = crop.x1 - crop.x0;
+    uint32_t cropHeight = crop.y1 - crop.y0;
+    
+    FrameTracer tracer(options, scene, crop);
+    tracer.prepare(options.numThreads);
+    
+    std::atomic<bool> expired(false);
+    auto pastDeadline = [&]()
+    {
+        if (!expired && std::chrono::steady_clock::now() > options.deadline)
+            expired = true;
+        return (bool)expired;
+    };
+    
+    //with a deadline rows are traced in spans so a render overruns it by one span per thread
+    //at most, not by a whole row
+    const bool hasDeadline = options.deadline != std::chrono::steady_clock::time_point::max();
+    const uint32_t span = hasDeadline ? kDeadlineSpan : cropWidth;
+    
+    //rows write disjoint parts of the buffers and every sample draws its random numbers
+    //from (pixel, pass, dimension), so the result does not depend on the thread count.
+    //returns the pixels traced from the start of the row, fewer than all past the deadline
+    auto traceRow = [&](uint32_t y, uint32_t pass, vec3f* out)
+    {
+        uint64_t before = raysTraced;
+        uint32_t x = crop.x0;
+        while (x < crop.x1 && !(hasDeadline && pastDeadline()))
+        {
+            uint32_t x1 = std::min(x + span, crop.x1);
+            tracer.traceSpan(x, x1, y, pass, out + (x - crop.x0));
+            x = x1;
+        }
+        if (options.rayCount)
+            *options.rayCount += raysTraced - before;
+        return x - crop.x0;
+    };
+    
+    if (options.samplesPerPixel == 1 && !options.checkpointPath)
+    {
+        parallelFor(crop.y0, crop.y1, 1, [&](int y)
+        {
+            std::vector<vec3f> row(cropWidth);
+            uint32_t traced = traceRow(y, 0, row.data());
+            typename Format::Pixel* out = img.pixels + (y - crop.y0) * cropWidth;
+            for (uint32_t i = 0; i < traced; i++)
+            {
+                RGB rgb = { row[i].x, row[i].y, row[i].z };
+                *(out++) = Format::encode(rgb);
+            }
+        }, options.numThreads);
+        return expired ? 0 : 1;
+    }
+    
+    vec3f* accumBuffer = new vec3f[cropWidth * cropHeight];
+    uint32_t* sampleCounts = new uint32_t[cropWidth * cropHeight];
+    memset(sampleCounts, 0, sizeof(uint32_t) * cropWidth * cropHeight);
+    
+    CheckpointHeader checkpoint = makeCheckpointHeader(options.width, options.height,
+                                                       crop.x0, crop.y0, crop.x1, crop.y1, options.integrator,
+                                                       options.sampler ? options.sampler->name() : "independent",
+                                                       options.rgb2spec != NULL, 0);
+    if (options.checkpointPath)
+    {
+        checkpoint.sceneHash = checkpointSceneHash(options, scene);
+        if (loadCheckpoint(options.checkpointPath, checkpoint, accumBuffer, sampleCounts))
+        {
+            std::cout << "resuming from checkpoint at pass " << checkpoint.passes << std::endl;
+        }
+        else
+        {
+            checkpoint.passes = 0;
+            std::fill(accumBuffer, accumBuffer + cropWidth * cropHeight, vec3f(0));
+            memset(sampleCounts, 0, sizeof(uint32_t) * cropWidth * cropHeight);
+        }
+    }
+    
+    auto resolveRow = [&](int y)
+    {
+        size_t offset = (y - crop.y0) * cropWidth;
+        for (uint32_t i = 0; i < cropWidth; i++)
+        {
+            float invCount = sampleCounts[offset + i] ? 1.0f / sampleCounts[offset + i] : 0.0f;
+            vec3f color = accumBuffer[offset + i] * invCount;
+            RGB rgb = { color.x, color.y, color.z };
+            img.pixels[offset + i] = Format::encode(rgb);
+        }
+    };
+    
+    //a checkpoint of a finished render only needs resolving
+    if (checkpoint.passes >= options.samplesPerPixel)
+        parallelFor(crop.y0, crop.y1, 1, resolveRow, options.numThreads);
+    
+    while (checkpoint.passes < options.samplesPerPixel && !pastDeadline())
+    {
+        uint32_t pass = checkpoint.passes;
+        bool lastPass = pass + 1 == options.samplesPerPixel;
+        parallelFor(crop.y0, crop.y1, 1, [&](int y)
+        {
+            std::vector<vec3f> row(cropWidth);
+            uint32_t traced = traceRow(y, pass, row.data());
+            vec3f* pix = accumBuffer + (y - crop.y0) * cropWidth;
+            uint32_t* count = sampleCounts + (y - crop.y0) * cropWidth;
+            for (uint32_t i = 0; i < traced; i++)
+            {
+                *(pix++) += row[i];
+                (*count++)++;
+            }
+            
+            if (lastPass)
+                resolveRow(y);
+        }, options.numThreads);
+        
+        //the pixels that were traced keep their extra sample, the counts are per pixel
+        if (expired)
+            break;
+        checkpoint.passes++;
+        
+        if (options.checkpointPath && (lastPass || checkpoint.passes % std::max(1u, options.checkpointInterval) == 0))
+        {
+            if (!saveCheckpoint(options.checkpointPath, checkpoint, accumBuffer, sampleCounts))
+                std::cout << "failed to write checkpoint " << options.checkpointPath << std::endl;
+        }
+    }
+    
+    if (expired)
+        parallelFor(crop.y0, crop.y1, 1, resolveRow, options.numThreads);
+    
+    delete[] accumBuffer;
+    delete[] sampleCounts;
+    return checkpoint.passes;
+}
+
+template <typename Format>
+RenderQuality renderWithBudget(const Options& options, const Scene& scene, const CropWindow& crop, ImageT<Format>& img)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&]() { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); };
+    
+    Options budgeted = options;
+    budgeted.deadline = start + std::chrono::microseconds((int64_t)(options.timeBudget * 1000));
+    //a checkpoint would resume a different level
+    budgeted.checkpointPath = NULL;
+    
+    RenderQuality quality;
+    //the last level that finished, upscaled into [img] once the time is up
+    ImageT<Format>* finished = NULL;
+    CropWindow finishedCrop;
+    //milliseconds per traced sample of the last finished level
+    double msPerSample = 0;
+    for (uint32_t divisor = 8; divisor >= 1; divisor /= 2)
+    {
+        Options level = budgeted;
+        level.width = (options.width + divisor - 1) / divisor;
+        level.height = (options.height + divisor - 1) / divisor;
+        level.crop.x0 = crop.x0 / divisor;
+        level.crop.y0 = crop.y0 / divisor;
+        level.crop.x1 = (crop.x1 + divisor - 1) / divisor;
+        level.crop.y1 = (crop.y1 + divisor - 1) / divisor;
+        //previews take one sample through each pixel center
+        if (divisor > 1)
+            level.samplesPerPixel = 1;
+        
+        uint32_t levelWidth = level.crop.x1 - level.crop.x0;
+        uint32_t levelHeight = level.crop.y1 - level.crop.y0;
+        if (msPerSample > 0 && elapsed() + msPerSample * levelWidth * levelHeight > options.timeBudget)
+            break;
+        
+        double levelStart = elapsed();
+        ImageT<Format>* levelImg = new ImageT<Format>(levelWidth, levelHeight);
+        uint32_t passes = render(level, scene, level.crop, *levelImg);
+        if (passes == 0)
+        {
+            delete levelImg;
+            break;
+        }
+        msPerSample = (elapsed() - levelStart) / ((double)levelWidth * levelHeight * passes);
+        
+        delete finished;
+        finished = levelImg;
+        finishedCrop = level.crop;
+        quality.resolutionDivisor = divisor;
+        quality.samplesPerPixel = passes;
+    }
+    
+    //the full resolution level is the frame, a preview is upscaled nearest neighbour, every
+    //level pixel covering divisor x divisor output pixels. A level row is expanded once and
+    //copied to the other output rows it covers
+    const uint32_t divisor = quality.resolutionDivisor;
+    const uint32_t width = crop.x1 - crop.x0;
+    if (divisor == 1)
+        std::swap(img.pixels, finished->pixels);
+    else if (finished)
+    {
+        parallelFor(finishedCrop.y0, finishedCrop.y1, 1, [&](int levelY)
+        {
+            uint32_t y0 = std::max(levelY * divisor, crop.y0);
+            uint32_t y1 = std::min((levelY + 1) * divisor, crop.y1);
+            const typename Format::Pixel* in = finished->pixels + (levelY - finishedCrop.y0) * finished->getWidth();
+            typename Format::Pixel* first = img.pixels + (y0 - crop.y0) * width;
+            for (uint32_t x = crop.x0; x < crop.x1; x++)
+                first[x - crop.x0] = in[x / divisor - finishedCrop.x0];
+            for (uint32_t y = y0 + 1; y < y1; y++)
+                memcpy(img.pixels + (y - crop.y0) * width, first, sizeof(typename Format::Pixel) * width);
+        }, options.numThreads);
+    }
+    delete finished;
+    
+    quality.milliseconds = elapsed();
+    return quality;
+}
+
+template uint32_t render<PixelFormatF32>(const Options&, const Scene&, const CropWindow&, ImageT<PixelFormatF32>&);
+template uint32_t render<PixelFormatF16>(const Options&, const Scene&, const CropWindow&, ImageT<PixelFormatF16>&);
+template uint32_t render<PixelFormatU16>(const Options&, const Scene&, const CropWindow&, ImageT<PixelFormatU16>&);
+template uint32_t render<PixelFormatU8>(const Options&, const Scene&, const CropWindow&, ImageT<PixelFormatU8>&);
+template RenderQuality renderWithBudget<PixelFormatF32>(const Options&, const Scene&, const CropWindow&, ImageT<PixelFormatF32>&);
+template RenderQuality renderWithBudget<PixelFormatF16>(const Options&, const Scene&, const CropWindow&, ImageT<PixelFormatF16>&);
+template RenderQuality renderWithBudget<PixelFormatU16>(const Options&, const Scene&, const CropWindow&, ImageT<PixelFormatU16>&);
+template RenderQuality renderWithBudget<PixelFormatU8>(const Options&, const Scene&, const CropWindow&, ImageT<PixelFormatU8>&);
+
+RenderJob::RenderJob(RenderEngine* e, const std::shared_ptr<const Scene>& s, const Options& opts,
+                     const CropWindow& cropWindow, int p, uint64_t seq) :
+engine(e), scene(s), options(opts), crop(cropWindow), priority(p), sequence(seq),
+image(cropWindow.x1 - cropWindow.x0, cropWindow.y1 - cropWindow.y0), traceWindow(cropWindow), tracer(NULL),
+state(kStateQueued), cancelled(false), tilesDone(0), tilesInFlight(0)
+{
+    for (uint32_t y = crop.y0; y < crop.y1; y += RenderEngine::kTileSize)
+    {
+        for (uint32_t x = crop.x0; x < crop.x1; x += RenderEngine::kTileSize)
+        {
+            Tile tile = { x, y, std::min(crop.x1, x + RenderEngine::kTileSize), std::min(crop.y1, y + RenderEngine::kTileSize),
+                          (uint32_t)tiles.size() };
+            tiles.push_back(tile);
+        }
+    }
+    numTiles = (uint32_t)tiles.size();
+    footprints.resize(numTiles);
+}
+
+RenderJob::~RenderJob()
+{
+    delete tracer;
+}
+
+void RenderJob::cancel()
+{
+    //as in wait(), a finished job may have outlived its engine
+    if (state == kStateDone || state == kStateCancelled)
+        return;
+    
+    std::lock_guard<std::mutex> lock(engine->mutex);
+    if (state == kStateDone || state == kStateCancelled)
+        return;
+    
+    cancelled = true;
+    tiles.clear();
+    engine->updatePendingPriority();
+    engine->retireIfFinished(*this);
+}
+
+bool RenderJob::wait()
+{
+    //the engine finishes every job before it goes away, a finished job needs no engine
+    if (state != kStateDone && state != kStateCancelled)
+    {
+        std::unique_lock<std::mutex> lock(engine->mutex);
+        engine->jobFinished.wait(lock, [&]() { return state == kStateDone || state == kStateCancelled; });
+    }
+    return state == kStateDone;
+}
+
+SceneEdit::SceneEdit(const RenderJob& frame) : options(frame.options), scene(*frame.scene), all(false) {}
+
+void SceneEdit::markChanged(const Object* object)
+{
+    Change change;
+    change.object = object;
+    change.geometry = true;
+    change.oldScreenBounds = screenBounds(object);
+    worldBounds(object, change.oldMin, change.oldMax);
+    changes.push_back(change);
+}
+
+void SceneEdit::markMaterialChanged(const Object* object)
+{
+    Change change;
+    change.object = object;
+    change.geometry = false;
+    changes.push_back(change);
+}
+
+//The box around the proxy, which encloses the object. Without a proxy it is everywhere
+void SceneEdit::worldBounds(const Object* object, vec3f& min, vec3f& max) const
+{
+    std::vector<vec3f> positions;
+    std::vector<uint32_t> indices;
+    min = vec3f(INFINITY);
+    max = vec3f(-INFINITY);
+    if (!object->tessellate(positions, indices))
+    {
+        min = vec3f(-INFINITY);
+        max = vec3f(INFINITY);
+        return;
+    }
+    
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        min = vec3f(std::min(min.x, positions[i].x), std::min(min.y, positions[i].y), std::min(min.z, positions[i].z));
+        max = vec3f(std::max(max.x, positions[i].x), std::max(max.y, positions[i].y), std::max(max.z, positions[i].z));
+    }
+}
+
+bool SceneEdit::affects(const Change& change, const TileFootprint& footprint, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) const
+{
+    if (footprint.objects.contains(change.object))
+        return true;
+    if (!change.geometry)
+        return false;
+    
+    const CropWindow* screen[2] = { &change.oldScreenBounds, &change.newScreenBounds };
+    for (int i = 0; i < 2; i++)
+    {
+        if (screen[i]->x0 < x1 && x0 < screen[i]->x1 && screen[i]->y0 < y1 && y0 < screen[i]->y1)
+            return true;
+    }
+    return footprint.overlaps(change.oldMin, change.oldMax) || footprint.overlaps(change.newMin, change.newMax);
+}
+
+//The bounding box of the projected proxy, which encloses the object. A proxy reaching
+//behind the camera could cover any pixel
+CropWindow SceneEdit::screenBounds(const Object* object) const
+{
+    CropWindow frame;
+    frame.x1 = options.width;
+    frame.y1 = options.height;
+    
+    std::vector<vec3f> positions;
+    std::vector<uint32_t> indices;
+    if (!object->tessellate(positions, indices))
+        return frame;
+    
+    //the inverse of computeRay()
+    Transform worldToCam = scene.camToWorld.inverse();
+    float tanfov = tanf(options.fov * 0.5f);
+    float aspect = (float)options.width / options.height;
+    float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+    for (size_t i = 0; i < positions.size(); i++)
+    {
+        vec3f cam = worldToCam.point(positions[i]);
+        if (!(cam.z < 0))
+            return frame;
+        
+        float x = (cam.x / -cam.z / (aspect * tanfov) + 1) * 0.5f * options.width;
+        float y = (1 - cam.y / -cam.z / tanfov) * 0.5f * options.height;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+    }
+    
+    //a pixel is covered if its center is, a hybrid frame also decides pixels by their neighbours
+    CropWindow bounds;
+    const float margin = 2;
+    bounds.x0 = (uint32_t)std::max(0.0f, floorf(minX - margin));
+    bounds.y0 = (uint32_t)std::max(0.0f, floorf(minY - margin));
+    bounds.x1 = (uint32_t)std::max(0.0f, std::min((float)options.width, ceilf(maxX + margin)));
+    bounds.y1 = (uint32_t)std::max(0.0f, std::min((float)options.height, ceilf(maxY + margin)));
+    return bounds;
+}
+
+RenderEngine::RenderEngine(unsigned numThreads) : stopping(false), nextSceneId(1), nextSequence(0),
+pendingPriority(INT_MIN)
+{
+    numThreads = resolveThreadCount(numThreads);
+    for (unsigned i = 0; i < numThreads; i++)
+        workers.push_back(std::thread(&RenderEngine::workerLoop, this));
+}
+
+RenderEngine::~RenderEngine()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            jobs[i]->cancelled = true;
+            jobs[i]->tiles.clear();
+        }
+        updatePendingPriority();
+    }
+    workAvailable.notify_all();
+    
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    
+    //no tile is in flight anymore
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!jobs.empty())
+        retireIfFinished(*jobs.back());
+}
+
+RenderEngine::SceneId RenderEngine::addScene(Scene* scene)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    SceneId id = nextSceneId++;
+    scenes[id] = std::shared_ptr<const Scene>(scene);
+    return id;
+}
+
+bool RenderEngine::removeScene(SceneId id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return scenes.erase(id) > 0;
+}
+
+std::shared_ptr<RenderJob> RenderEngine::submit(SceneId id, const Options& options, int priority)
+{
+    CropWindow crop = resolveCrop(options);
+    if (crop.empty())
+        return std::shared_ptr<RenderJob>();
+    
+    std::shared_ptr<RenderJob> job;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::map<SceneId, std::shared_ptr<const Scene> >::const_iterator it = scenes.find(id);
+        if (it == scenes.end() || stopping)
+            return std::shared_ptr<RenderJob>();
+        
+        job.reset(new RenderJob(this, it->second, options, crop, priority, nextSequence++));
+        job->options.crop = crop;
+        job->options.checkpointPath = NULL;
+        job->options.deadline = std::chrono::steady_clock::time_point::max();
+        jobs.push_back(job);
+        updatePendingPriority();
+    }
+    workAvailable.notify_all();
+    return job;
+}
+
+std::shared_ptr<RenderJob> RenderEngine::submitIncremental(const RenderJob& previous, const SceneEdit& edit, int priority)
+{
+    if (previous.getState() != RenderJob::kStateDone)
+        return std::shared_ptr<RenderJob>();
+    
+    //where the changed objects are now
+    std::vector<SceneEdit::Change> changes = edit.changes;
+    for (size_t i = 0; i < changes.size(); i++)
+    {
+        if (!changes[i].geometry)
+            continue;
+        changes[i].newScreenBounds = edit.screenBounds(changes[i].object);
+        edit.worldBounds(changes[i].object, changes[i].newMin, changes[i].newMax);
+    }
+    
+    std::shared_ptr<RenderJob> job;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping)
+            return std::shared_ptr<RenderJob>();
+        
+        job.reset(new RenderJob(this, previous.scene, previous.options, previous.crop, priority, nextSequence++));
+        memcpy(job->image.pixels, previous.image.pixels, sizeof(RGB) * job->image.getWidth() * job->image.getHeight());
+        job->footprints = previous.footprints;
+        
+        std::deque<RenderJob::Tile> affected;
+        CropWindow window;
+        window.x0 = window.y0 = UINT32_MAX;
+        for (size_t i = 0; i < job->tiles.size(); i++)
+        {
+            const RenderJob::Tile& tile = job->tiles[i];
+            bool dirty = edit.all;
+            for (size_t c = 0; c < changes.size() && !dirty; c++)
+                dirty = edit.affects(changes[c], previous.footprints[tile.index], tile.x0, tile.y0, tile.x1, tile.y1);
+            if (!dirty)
+                continue;
+            
+            affected.push_back(tile);
+            job->footprints[tile.index].clear();
+            window.x0 = std::min(window.x0, tile.x0);
+            window.y0 = std::min(window.y0, tile.y0);
+            window.x1 = std::max(window.x1, tile.x1);
+            window.y1 = std::max(window.y1, tile.y1);
+        }
+        
+        job->tiles.swap(affected);
+        job->numTiles = (uint32_t)job->tiles.size();
+        job->traceWindow = window;
+        if (job->tiles.empty())
+        {
+            job->state = RenderJob::kStateDone;
+            return job;
+        }
+        jobs.push_back(job);
+        updatePendingPriority();
+    }
+    workAvailable.notify_all();
+    return job;
+}
+
+RenderJob* RenderEngine::nextJob() const
+{
+    RenderJob* best = NULL;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        RenderJob* job = jobs[i].get();
+        if (job->tiles.empty())
+            continue;
+        if (!best || job->priority > best->priority || (job->priority == best->priority && job->sequence < best->sequence))
+            best = job;
+    }
+    return best;
+}
+
+void RenderEngine::updatePendingPriority()
+{
+    RenderJob* job = nextJob();
+    pendingPriority = job ? job->priority : INT_MIN;
+}
+
+void RenderEngine::retireIfFinished(RenderJob& job)
+{
+    if (!job.tiles.empty() || job.tilesInFlight)
+        return;
+    
+    job.state = job.cancelled ? RenderJob::kStateCancelled : RenderJob::kStateDone;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        if (jobs[i].get() == &job)
+        {
+            jobs.erase(jobs.begin() + i);
+            break;
+        }
+    }
+    jobFinished.notify_all();
+}
+
+void RenderEngine::workerLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        RenderJob* next = nextJob();
+        if (!next)
+        {
+            if (stopping)
+                return;
+            workAvailable.wait(lock);
+            continue;
+        }
+        
+        //the engine's reference goes away when the job retires, keep one while on a tile
+        std::shared_ptr<RenderJob> job;
+        for (size_t i = 0; i < jobs.size(); i++)
+            if (jobs[i].get() == next)
+                job = jobs[i];
+        
+        RenderJob::Tile tile = job->tiles.front();
+        job->tiles.pop_front();
+        job->tilesInFlight++;
+        job->state = RenderJob::kStateRunning;
+        updatePendingPriority();
+        lock.unlock();
+        
+        //a hybrid job rasterizes its G-buffer first, on as many threads as the engine has
+        std::call_once(job->setupFlag, [&]()
+        {
+            job->tracer = new FrameTracer(job->options, *job->scene, job->traceWindow);
+            job->tracer->prepare(getNumThreads());
+        });
+        footprint = &job->footprints[tile.index];
+        bool finished = renderTile(*job, tile);
+        footprint = NULL;
+        
+        lock.lock();
+        job->tilesInFlight--;
+        if (finished)
+            job->tilesDone++;
+        else if (!job->cancelled)
+            job->tiles.push_front(tile);
+        updatePendingPriority();
+        retireIfFinished(*job);
+    }
+}
+
+bool RenderEngine::renderTile(RenderJob& job, RenderJob::Tile& tile)
+{
+    const Options& options = job.options;
+    const uint32_t cropWidth = job.crop.x1 - job.crop.x0;
+    const uint32_t spp = std::max(1u, options.samplesPerPixel);
+    const float invCount = 1.0f / spp;
+    
+    while (tile.y0 < tile.y1)
+    {
+        if (job.cancelled)
+            return false;
+        
+        //the same sums as the passes of render(), in the same order
+        vec3f color[kTileSize];
+        vec3f sample[kTileSize];
+        const uint32_t width = tile.x1 - tile.x0;
+        std::fill(color, color + width, vec3f(0));
+        uint64_t before = raysTraced;
+        for (uint32_t pass = 0; pass < spp; pass++)
+        {
+            job.tracer->traceSpan(tile.x0, tile.x1, tile.y0, pass, sample);
+            for (uint32_t i = 0; i < width; i++)
+                color[i] += sample[i];
+        }
+        if (options.rayCount)
+            *options.rayCount += raysTraced - before;
+        
+        RGB* out = job.image.pixels + (tile.y0 - job.crop.y0) * cropWidth + (tile.x0 - job.crop.x0);
+        for (uint32_t i = 0; i < width; i++)
+        {
+            if (spp > 1)
+                color[i] = color[i] * invCount;
+            RGB rgb = { color[i].x, color[i].y, color[i].z };
+            *(out++) = rgb;
+        }
+        tile.y0++;
+        
+        if (tile.y0 < tile.y1 && pendingPriority > job.priority)
+            return false;
+    }
+    return true;
+}
@@ -0,0 +1,412 @@
+//
+//  render_engine.h
+//  theraytracer
+//
+//  The renderer as a library: scenes, render options and the functions
+//  that render a frame, plus RenderEngine, which keeps worker threads
+//  and scenes resident and renders prioritized jobs tile by tile.
+//  main.cpp is a command line front end on top of it.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef render_engine_h
+#define render_engine_h
+
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "vec3.h"
+#include "transform.h"
+#include "image.h"
+#include "geometry.h"
+#include "light.h"
+
+class Sampler;
+class RGB2Spec;
+class FrameTracer;
+
+//A rectangular region of the frame in pixels, [x0, x1) x [y0, y1)
+struct CropWindow
+{
+    uint32_t x0 = 0, y0 = 0;
+    uint32_t x1 = 0, y1 = 0;
+    
+    bool empty() const { return x1 <= x0 || y1 <= y0; }
+};
+
+enum IntegratorType
+{
+    //direct lighting plus perfect mirror bounces up to maxDepth, fast preview
+    kIntegratorWhitted,
+    //unidirectional path tracing with next-event estimation and russian roulette
+    kIntegratorPath,
+};
+
+struct Options
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t maxDepth;
+    float fov;
+    vec3f backgroundColor;
+    //number of jittered samples traced per pixel, one per pass
+    uint32_t samplesPerPixel = 1;
+    //only pixels inside the window are traced, an empty window renders the full frame
+    CropWindow crop;
+    //accumulation state is written here every [checkpointInterval] passes, NULL disables it
+    const char* checkpointPath = NULL;
+    uint32_t checkpointInterval = 4;
+    //number of render threads, 0 uses one per core
+    uint32_t numThreads = 0;
+    //generates the per-pixel sample positions, NULL uses independent random samples
+    const Sampler* sampler = NULL;
+    IntegratorType integrator = kIntegratorWhitted;
+    //path tracing: bounces before russian roulette starts and a hard cap on the path length
+    uint32_t rouletteDepth = 3;
+    uint32_t maxPathDepth = 64;
+    //renders spectrally with reflectances upsampled through this table, NULL renders in RGB
+    const RGB2Spec* rgb2spec = NULL;
+    //resolves primary visibility by rasterization (gbuffer.h), only secondary rays are traced.
+    //Needs the whitted integrator and one sample per pixel, otherwise everything is traced
+    bool hybrid = false;
+    //milliseconds renderToFile() may take, 0 renders to full quality however long it takes.
+    //samplesPerPixel is the most a budgeted render refines to
+    double timeBudget = 0;
+    //no span of a row is started past this point, render() stops early and reports what it
+    //finished. The render overruns it by the time one span takes on every thread at most
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    //the rays a render traces, primary, secondary and shadow, are added to this counter if
+    //it is not NULL
+    std::atomic<uint64_t>* rayCount = NULL;
+};
+
+//What a budgeted render reached: the image was traced at 1 / [resolutionDivisor] of the
+//frame size with at least [samplesPerPixel] samples on every pixel
+struct RenderQuality
+{
+    uint32_t resolutionDivisor = 0;
+    uint32_t samplesPerPixel = 0;
+    double milliseconds = 0;
+    
+    //no level finished in time and the image is black
+    bool empty() const { return resolutionDivisor == 0; }
+};
+
+//The objects, lights and camera of a frame. A scene owns its objects and lights
+struct Scene
+{
+    Scene() {}
+    ~Scene()
+    {
+        for (size_t i = 0; i < objects.size(); i++)
+            delete objects[i];
+        for (size_t i = 0; i < lights.size(); i++)
+            delete lights[i];
+    }
+    
+    Scene(const Scene&) = delete;
+    Scene& operator = (const Scene&) = delete;
+    
+    std::vector<Object*> objects;
+    std::vector<Light*> lights;
+    //the camera looks down its -z axis
+    Transform camToWorld;
+};
+
+//The crop window of [options] clamped to the frame, the whole frame if it is empty
+CropWindow resolveCrop(const Options& options);
+
+//Renders the crop window of the frame into [img], which has the size of the window.
+//A single pass without checkpointing writes every sample straight into the image.
+//Otherwise every pass traces one sample per pixel into an accumulation buffer, which is
+//checkpointed to disk so a killed render resumes from its last checkpoint, and the last
+//pass resolves the mean of each row into the image as soon as the row is done.
+//Rows are not started past options.deadline. returns the number of passes that finished
+//on every pixel; after an early stop the image holds the mean of the samples that were
+//traced, unless not even the first pass finished.
+//Instantiated for the pixel formats of image.h.
+template <typename Format>
+uint32_t render(const Options& options, const Scene& scene, const CropWindow& crop, ImageT<Format>& img);
+
+//Renders the crop window into [img] within options.timeBudget milliseconds. The frame is
+//first traced at 1/8, 1/4 and 1/2 resolution, then at full resolution pass by pass up to
+//options.samplesPerPixel. A level that the previous one predicts not to finish in time is
+//not started, and one that runs into the deadline is dropped, so [img] gets the last level
+//that completed. The budget is best-effort: tracing overruns it by one span of a row per
+//thread at most (see Options::deadline), and upscaling the level into [img], a single pass
+//over the output, comes on top.
+template <typename Format>
+RenderQuality renderWithBudget(const Options& options, const Scene& scene, const CropWindow& crop, ImageT<Format>& img);
+
+//A set of objects as a 256 bit bloom filter, contains() can be wrong about an object
+//that was never inserted but never about one that was
+struct ObjectSet
+{
+    ObjectSet() { clear(); }
+    
+    void clear() { bits[0] = bits[1] = bits[2] = bits[3] = 0; }
+    
+    void insert(const Object* object)
+    {
+        uint64_t h = hash(object);
+        bits[(h >> 62) & 3] |= 1ull << ((h >> 56) & 63);
+        bits[(h >> 46) & 3] |= 1ull << ((h >> 40) & 63);
+    }
+    
+    bool contains(const Object* object) const
+    {
+        uint64_t h = hash(object);
+        return (bits[(h >> 62) & 3] & (1ull << ((h >> 56) & 63))) &&
+               (bits[(h >> 46) & 3] & (1ull << ((h >> 40) & 63)));
+    }
+    
+private:
+    //objects are identified by address, the multiplication spreads it into the high bits
+    static uint64_t hash(const Object* object) { return (uint64_t)(uintptr_t)object * 0x9E3779B97F4A7C15ull; }
+    
+    uint64_t bits[4];
+};
+
+//What the rays of one tile depended on: the objects they hit and a box around the
+//secondary rays, shadow rays included, which an object must enter to start blocking one
+struct TileFootprint
+{
+    TileFootprint() { clear(); }
+    
+    void clear()
+    {
+        objects.clear();
+        secondaryMin = vec3f(INFINITY);
+        secondaryMax = vec3f(-INFINITY);
+    }
+    
+    //the segment from [pos] along [dir] to distance [t], which may be infinite
+    void addSegment(const vec3f& pos, const vec3f& dir, float t)
+    {
+        vec3f end = pos + dir * t;
+        //inf * 0 is NaN, an axis the ray does not move along stays at pos
+        if (dir.x == 0) end.x = pos.x;
+        if (dir.y == 0) end.y = pos.y;
+        if (dir.z == 0) end.z = pos.z;
+        secondaryMin = vec3f(std::min(secondaryMin.x, std::min(pos.x, end.x)), std::min(secondaryMin.y, std::min(pos.y, end.y)),
+                             std::min(secondaryMin.z, std::min(pos.z, end.z)));
+        secondaryMax = vec3f(std::max(secondaryMax.x, std::max(pos.x, end.x)), std::max(secondaryMax.y, std::max(pos.y, end.y)),
+                             std::max(secondaryMax.z, std::max(pos.z, end.z)));
+    }
+    
+    bool overlaps(const vec3f& min, const vec3f& max) const
+    {
+        return min.x <= secondaryMax.x && secondaryMin.x <= max.x && min.y <= secondaryMax.y &&
+               secondaryMin.y <= max.y && min.z <= secondaryMax.z && secondaryMin.z <= max.z;
+    }
+    
+    ObjectSet objects;
+    vec3f secondaryMin, secondaryMax;
+};
+
+class RenderEngine;
+class RenderJob;
+
+//The changes to a scene since a frame of it was rendered, what RenderEngine::submitIncremental()
+//needs to decide which tiles of the frame can be reused.
+//A tile renders again if its rays hit a changed object. For geometry changes it also does if
+//the old or new screen bounds of the object overlap it, or the old or new world bounds its
+//secondary rays; markChanged() must be called before the object is modified so the old
+//bounds are known. A secondary ray that left the scene spans everything, so with mirrors
+//seeing the background or distant lights geometry edits re-render much of the frame.
+//Edits of lights or the camera need markAll().
+class SceneEdit
+{
+public:
+    explicit SceneEdit(const RenderJob& frame);
+    
+    //the shape or placement of [object] is about to change
+    void markChanged(const Object* object);
+    //only the albedo, type or texture of [object] changed
+    void markMaterialChanged(const Object* object);
+    //every tile renders again
+    void markAll() { all = true; }
+    
+private:
+    friend class RenderEngine;
+    
+    struct Change
+    {
+        const Object* object;
+        bool geometry;
+        CropWindow oldScreenBounds, newScreenBounds;
+        vec3f oldMin, oldMax, newMin, newMax;
+    };
+    
+    //the pixels [object] can cover in the frame, an empty window if none
+    CropWindow screenBounds(const Object* object) const;
+    void worldBounds(const Object* object, vec3f& min, vec3f& max) const;
+    bool affects(const Change& change, const TileFootprint& footprint, uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) const;
+    
+    const Options& options;
+    const Scene& scene;
+    bool all;
+    //new bounds are filled in at submission
+    std::vector<Change> changes;
+};
+
+//A frame rendered by a RenderEngine, shared by the engine and whoever submitted it
+class RenderJob
+{
+public:
+    enum State
+    {
+        kStateQueued,
+        kStateRunning,
+        kStateDone,
+        kStateCancelled,
+    };
+    
+    ~RenderJob();
+    
+    RenderJob(const RenderJob&) = delete;
+    RenderJob& operator = (const RenderJob&) = delete;
+    
+    State getState() const { return state; }
+    int getPriority() const { return priority; }
+    //the tiles the job renders, fewer than cover the frame for an incremental render
+    uint32_t getNumTiles() const { return numTiles; }
+    //fraction of the tiles that are finished
+    float getProgress() const { return numTiles ? (float)tilesDone / numTiles : 1.0f; }
+    
+    //Drops the tiles that have not started, tiles in flight stop at their next row.
+    //Does nothing once the job is done
+    void cancel();
+    //blocks until the job is done or cancelled, returns true if it is done
+    bool wait();
+    
+    //the crop window of the frame, complete once the job is done
+    const Image& getImage() const { return image; }
+    const CropWindow& getCrop() const { return crop; }
+    
+private:
+    friend class RenderEngine;
+    friend class SceneEdit;
+    
+    //Tiles are rendered row by row, a preempted tile goes back to its job with the rows
+    //that are left. [index] numbers the tiles of the frame in scanline order
+    struct Tile
+    {
+        uint32_t x0, y0, x1, y1;
+        uint32_t index;
+    };
+    
+    RenderJob(RenderEngine* engine, const std::shared_ptr<const Scene>& scene, const Options& options,
+              const CropWindow& crop, int priority, uint64_t sequence);
+    
+    RenderEngine* engine;
+    std::shared_ptr<const Scene> scene;
+    Options options;
+    CropWindow crop;
+    int priority;
+    //submission order, ties of priority go first come first served
+    uint64_t sequence;
+    Image image;
+    //what each tile of the frame depended on
+    std::vector<TileFootprint> footprints;
+    //the part of the frame that is traced, the crop window unless the render is incremental
+    CropWindow traceWindow;
+    
+    //traces the samples, set up by the first worker to reach the job
+    FrameTracer* tracer;
+    std::once_flag setupFlag;
+    
+    std::atomic<State> state;
+    std::atomic<bool> cancelled;
+    std::atomic<uint32_t> tilesDone;
+    uint32_t numTiles;
+    //guarded by the engine's mutex
+    std::deque<Tile> tiles;
+    uint32_t tilesInFlight;
+};
+
+//Renders jobs on a pool of worker threads that lives as long as the engine, over scenes
+//that stay loaded between jobs. Jobs are cut into tiles and a worker always takes the
+//next tile of the job with the highest priority, first submitted first. A worker on a
+//tile checks after every row whether a job of higher priority is waiting and if so hands
+//the rest of its tile back, so a preview preempts batch renders within one tile row.
+class RenderEngine
+{
+public:
+    typedef uint32_t SceneId;
+    
+    enum
+    {
+        kPriorityBatch = 0,
+        kPriorityPreview = 100,
+    };
+    
+    static const uint32_t kTileSize = 32;
+    
+    //starts [numThreads] workers (0 = one per core)
+    explicit RenderEngine(unsigned numThreads = 0);
+    //cancels every job and stops the workers
+    ~RenderEngine();
+    
+    RenderEngine(const RenderEngine&) = delete;
+    RenderEngine& operator = (const RenderEngine&) = delete;
+    
+    //the engine owns [scene] from now on, it must not change while jobs render it
+    SceneId addScene(Scene* scene);
+    //Unloads the scene, jobs already submitted still render it and it is deleted with
+    //the last of them. returns false for an unknown id
+    bool removeScene(SceneId id);
+    
+    //Queues a render of the crop window of [options] on scene [id] into a float image.
+    //The job traces options.samplesPerPixel samples per pixel; checkpointing, the time
+    //budget and options.numThreads are not used by the engine. returns NULL for an unknown
+    //scene or an empty crop window
+    std::shared_ptr<RenderJob> submit(SceneId id, const Options& options, int priority = kPriorityBatch);
+    //Queues a render of the frame of [previous] after [edit], only the tiles the edit can
+    //affect are traced and the other pixels are copied. [previous] must be done, otherwise
+    //or if the engine is stopping returns NULL
+    std::shared_ptr<RenderJob> submitIncremental(const RenderJob& previous, const SceneEdit& edit,
+                                                 int priority = kPriorityPreview);
+    
+    unsigned getNumThreads() const { return (unsigned)workers.size(); }
+    
+private:
+    friend class RenderJob;
+    
+    void workerLoop();
+    //the job with the highest priority that has tiles left, NULL if there is none
+    RenderJob* nextJob() const;
+    //renders [tile] and returns true, or false with [tile] shrunk to the rows left if the
+    //job was cancelled or a job of higher priority is waiting
+    bool renderTile(RenderJob& job, RenderJob::Tile& tile);
+    //called with the mutex held whenever tiles are queued or taken
+    void updatePendingPriority();
+    //called with the mutex held, finishes [job] if it has no tiles left
+    void retireIfFinished(RenderJob& job);
+    
+    std::vector<std::thread> workers;
+    mutable std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable jobFinished;
+    bool stopping;
+    
+    std::map<SceneId, std::shared_ptr<const Scene> > scenes;
+    SceneId nextSceneId;
+    std::vector<std::shared_ptr<RenderJob> > jobs;
+    uint64_t nextSequence;
+    //highest priority of a job with queued tiles, INT_MIN if there is none
+    std::atomic<int> pendingPriority;
+};
+
+#endif /* render_engine_h */
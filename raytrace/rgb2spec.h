@@ -0,0 +1,443 @@
+//
+//  rgb2spec.h
+//  theraytracer
+//
+//  Upsampling of RGB colors to smooth reflectance spectra through a
+//  precomputed coefficient table (Jakob & Hanika 2019, "A Low-Dimensional
+//  Function Space for Efficient Spectral Upsampling"). A spectrum is
+//  sigmoid(c0 * lambda^2 + c1 * lambda + c2), the table stores the
+//  coefficients for a grid of RGB colors. It is generated once, written
+//  to disk and memory-mapped afterwards, so upsampling at runtime is a
+//  table fetch plus the evaluation of the polynomial.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef rgb2spec_h
+#define rgb2spec_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include "vec3.h"
+#include "spectrum.h"
+#include "parallel.h"
+#include "mapped_file.h"
+
+//linear sRGB (D65 white) to CIE XYZ and back
+const double kSRGBToXYZ[3][3] = {
+    { 0.4124564, 0.3575761, 0.1804375 },
+    { 0.2126729, 0.7151522, 0.0721750 },
+    { 0.0193339, 0.1191920, 0.9503041 }
+};
+
+const double kXYZToSRGB[3][3] = {
+    {  3.2404542, -1.5371385, -0.4985314 },
+    { -0.9692660,  1.8760108,  0.0415560 },
+    {  0.0556434, -0.2040259,  1.0572252 }
+};
+
+//Evaluates the spectrum described by [coeffs] at wavelength [lambda] (nm)
+inline float evalSigmoidPolynomial(const float* coeffs, float lambda)
+{
+    float x = (coeffs[0] * lambda + coeffs[1]) * lambda + coeffs[2];
+    if (isinf(x))
+        return x > 0 ? 1.0f : 0.0f;
+    return 0.5f + x / (2 * sqrtf(1 + x * x));
+}
+
+class RGB2Spec
+{
+public:
+    RGB2Spec() : res(0), scale(NULL), data(NULL) {}
+    ~RGB2Spec() { unload(); }
+
+    //Looks up the coefficients of the reflectance spectrum of [rgb] (linear sRGB, clamped to [0, 1])
+    void fetch(const vec3f& rgb, float* coeffs) const
+    {
+        float c[3] = { clamp_nv(rgb.x, 0.0f, 1.0f), clamp_nv(rgb.y, 0.0f, 1.0f), clamp_nv(rgb.z, 0.0f, 1.0f) };
+
+        int i = 0;
+        for (int j = 1; j < 3; j++)
+        {
+            if (c[j] >= c[i])
+                i = j;
+        }
+
+        float z = c[i];
+        if (z == 0)
+        {
+            //black, the sigmoid of -inf
+            coeffs[0] = coeffs[1] = 0;
+            coeffs[2] = -INFINITY;
+            return;
+        }
+
+        float x = c[(i + 1) % 3] * (res - 1) / z;
+        float y = c[(i + 2) % 3] * (res - 1) / z;
+
+        int xi = std::min((int)x, res - 2);
+        int yi = std::min((int)y, res - 2);
+        int zi = (int)(std::upper_bound(scale, scale + res, z) - scale) - 1;
+        zi = clamp_nv(zi, 0, res - 2);
+
+        float x1 = x - xi, x0 = 1 - x1;
+        float y1 = y - yi, y0 = 1 - y1;
+        float z1 = (z - scale[zi]) / (scale[zi + 1] - scale[zi]), z0 = 1 - z1;
+
+        size_t dx = 3;
+        size_t dy = 3 * (size_t)res;
+        size_t dz = 3 * (size_t)res * res;
+        const float* p = data + 3 * ((((size_t)i * res + zi) * res + yi) * res + xi);
+
+        for (int j = 0; j < 3; j++, p++)
+        {
+            coeffs[j] = ((p[0] * x0 + p[dx] * x1) * y0 +
+                         (p[dy] * x0 + p[dy + dx] * x1) * y1) * z0 +
+                        ((p[dz] * x0 + p[dz + dx] * x1) * y0 +
+                         (p[dz + dy] * x0 + p[dz + dy + dx] * x1) * y1) * z1;
+        }
+    }
+
+    bool isLoaded() const { return data != NULL; }
+
+    //Memory-maps a table written by generate()
+    //returns false if the file does not exist or is not a valid table
+    bool load(const char* path);
+    void unload();
+
+    //Fits the coefficients for a [resolution]^3 grid of colors and writes the table to [path].
+    //Takes a few seconds, the result is reused by every later run through load().
+    static bool generate(const char* path, int resolution, unsigned numThreads = 0);
+
+    int res;
+    const float* scale;
+    const float* data;
+
+private:
+    MappedFile file;
+};
+
+//Fits coefficients for linear sRGB colors by Gauss-Newton iteration on the
+//CIELAB difference between the color of the spectrum (under D65) and the target
+class RGB2SpecOptimizer
+{
+public:
+    static const int kNumSamples = SpectralTables::kNumSamples;
+
+    RGB2SpecOptimizer()
+    {
+        SpectralTables tables;
+
+        double norm = 0;
+        for (int i = 0; i < kNumSamples; i++)
+            norm += simpsonWeight(i) * tables.cmf[1][i] * tables.illuminant[i];
+
+        for (int i = 0; i < kNumSamples; i++)
+        {
+            //wavelengths normalized to [0, 1] keep the fit well conditioned
+            lambda[i] = (double)i / (kNumSamples - 1);
+            for (int c = 0; c < 3; c++)
+                xyzWeights[c][i] = simpsonWeight(i) * tables.cmf[c][i] * tables.illuminant[i] / norm;
+        }
+
+        for (int c = 0; c < 3; c++)
+        {
+            whitepoint[c] = 0;
+            for (int i = 0; i < kNumSamples; i++)
+                whitepoint[c] += xyzWeights[c][i];
+        }
+    }
+
+    static double simpsonWeight(int i)
+    {
+        return (i == 0 || i == kNumSamples - 1) ? 1 : ((i & 1) ? 4 : 2);
+    }
+
+    void rgbToLab(const double* rgb, double* lab) const
+    {
+        double xyz[3];
+        for (int j = 0; j < 3; j++)
+            xyz[j] = kSRGBToXYZ[j][0] * rgb[0] + kSRGBToXYZ[j][1] * rgb[1] + kSRGBToXYZ[j][2] * rgb[2];
+        xyzToLab(xyz, lab);
+    }
+
+    void xyzToLab(const double* xyz, double* lab) const
+    {
+        double f[3];
+        for (int j = 0; j < 3; j++)
+        {
+            const double delta = 6.0 / 29.0;
+            double t = xyz[j] / whitepoint[j];
+            f[j] = (t > delta * delta * delta) ? cbrt(t) : t / (3 * delta * delta) + 4.0 / 29.0;
+        }
+        lab[0] = 116 * f[1] - 16;
+        lab[1] = 500 * (f[0] - f[1]);
+        lab[2] = 200 * (f[1] - f[2]);
+    }
+
+    void residual(const double* coeffs, const double* targetLab, double* r) const
+    {
+        double xyz[3] = { 0, 0, 0 };
+        for (int i = 0; i < kNumSamples; i++)
+        {
+            double x = (coeffs[0] * lambda[i] + coeffs[1]) * lambda[i] + coeffs[2];
+            double s = 0.5 + x / (2 * sqrt(1 + x * x));
+            for (int c = 0; c < 3; c++)
+                xyz[c] += xyzWeights[c][i] * s;
+        }
+
+        double lab[3];
+        xyzToLab(xyz, lab);
+        for (int j = 0; j < 3; j++)
+            r[j] = lab[j] - targetLab[j];
+    }
+
+    //Refines [coeffs] (normalized wavelengths) for [rgb]. Steps that would increase the
+    //error are halved, the sigmoid saturates for colors near white and undamped steps
+    //can then oscillate into a spectrum that dips far below the target.
+    void gaussNewton(const double* rgb, double* coeffs, int iterations = 15) const
+    {
+        double targetLab[3];
+        rgbToLab(rgb, targetLab);
+        
+        double r[3];
+        residual(coeffs, targetLab, r);
+        double error = r[0] * r[0] + r[1] * r[1] + r[2] * r[2];
+        
+        for (int it = 0; it < iterations && error > 1e-12; it++)
+        {
+            double J[3][3];
+            for (int j = 0; j < 3; j++)
+            {
+                double c0[3] = { coeffs[0], coeffs[1], coeffs[2] };
+                double c1[3] = { coeffs[0], coeffs[1], coeffs[2] };
+                c0[j] -= 1e-5;
+                c1[j] += 1e-5;
+                
+                double r0[3], r1[3];
+                residual(c0, targetLab, r0);
+                residual(c1, targetLab, r1);
+                for (int k = 0; k < 3; k++)
+                    J[k][j] = (r1[k] - r0[k]) / 2e-5;
+            }
+            
+            double step[3];
+            if (!solve3x3(J, r, step))
+                break;
+            
+            bool improved = false;
+            for (int halvings = 0; halvings < 16 && !improved; halvings++)
+            {
+                double next[3];
+                double maxCoeff = 0;
+                for (int j = 0; j < 3; j++)
+                {
+                    next[j] = coeffs[j] - step[j];
+                    maxCoeff = std::max(maxCoeff, fabs(next[j]));
+                }
+                
+                //keep the sigmoid from saturating so hard the fit can no longer move
+                if (maxCoeff > 200)
+                {
+                    for (int j = 0; j < 3; j++)
+                        next[j] *= 200 / maxCoeff;
+                }
+                
+                double nextR[3];
+                residual(next, targetLab, nextR);
+                double nextError = nextR[0] * nextR[0] + nextR[1] * nextR[1] + nextR[2] * nextR[2];
+                if (nextError < error)
+                {
+                    memcpy(coeffs, next, sizeof(next));
+                    memcpy(r, nextR, sizeof(nextR));
+                    error = nextError;
+                    improved = true;
+                }
+                
+                for (int j = 0; j < 3; j++)
+                    step[j] *= 0.5;
+            }
+            
+            if (!improved)
+                break;
+        }
+    }
+    
+    //Solves A x = b by gaussian elimination with partial pivoting
+    static bool solve3x3(double A[3][3], const double* b, double* x)
+    {
+        double m[3][4];
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+                m[i][j] = A[i][j];
+            m[i][3] = b[i];
+        }
+
+        for (int i = 0; i < 3; i++)
+        {
+            int pivot = i;
+            for (int j = i + 1; j < 3; j++)
+            {
+                if (fabs(m[j][i]) > fabs(m[pivot][i]))
+                    pivot = j;
+            }
+            if (fabs(m[pivot][i]) < 1e-15)
+                return false;
+            for (int k = 0; k < 4; k++)
+                std::swap(m[i][k], m[pivot][k]);
+
+            for (int j = i + 1; j < 3; j++)
+            {
+                double f = m[j][i] / m[i][i];
+                for (int k = i; k < 4; k++)
+                    m[j][k] -= f * m[i][k];
+            }
+        }
+
+        for (int i = 2; i >= 0; i--)
+        {
+            double sum = m[i][3];
+            for (int j = i + 1; j < 3; j++)
+                sum -= m[i][j] * x[j];
+            x[i] = sum / m[i][i];
+        }
+
+        return true;
+    }
+
+    //Converts coefficients of normalized wavelengths to coefficients of wavelengths in nm
+    static void denormalize(const double* c, float* out)
+    {
+        double lambdaMin = kLambdaMin;
+        double range = kLambdaMax - kLambdaMin;
+        double c0 = c[0] / (range * range);
+        double c1 = c[1] / range;
+        out[0] = (float)c0;
+        out[1] = (float)(c1 - 2 * c0 * lambdaMin);
+        out[2] = (float)(c[2] - c1 * lambdaMin + c0 * lambdaMin * lambdaMin);
+    }
+
+    double lambda[kNumSamples];
+    double xyzWeights[3][kNumSamples];
+    double whitepoint[3];
+};
+
+//table file layout: "SPEC", int32 resolution, float scale[res], float coeffs[3][res][res][res][3]
+
+inline bool RGB2Spec::generate(const char* path, int resolution, unsigned numThreads)
+{
+    if (resolution < 2)
+        return false;
+
+    const int res = resolution;
+    RGB2SpecOptimizer optimizer;
+
+    //denser near black where small differences are visible
+    std::vector<float> scale(res);
+    for (int k = 0; k < res; k++)
+    {
+        double t = (double)k / (res - 1);
+        t = t * t * (3 - 2 * t);
+        scale[k] = (float)(t * t * (3 - 2 * t));
+    }
+
+    std::vector<float> table((size_t)3 * res * res * res * 3);
+
+    //every (max channel, y) row is independent, z walks outwards from a well conditioned
+    //start so that every fit starts from the coefficients of its neighbour
+    parallelFor(0, 3 * res, 1, [&](int row)
+    {
+        int l = row / res;
+        int j = row % res;
+        double y = (double)j / (res - 1);
+
+        for (int i = 0; i < res; i++)
+        {
+            double x = (double)i / (res - 1);
+            int start = res / 5;
+
+            for (int pass = 0; pass < 2; pass++)
+            {
+                double coeffs[3] = { 0, 0, 0 };
+                int first = pass == 0 ? start : start - 1;
+                int step = pass == 0 ? 1 : -1;
+
+                for (int k = first; k >= 0 && k < res; k += step)
+                {
+                    double z = scale[k];
+                    double rgb[3];
+                    rgb[l] = z;
+                    rgb[(l + 1) % 3] = x * z;
+                    rgb[(l + 2) % 3] = y * z;
+
+                    optimizer.gaussNewton(rgb, coeffs);
+
+                    size_t idx = 3 * ((((size_t)l * res + k) * res + j) * res + i);
+                    RGB2SpecOptimizer::denormalize(coeffs, &table[idx]);
+                }
+            }
+        }
+    }, numThreads);
+
+    //written next to [path] and renamed over it, like a checkpoint, so a run killed while
+    //writing or another run loading the table never sees a torn file
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+        return false;
+
+    int32_t header = res;
+    bool ok = fwrite("SPEC", 1, 4, file) == 4;
+    ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(&scale[0], sizeof(float), scale.size(), file) == scale.size();
+    ok = ok && fwrite(&table[0], sizeof(float), table.size(), file) == table.size();
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(tmpPath.c_str(), path) != 0)
+    {
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+inline bool RGB2Spec::load(const char* path)
+{
+    unload();
+
+    if (!file.open(path) || file.size() < 8)
+    {
+        unload();
+        return false;
+    }
+
+    const char* bytes = (const char*)file.data();
+    int32_t header = 0;
+    memcpy(&header, bytes + 4, sizeof(header));
+    size_t expected = 8 + sizeof(float) * ((size_t)header + (size_t)9 * header * header * header);
+    if (memcmp(bytes, "SPEC", 4) != 0 || header < 2 || file.size() != expected)
+    {
+        unload();
+        return false;
+    }
+
+    res = header;
+    scale = (const float*)(bytes + 8);
+    data = scale + res;
+    return true;
+}
+
+inline void RGB2Spec::unload()
+{
+    file.close();
+    scale = data = NULL;
+    res = 0;
+}
+
+#endif /* rgb2spec_h */
@@ -0,0 +1,173 @@
+//
+//  sampled_spectrum.h
+//  theraytracer
+//
+//  Spectral quantities at a small set of hero wavelengths and the
+//  color models the integrators shade in: plain RGB, or spectra
+//  upsampled from RGB through the RGB2Spec table
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef sampled_spectrum_h
+#define sampled_spectrum_h
+
+#include <math.h>
+#include <algorithm>
+#include "vec3.h"
+#include "rgb2spec.h"
+
+//A spectral quantity sampled at the wavelengths of a SampledWavelengths
+class SampledSpectrum
+{
+public:
+    static const int kNumSamples = 4;
+
+    SampledSpectrum() { for (int i = 0; i < kNumSamples; i++) v[i] = 0; }
+    SampledSpectrum(float f) { for (int i = 0; i < kNumSamples; i++) v[i] = f; }
+
+    SampledSpectrum operator + (const SampledSpectrum& r) const { SampledSpectrum o; for (int i = 0; i < kNumSamples; i++) o.v[i] = v[i] + r.v[i]; return o; }
+    SampledSpectrum operator * (const SampledSpectrum& r) const { SampledSpectrum o; for (int i = 0; i < kNumSamples; i++) o.v[i] = v[i] * r.v[i]; return o; }
+    SampledSpectrum operator * (const float& r) const { SampledSpectrum o; for (int i = 0; i < kNumSamples; i++) o.v[i] = v[i] * r; return o; }
+    SampledSpectrum& operator *= (const float& r) { for (int i = 0; i < kNumSamples; i++) v[i] *= r; return *this; }
+    void operator += (const SampledSpectrum& r) { for (int i = 0; i < kNumSamples; i++) v[i] += r.v[i]; }
+
+    float maxComponent() const { return *std::max_element(v, v + kNumSamples); }
+
+    float v[kNumSamples];
+};
+
+//Hero wavelength sampling: one uniform number places kNumSamples wavelengths
+//evenly spread (mod the spectral range) over the visible spectrum
+class SampledWavelengths
+{
+public:
+    static SampledWavelengths sample(float u)
+    {
+        SampledWavelengths w;
+        for (int i = 0; i < SampledSpectrum::kNumSamples; i++)
+        {
+            float r = u + (float)i / SampledSpectrum::kNumSamples;
+            r -= (r >= 1) ? 1 : 0;
+            w.lambda[i] = kLambdaMin + r * (kLambdaMax - kLambdaMin);
+        }
+        return w;
+    }
+
+    float lambda[SampledSpectrum::kNumSamples];
+};
+
+//The color matching functions and D65 on the grid of SpectralTables, normalized for rendering
+class CIETables
+{
+public:
+    static const CIETables& get()
+    {
+        static const CIETables tables;
+        return tables;
+    }
+
+    //linear interpolation of a table of SpectralTables at [lambda] (nm)
+    static float lookup(const float* f, float lambda)
+    {
+        float b = (lambda - kLambdaMin) / SpectralTables::kStep;
+        int i = clamp_nv((int)b, 0, SpectralTables::kNumSamples - 2);
+        float t = b - i;
+        return f[i] * (1 - t) + f[i + 1] * t;
+    }
+
+    SpectralTables tables;
+    //integral of the y color matching function, Y of a constant spectrum of 1
+    float integralY;
+    //scales D65 so that it has Y = 1, like an RGB white light of 1
+    float illuminantScale;
+
+private:
+    CIETables()
+    {
+        integralY = (float)SpectralTables::integrate(tables.cmf[1], NULL);
+        illuminantScale = integralY / (float)SpectralTables::integrate(tables.cmf[1], tables.illuminant);
+    }
+};
+
+//Shading in RGB, every conversion is the identity
+class RGBColorModel
+{
+public:
+    typedef vec3f Color;
+
+    Color reflectance(const vec3f& rgb) const { return rgb; }
+    Color illuminant(const vec3f& rgb) const { return rgb; }
+    vec3f toRGB(const Color& c) const { return c; }
+};
+
+//Shading at the hero wavelengths [lambda]. Reflectances are upsampled through the
+//RGB2Spec table, lights are D65 tinted by the upsampled light color, so RGB and
+//spectral renders of the same scene agree up to the effects of the spectra.
+class SpectralColorModel
+{
+public:
+    typedef SampledSpectrum Color;
+
+    SpectralColorModel(const RGB2Spec& t, const SampledWavelengths& w) : table(t), wavelengths(w) {}
+
+    Color reflectance(const vec3f& rgb) const
+    {
+        float coeffs[3];
+        table.fetch(rgb, coeffs);
+
+        Color c;
+        for (int i = 0; i < Color::kNumSamples; i++)
+            c.v[i] = evalSigmoidPolynomial(coeffs, wavelengths.lambda[i]);
+        return c;
+    }
+
+    //light colors are unbounded, the spectrum of the color scaled to a maximum of 1 is scaled back up
+    Color illuminant(const vec3f& rgb) const
+    {
+        float m = std::max(rgb.x, std::max(rgb.y, rgb.z));
+        if (m <= 0)
+            return Color();
+
+        float coeffs[3];
+        table.fetch(rgb * (1 / m), coeffs);
+
+        const CIETables& cie = CIETables::get();
+        Color c;
+        for (int i = 0; i < Color::kNumSamples; i++)
+        {
+            float d65 = CIETables::lookup(cie.tables.illuminant, wavelengths.lambda[i]) * cie.illuminantScale;
+            c.v[i] = m * d65 * evalSigmoidPolynomial(coeffs, wavelengths.lambda[i]);
+        }
+        return c;
+    }
+
+    //Monte Carlo estimate of the linear sRGB color of the spectrum
+    vec3f toRGB(const Color& c) const
+    {
+        const CIETables& cie = CIETables::get();
+        double xyz[3] = { 0, 0, 0 };
+        for (int i = 0; i < Color::kNumSamples; i++)
+        {
+            for (int j = 0; j < 3; j++)
+                xyz[j] += c.v[i] * CIETables::lookup(cie.tables.cmf[j], wavelengths.lambda[i]);
+        }
+
+        //uniform wavelength pdf of 1 / range
+        double norm = (kLambdaMax - kLambdaMin) / (Color::kNumSamples * cie.integralY);
+        for (int j = 0; j < 3; j++)
+            xyz[j] *= norm;
+
+        return vec3f((float)(kXYZToSRGB[0][0] * xyz[0] + kXYZToSRGB[0][1] * xyz[1] + kXYZToSRGB[0][2] * xyz[2]),
+                     (float)(kXYZToSRGB[1][0] * xyz[0] + kXYZToSRGB[1][1] * xyz[1] + kXYZToSRGB[1][2] * xyz[2]),
+                     (float)(kXYZToSRGB[2][0] * xyz[0] + kXYZToSRGB[2][1] * xyz[1] + kXYZToSRGB[2][2] * xyz[2]));
+    }
+
+    const RGB2Spec& table;
+    SampledWavelengths wavelengths;
+};
+
+inline float maxComponent(const vec3f& c) { return std::max(c.x, std::max(c.y, c.z)); }
+inline float maxComponent(const SampledSpectrum& c) { return c.maxComponent(); }
+
+#endif /* sampled_spectrum_h */
@@ -0,0 +1,182 @@
+//
+//  scenes.h
+//  theraytracer
+//
+//  Scenes built in code: the default scene of the command line renderer
+//  and the reference scenes of the regression suite. Everything random
+//  is drawn from fixed seeds, so a scene is the same on every run.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef scenes_h
+#define scenes_h
+
+#include <math.h>
+#include <vector>
+#include "vec3.h"
+#include "matrix4x4.h"
+#include "transform.h"
+#include "random.h"
+#include "geometry.h"
+#include "compressed_mesh.h"
+#include "light.h"
+#include "render_engine.h"
+
+//The camera every scene here is seen from, above and behind the origin looking down -z
+inline Transform defaultCamera()
+{
+    return Transform(Mat44Util::look_at(vec3f(0, 10, -20), vec3f(0, 0, -1)));
+}
+
+//Two diffuse spheres and a mirror sphere on a floor disk, lit by a blue and a green point
+//light. returns the floor, which takes the texture of the command line
+inline Disk* buildDefaultScene(Scene& scene)
+{
+    std::vector<Object*>& objects = scene.objects;
+    std::vector<Light*>& lights = scene.lights;
+    scene.camToWorld = defaultCamera();
+
+    Disk* disk = new Disk(vec3f(0,-1.0f,0), vec3f(0,1,0), 30, vec3f(0.3f));
+    disk->type = kDiffuse;
+
+    objects.push_back(disk);
+    objects.push_back(new Sphere(vec3f(-5,2,10), 3, vec3f(0.5f)));
+    objects.push_back(new Sphere(vec3f(5,2,5), 3, vec3f(0.18f)));
+
+    Sphere* refletionSphere = new Sphere(vec3f(0,2,5), 2.0f, vec3f(0.8f));
+    refletionSphere->type = kReflection;
+    objects.push_back(refletionSphere);
+
+    mat44f distLightMat;
+    distLightMat[2][0] = 3;
+    distLightMat[2][1] = 5;
+    distLightMat[2][2] = 4;
+    lights.push_back(new DistantLight(Transform(distLightMat), vec3f(1.0f, 1.0f, 1.0f), 0.0f));
+
+    distLightMat[3][0] = -10;
+    distLightMat[3][1] = 3;
+    distLightMat[3][2] = 3.0f;
+    lights.push_back(new PointLight(Transform(distLightMat), vec3f(0.3f, 0.3f, 1.0f), 2000));
+
+    distLightMat[3][0] = 8;
+    distLightMat[3][1] = 5
+    ;
+    distLightMat[3][2] = -2.5f;
+    lights.push_back(new PointLight(Transform(distLightMat), vec3f(0.3f, 1.0f, 0.4f), 1500));
+
+    return disk;
+}
+
+//A point light at [pos]
+inline PointLight* makePointLight(const vec3f& pos, const vec3f& color, float intensity)
+{
+    mat44f m;
+    m[3][0] = pos.x;
+    m[3][1] = pos.y;
+    m[3][2] = pos.z;
+    return new PointLight(Transform(m), color, intensity);
+}
+
+//[count] spheres of random position, size and albedo on a floor disk, every third a
+//mirror, lit by a distant light and a point light
+inline void buildManySpheresScene(Scene& scene, int count)
+{
+    scene.camToWorld = defaultCamera();
+    scene.objects.push_back(new Disk(vec3f(0, -1, 0), vec3f(0, 1, 0), 40, vec3f(0.3f)));
+
+    SampleRng rng(0, 0, 0x5eed);
+    for (int i = 0; i < count; i++)
+    {
+        vec3f center(-20 + rng.next01() * 40, rng.next01() * 4, -20 + rng.next01() * 30);
+        float radius = 0.3f + rng.next01() * 0.7f;
+        vec3f albedo(rng.next01(), rng.next01(), rng.next01());
+        Sphere* sphere = new Sphere(center, radius, albedo);
+        if (i % 3 == 0)
+            sphere->type = kReflection;
+        scene.objects.push_back(sphere);
+    }
+
+    mat44f sun;
+    sun[2][0] = 3;
+    sun[2][1] = 5;
+    sun[2][2] = 4;
+    scene.lights.push_back(new DistantLight(Transform(sun), vec3f(1, 0.95f, 0.9f), 0.5f));
+    scene.lights.push_back(makePointLight(vec3f(-10, 10, 3), vec3f(1), 2000));
+}
+
+//The objects of the default scene lit by [count] point lights of random color on a ring
+//above them
+inline void buildManyLightsScene(Scene& scene, int count)
+{
+    buildDefaultScene(scene);
+    for (size_t i = 0; i < scene.lights.size(); i++)
+        delete scene.lights[i];
+    scene.lights.clear();
+
+    SampleRng rng(0, 0, 0x119b7);
+    for (int i = 0; i < count; i++)
+    {
+        float phi = 2 * M_PI * i / count;
+        vec3f pos(12 * cosf(phi), 6 + rng.next01() * 4, 6 + 12 * sinf(phi));
+        vec3f color(0.2f + rng.next01(), 0.2f + rng.next01(), 0.2f + rng.next01());
+        scene.lights.push_back(makePointLight(pos, color, 4000.0f / count));
+    }
+}
+
+//Writes a closed bumpy ball of [rings] x [segments] quads, two triangles each, as a
+//compressed mesh to [path]
+inline bool writeMeshFile(const char* path, int rings, int segments)
+{
+    const vec3f center(0, 3.5f, 6);
+    std::vector<vec3f> positions;
+    for (int i = 0; i <= rings; i++)
+    {
+        float theta = M_PI * i / rings;
+        for (int j = 0; j < segments; j++)
+        {
+            float phi = 2 * M_PI * j / segments;
+            float r = 4 + 0.4f * sinf(5 * theta) * cosf(7 * phi);
+            positions.push_back(center + vec3f(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi)) * r);
+        }
+    }
+
+    std::vector<float> triangles;
+    auto addTriangle = [&](const vec3f& a, const vec3f& b, const vec3f& c)
+    {
+        float tri[9] = { a.x, a.y, a.z, b.x, b.y, b.z, c.x, c.y, c.z };
+        triangles.insert(triangles.end(), tri, tri + 9);
+    };
+    for (int i = 0; i < rings; i++)
+    {
+        for (int j = 0; j < segments; j++)
+        {
+            const vec3f& a = positions[i * segments + j];
+            const vec3f& b = positions[i * segments + (j + 1) % segments];
+            const vec3f& c = positions[(i + 1) * segments + j];
+            const vec3f& d = positions[(i + 1) * segments + (j + 1) % segments];
+            //the rows at the poles collapse to a point, their quads are single triangles
+            if (i > 0)
+                addTriangle(a, b, c);
+            if (i < rings - 1)
+                addTriangle(b, d, c);
+        }
+    }
+    return CompressedMesh::build(&triangles[0], triangles.size() / 9, path);
+}
+
+//The compressed mesh at [meshPath] on the floor of the default scene, lit by its lights.
+//returns false if the mesh cannot be opened
+inline bool buildMeshScene(Scene& scene, const char* meshPath)
+{
+    buildDefaultScene(scene);
+    for (size_t i = 1; i < scene.objects.size(); i++)
+        delete scene.objects[i];
+    scene.objects.resize(1);
+
+    CompressedMesh* mesh = new CompressedMesh(vec3f(0.7f, 0.5f, 0.3f));
+    scene.objects.push_back(mesh);
+    return mesh->open(meshPath);
+}
+
+#endif /* scenes_h */
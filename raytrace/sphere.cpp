@@ -42,12 +42,44 @@ void Sphere::getSurfaceData(const vec3f &hit, vec3f &normal, vec3f &texCoord) co
     normal = n;
     
     float phi = (1 + atan2(n.z, n.x) / M_PI) * 0.5f;
-    float theta = acos(hit.y/radius) / M_PI;
+    float theta = acos(clamp_nv(n.y, -1.0f, 1.0f)) / M_PI;
     
     texCoord.x = phi;
     texCoord.y = theta;
 }
 
+//A latitude-longitude mesh, pushed out so that its faces lie outside the sphere
+bool Sphere::tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const
+{
+    const int stacks = 32, slices = 64;
+    float r = radius / (cosf(M_PI / (2 * stacks)) * cosf(M_PI / slices));
+    uint32_t first = (uint32_t)positions.size();
+    
+    for (int i = 0; i <= stacks; i++)
+    {
+        float theta = M_PI * i / stacks;
+        for (int j = 0; j < slices; j++)
+        {
+            float phi = 2 * M_PI * j / slices;
+            positions.push_back(center + vec3f(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi)) * r);
+        }
+    }
+    
+    for (int i = 0; i < stacks; i++)
+    {
+        for (int j = 0; j < slices; j++)
+        {
+            uint32_t a = first + i * slices + j;
+            uint32_t b = first + i * slices + (j + 1) % slices;
+            uint32_t c = a + slices, d = b + slices;
+            uint32_t quad[6] = { a, c, b, b, c, d };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    
+    return true;
+}
+
 float Sphere::radius2() const 
 {
 	return radius*radius;
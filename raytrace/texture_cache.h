@@ -0,0 +1,350 @@
+//
+//  texture_cache.h
+//  theraytracer
+//
+//  Image textures served by a cache of tiles under a memory budget. A texture
+//  is a mip pyramid of 64x64 texel tiles, none of which is in memory until a
+//  lookup needs it: base tiles are read from the memory-mapped PPM or PGM
+//  file, coarser tiles are filtered from the four tiles below them. The
+//  least recently used tiles are evicted when the budget is exceeded, so
+//  any amount of texture renders in a bounded footprint.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef texture_cache_h
+#define texture_cache_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "vec3.h"
+#include "image.h"
+
+class TextureCache;
+
+//A block of sRGB encoded texels, tiles on the right and bottom edges of a level only use part of it
+struct TextureTile
+{
+    static constexpr int kSize = 64;
+
+    RGB8 texels[kSize * kSize];
+};
+
+typedef std::shared_ptr<const TextureTile> TextureTilePtr;
+
+//An image texture. Lookups filter the texels in linear RGB and repeat the texture outside [0, 1).
+class Texture
+{
+public:
+    //the last tile a lookup touched, neighbouring texels mostly share it
+    struct TileHint
+    {
+        uint64_t key = ~(uint64_t)0;
+        TextureTilePtr tile;
+    };
+
+    //Trilinear lookup at [u, v]. [width] is the size of the lookup footprint in texture
+    //space (1 covers the whole texture) and selects the mip levels.
+    vec3f sample(float u, float v, float width) const
+    {
+        if (!std::isfinite(u) || !std::isfinite(v))
+            return vec3f(0);
+        u -= floorf(u);
+        v -= floorf(v);
+
+        float lod = log2f(std::max(width * std::max(width_, height_), 1e-8f));
+        lod = std::min(std::max(lod, 0.0f), (float)(numLevels - 1));
+        int level = (int)lod;
+        float t = lod - level;
+
+        TileHint hint;
+        vec3f c = bilinear(level, u, v, hint);
+        if (t > 0 && level + 1 < numLevels)
+            c = c * (1 - t) + bilinear(level + 1, u, v, hint) * t;
+        return c;
+    }
+
+    int getWidth() const { return width_; }
+    int getHeight() const { return height_; }
+    int getNumLevels() const { return numLevels; }
+
+    int levelWidth(int level) const { return std::max(1, width_ >> level); }
+    int levelHeight(int level) const { return std::max(1, height_ >> level); }
+    int tilesX(int level) const { return (levelWidth(level) + TextureTile::kSize - 1) / TextureTile::kSize; }
+    int tilesY(int level) const { return (levelHeight(level) + TextureTile::kSize - 1) / TextureTile::kSize; }
+
+    //the cache key of a tile
+    uint64_t tileKey(int level, int tx, int ty) const
+    {
+        return (uint64_t)id << 52 | (uint64_t)level << 46 | (uint64_t)ty << 23 | (uint64_t)tx;
+    }
+
+private:
+    friend class TextureCache;
+
+    Texture() {}
+    Texture(const Texture&) = delete;
+    Texture& operator = (const Texture&) = delete;
+
+    //linear color of texel (x, y) of [level]
+    inline vec3f texel(int level, int x, int y, TileHint& hint) const;
+
+    vec3f bilinear(int level, float u, float v, TileHint& hint) const
+    {
+        int w = levelWidth(level);
+        int h = levelHeight(level);
+        float x = u * w - 0.5f;
+        float y = v * h - 0.5f;
+        float fx = floorf(x), fy = floorf(y);
+        float tx = x - fx, ty = y - fy;
+
+        //wrap around, x0 and y0 can be -1
+        int x0 = ((int)fx + w) % w, x1 = (x0 + 1) % w;
+        int y0 = ((int)fy + h) % h, y1 = (y0 + 1) % h;
+
+        vec3f top = texel(level, x0, y0, hint) * (1 - tx) + texel(level, x1, y0, hint) * tx;
+        vec3f bottom = texel(level, x0, y1, hint) * (1 - tx) + texel(level, x1, y1, hint) * tx;
+        return top * (1 - ty) + bottom * ty;
+    }
+
+    int width_ = 0, height_ = 0;
+    int numLevels = 0;
+    uint32_t id = 0;
+    TextureCache* cache = NULL;
+
+    //the source image, base tiles are read from the mapping a row segment at a time
+    PNMImage image;
+};
+
+//The tiles of all textures, split into shards by key so that threads looking up different
+//tiles rarely contend. Every shard keeps its own LRU list and an equal part of the budget.
+//A tile that is being loaded is in the cache as a future, threads that need it meanwhile
+//wait for that load instead of loading it again.
+class TextureCache
+{
+public:
+    static const int kNumShards = 16;
+
+    //[budgetBytes] bounds the memory of the resident tiles, at least one tile per shard is kept
+    TextureCache(size_t budgetBytes) : hits(0), misses(0), evictions(0), residentBytes(0), peakBytes(0)
+    {
+        shardBudget = std::max(budgetBytes / kNumShards, sizeof(TextureTile));
+    }
+
+    ~TextureCache()
+    {
+        for (size_t i = 0; i < textures.size(); i++)
+            delete textures[i];
+    }
+
+    //Opens the binary PPM or PGM at [path] as a texture, only its header is read here.
+    //The texture is owned by the cache. returns NULL on failure
+    Texture* addTexture(const char* path)
+    {
+        if (textures.size() >= 4096)
+            return NULL;
+
+        Texture* texture = new Texture();
+        if (!texture->image.open(path) || !texture->image.isBinary() ||
+            texture->image.getWidth() >= (1 << 23) || texture->image.getHeight() >= (1 << 23))
+        {
+            delete texture;
+            return NULL;
+        }
+        texture->image.advise(MappedFile::kAccessRandom);
+
+        int width = texture->image.getWidth(), height = texture->image.getHeight();
+        texture->width_ = width;
+        texture->height_ = height;
+        texture->numLevels = 1;
+        while ((std::max(width, height) >> texture->numLevels) > 0)
+            texture->numLevels++;
+        texture->id = (uint32_t)textures.size();
+        texture->cache = this;
+        textures.push_back(texture);
+        return texture;
+    }
+
+    //tile (tx, ty) of [level] of [texture], loaded if it is not resident
+    TextureTilePtr getTile(const Texture& texture, int level, int tx, int ty)
+    {
+        uint64_t key = texture.tileKey(level, tx, ty);
+        Shard& shard = shards[shardOf(key)];
+
+        std::shared_future<TextureTilePtr> pending;
+        std::unique_ptr<std::promise<TextureTilePtr> > promise;
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            std::unordered_map<uint64_t, Entry>::iterator it = shard.tiles.find(key);
+            if (it != shard.tiles.end())
+            {
+                shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lruPosition);
+                pending = it->second.tile;
+                hits++;
+            }
+            else
+            {
+                promise.reset(new std::promise<TextureTilePtr>());
+                shard.lru.push_front(key);
+                Entry& entry = shard.tiles[key];
+                entry.tile = promise->get_future().share();
+                entry.lruPosition = shard.lru.begin();
+                misses++;
+            }
+        }
+
+        if (pending.valid())
+            return pending.get();
+
+        //a miss, load without holding the shard, coarse tiles look up finer ones
+        TextureTilePtr tile = (level == 0) ? readTile(texture, tx, ty) : filterTile(texture, level, tx, ty);
+        promise->set_value(tile);
+
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.tiles[key].loaded = true;
+        shard.bytes += sizeof(TextureTile);
+        size_t resident = (residentBytes += sizeof(TextureTile));
+        size_t peak = peakBytes.load();
+        while (resident > peak && !peakBytes.compare_exchange_weak(peak, resident)) {}
+
+        //evict from the least recently used end, the tile just loaded and
+        //tiles still loading (which are not counted yet) stay
+        std::list<uint64_t>::iterator it = shard.lru.end();
+        while (shard.bytes > shardBudget && it != shard.lru.begin())
+        {
+            --it;
+            std::unordered_map<uint64_t, Entry>::iterator victim = shard.tiles.find(*it);
+            if (*it == key || !victim->second.loaded)
+                continue;
+
+            shard.tiles.erase(victim);
+            it = shard.lru.erase(it);
+            shard.bytes -= sizeof(TextureTile);
+            residentBytes -= sizeof(TextureTile);
+            evictions++;
+        }
+
+        return tile;
+    }
+
+    std::atomic<uint64_t> hits, misses, evictions;
+    std::atomic<size_t> residentBytes, peakBytes;
+
+private:
+    struct Entry
+    {
+        std::shared_future<TextureTilePtr> tile;
+        std::list<uint64_t>::iterator lruPosition;
+        bool loaded = false;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::list<uint64_t> lru;
+        std::unordered_map<uint64_t, Entry> tiles;
+        size_t bytes = 0;
+    };
+
+    static int shardOf(uint64_t key)
+    {
+        key ^= key >> 29;
+        key *= 0xbf58476d1ce4e5b9ull;
+        return (int)((key >> 32) % kNumShards);
+    }
+
+    //reads a base level tile from the image, one row segment at a time
+    static TextureTilePtr readTile(const Texture& texture, int tx, int ty)
+    {
+        std::shared_ptr<TextureTile> tile = std::make_shared<TextureTile>();
+        //std::min takes references, a copy keeps kSize from needing a definition before C++17
+        const int size = TextureTile::kSize;
+        int x0 = tx * size, y0 = ty * size;
+        int w = std::min(size, texture.width_ - x0);
+        int h = std::min(size, texture.height_ - y0);
+
+        for (int y = 0; y < h; y++)
+            texture.image.readRow8(y0 + y, x0, w, tile->texels + y * TextureTile::kSize);
+        return tile;
+    }
+
+    //Filters tile (tx, ty) of [level] from the up to four tiles below it, each texel is
+    //the linear mean of the 2x2 texels below it (clamped at the edge of odd sized levels)
+    TextureTilePtr filterTile(const Texture& texture, int level, int tx, int ty)
+    {
+        TextureTilePtr children[2][2];
+        for (int j = 0; j < 2; j++)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                int cx = tx * 2 + i, cy = ty * 2 + j;
+                if (cx < texture.tilesX(level - 1) && cy < texture.tilesY(level - 1))
+                    children[j][i] = getTile(texture, level - 1, cx, cy);
+            }
+        }
+
+        std::shared_ptr<TextureTile> tile = std::make_shared<TextureTile>();
+        int pw = texture.levelWidth(level - 1), ph = texture.levelHeight(level - 1);
+        const int size = TextureTile::kSize;
+        int x0 = tx * size, y0 = ty * size;
+        int w = std::min(size, texture.levelWidth(level) - x0);
+        int h = std::min(size, texture.levelHeight(level) - y0);
+        for (int y = 0; y < h; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                float sum[3] = { 0, 0, 0 };
+                for (int dy = 0; dy < 2; dy++)
+                {
+                    for (int dx = 0; dx < 2; dx++)
+                    {
+                        //texel of the level below, relative to the first child tile
+                        int cx = std::min(2 * (x0 + x) + dx, pw - 1) - 2 * x0;
+                        int cy = std::min(2 * (y0 + y) + dy, ph - 1) - 2 * y0;
+                        const TextureTile& child = *children[cy / TextureTile::kSize][cx / TextureTile::kSize];
+                        const RGB8& t = child.texels[(cy % TextureTile::kSize) * TextureTile::kSize + cx % TextureTile::kSize];
+                        sum[0] += srgb8ToLinear(t.r);
+                        sum[1] += srgb8ToLinear(t.g);
+                        sum[2] += srgb8ToLinear(t.b);
+                    }
+                }
+
+                RGB8& out = tile->texels[y * TextureTile::kSize + x];
+                out.r = (uint8_t)(linearToSRGB(sum[0] * 0.25f) * 255 + 0.5f);
+                out.g = (uint8_t)(linearToSRGB(sum[1] * 0.25f) * 255 + 0.5f);
+                out.b = (uint8_t)(linearToSRGB(sum[2] * 0.25f) * 255 + 0.5f);
+            }
+        }
+        return tile;
+    }
+
+    Shard shards[kNumShards];
+    size_t shardBudget;
+    std::vector<Texture*> textures;
+};
+
+inline vec3f Texture::texel(int level, int x, int y, TileHint& hint) const
+{
+    int tx = x / TextureTile::kSize, ty = y / TextureTile::kSize;
+    uint64_t key = tileKey(level, tx, ty);
+    if (key != hint.key)
+    {
+        hint.tile = cache->getTile(*this, level, tx, ty);
+        hint.key = key;
+    }
+
+    const RGB8& t = hint.tile->texels[(y % TextureTile::kSize) * TextureTile::kSize + x % TextureTile::kSize];
+    return vec3f(srgb8ToLinear(t.r), srgb8ToLinear(t.g), srgb8ToLinear(t.b));
+}
+
+#endif /* texture_cache_h */
@@ -0,0 +1,39 @@
+//
+//  triangle.cpp
+//  theraytracer
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#include "geometry.h"
+
+bool Triangle::intersects(const Ray& ray, float& t) const
+{
+    return intersectTriangle(ray, p0, p1, p2, t);
+}
+
+void Triangle::getSurfaceData(const vec3f& hit, vec3f& normal, vec3f& texCoord) const
+{
+    normal = this->normal;
+    triangleBarycentrics(hit, p0, p1, p2, texCoord.x, texCoord.y);
+    texCoord.z = 0;
+}
+
+//the side of a square with twice the area, barycentrics span the triangle in both directions
+float Triangle::texCoordScale() const
+{
+    //length() is the squared length
+    return sqrtf(sqrtf(Vec3Util::cross(p1 - p0, p2 - p0).length()));
+}
+
+//the triangle is its own proxy
+bool Triangle::tessellate(std::vector<vec3f>& positions, std::vector<uint32_t>& indices) const
+{
+    uint32_t first = (uint32_t)positions.size();
+    positions.push_back(p0);
+    positions.push_back(p1);
+    positions.push_back(p2);
+    uint32_t tri[3] = { first, first + 1, first + 2 };
+    indices.insert(indices.end(), tri, tri + 3);
+    return true;
+}
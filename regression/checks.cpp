@@ -0,0 +1,623 @@
+//
+//  checks.cpp
+//  theraytracer
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "random.h"
+#include "sampler.h"
+#include "geometry.h"
+#include "compressed_mesh.h"
+#include "image.h"
+#include "render_engine.h"
+#include "scenes.h"
+#include "checks.h"
+
+std::string temporaryFile(const char* prefix)
+{
+    const char* tmp = getenv("TMPDIR");
+#ifndef _WIN32
+    std::string path = std::string(tmp ? tmp : "/tmp") + "/" + prefix + "XXXXXX";
+    std::vector<char> name(path.begin(), path.end());
+    name.push_back(0);
+    int fd = mkstemp(&name[0]);
+    if (fd < 0)
+        return std::string();
+    close(fd);
+    return std::string(&name[0]);
+#else
+    char name[L_tmpnam];
+    return tmpnam(name) ? std::string(name) : std::string();
+#endif
+}
+
+std::string describe(const char* what, int index)
+{
+    char text[128];
+    snprintf(text, sizeof(text), "%s %d", what, index);
+    return text;
+}
+
+//Random triangles, traced as Triangle objects and as a CompressedMesh, must give the same
+//hits at the same distances up to rounding with the surface data of the same triangle, and
+//shadow rays with a tMax the same visibility. A mesh file with a corrupt child index must
+//not open.
+bool checkCompressedMesh(std::string& detail)
+{
+    const int kTriangles = 300;
+    const int kRays = 20000;
+
+    SampleRng rng(0, 0, 0x3e54);
+    std::vector<float> soup;
+    std::vector<Triangle*> triangles;
+    for (int i = 0; i < kTriangles; i++)
+    {
+        vec3f center(rng.next01() * 20 - 10, rng.next01() * 20 - 10, rng.next01() * 20 - 10);
+        vec3f p[3];
+        for (int k = 0; k < 3; k++)
+        {
+            p[k] = center + vec3f(rng.next01() * 4 - 2, rng.next01() * 4 - 2, rng.next01() * 4 - 2);
+            float xyz[3] = { p[k].x, p[k].y, p[k].z };
+            soup.insert(soup.end(), xyz, xyz + 3);
+        }
+        triangles.push_back(new Triangle(p[0], p[1], p[2]));
+    }
+
+    std::string path = temporaryFile("check_mesh_");
+    CompressedMesh mesh;
+    bool ok = !path.empty() && CompressedMesh::build(&soup[0], kTriangles, path.c_str()) && mesh.open(path.c_str());
+    if (!ok)
+        detail = "cannot build or open the mesh";
+
+    for (int i = 0; ok && i < kRays; i++)
+    {
+        vec3f origin(rng.next01() * 30 - 15, rng.next01() * 30 - 15, rng.next01() * 30 - 15);
+        vec3f target(rng.next01() * 20 - 10, rng.next01() * 20 - 10, rng.next01() * 20 - 10);
+        Ray ray(origin, Vec3Util::normalize(target - origin));
+        //every other ray is a shadow ray ending somewhere along the way
+        bool shadow = i & 1;
+        if (shadow)
+        {
+            ray.type = kRayTypeShadow;
+            ray.tMax = rng.next01() * 30;
+        }
+
+        const Triangle* nearest = NULL;
+        float tNearest = INFINITY;
+        for (size_t k = 0; k < triangles.size(); k++)
+        {
+            float t;
+            if (triangles[k]->intersects(ray, t) && t < tNearest && t < ray.tMax)
+            {
+                nearest = triangles[k];
+                tNearest = t;
+            }
+        }
+
+        float t = INFINITY;
+        uint64_t primitive;
+        bool hit = mesh.intersectPrimitive(ray, t, primitive) && t < ray.tMax;
+        if (hit != (nearest != NULL))
+        {
+            detail = describe(shadow ? "visibility differs for shadow ray" : "hit differs for ray", i);
+            ok = false;
+        }
+        else if (hit && !shadow)
+        {
+            //both run the same arithmetic, but the compiler may fuse multiply-adds differently in
+            //each, a neighbouring triangle would be off by far more
+            vec3f pHit = ray.pos + ray.dir * t;
+            vec3f normal, texCoord, expectedNormal, expectedTexCoord;
+            mesh.getPrimitiveSurfaceData(pHit, primitive, normal, texCoord);
+            nearest->getSurfaceData(pHit, expectedNormal, expectedTexCoord);
+            if (fabsf(t - tNearest) > 1e-5f * tNearest)
+                detail = describe("distance differs for ray", i);
+            else if ((normal - expectedNormal).length() > 1e-8f || fabsf(texCoord.x - expectedTexCoord.x) > 1e-4f ||
+                     fabsf(texCoord.y - expectedTexCoord.y) > 1e-4f)
+                detail = describe("surface data differs for ray", i);
+            ok = detail.empty();
+        }
+    }
+    mesh.close();
+
+    //the root's first child pointing far outside the node array, child[] follows the header and 72 bytes of the node
+    FILE* file = ok ? fopen(path.c_str(), "r+b") : NULL;
+    if (file)
+    {
+        uint32_t child = 0x7fffffff;
+        ok = fseek(file, 64 + 72, SEEK_SET) == 0 && fwrite(&child, sizeof(child), 1, file) == 1;
+        ok = (fclose(file) == 0) && ok;
+        if (ok && mesh.open(path.c_str()))
+        {
+            detail = "a corrupt mesh opens";
+            ok = false;
+        }
+    }
+
+    if (!path.empty())
+        remove(path.c_str());
+    for (size_t k = 0; k < triangles.size(); k++)
+        delete triangles[k];
+    return ok;
+}
+
+//pixels that are not bit-identical, every pixel if the sizes differ
+size_t countDiffering(const Image& a, const Image& b)
+{
+    if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight())
+        return (size_t)std::max(a.getWidth() * a.getHeight(), b.getWidth() * b.getHeight());
+
+    size_t differing = 0;
+    for (int i = 0; i < a.getWidth() * a.getHeight(); i++)
+    {
+        RGB p = a.get(i), q = b.get(i);
+        differing += (p.r != q.r || p.g != q.g || p.b != q.b);
+    }
+    return differing;
+}
+
+//root mean square difference over the channels of two images of the same size
+double rmse(const Image& a, const Image& b)
+{
+    double sum = 0;
+    for (int i = 0; i < a.getWidth() * a.getHeight(); i++)
+    {
+        RGB p = a.get(i), q = b.get(i);
+        sum += (p.r - q.r) * (p.r - q.r) + (p.g - q.g) * (p.g - q.g) + (p.b - q.b) * (p.b - q.b);
+    }
+    return sqrt(sum / (3.0 * a.getWidth() * a.getHeight()));
+}
+
+Options checkOptions(uint32_t width, uint32_t height, IntegratorType integrator, uint32_t samplesPerPixel)
+{
+    Options options;
+    options.width = width;
+    options.height = height;
+    options.fov = 70 * DEG_TO_RAD;
+    options.backgroundColor = vec3f(0);
+    options.maxDepth = 3;
+    options.integrator = integrator;
+    options.samplesPerPixel = samplesPerPixel;
+    return options;
+}
+
+//the pixels of [image] that differ from the frame of [options] as render() traces it
+size_t countDifferingFromRender(const Image& image, const Options& options, const Scene& scene)
+{
+    CropWindow crop = resolveCrop(options);
+    Image reference(crop.x1 - crop.x0, crop.y1 - crop.y0);
+    render(options, scene, crop, reference);
+    return countDiffering(image, reference);
+}
+
+//Polls [done] for up to ten seconds
+template<typename Done>
+bool waitUntil(Done done)
+{
+    for (int i = 0; i < 10000 && !done(); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return done();
+}
+
+//Frames of the engine, whitted and path traced, must be bit-identical to render()
+bool checkEngineMatchesRender(std::string& detail)
+{
+    Scene* scene = new Scene();
+    buildManySpheresScene(*scene, 60);
+    RenderEngine engine(2);
+    RenderEngine::SceneId id = engine.addScene(scene);
+
+    const Options frames[] =
+    {
+        checkOptions(320, 180, kIntegratorWhitted, 1),
+        checkOptions(200, 120, kIntegratorPath, 4),
+    };
+    for (int i = 0; i < 2; i++)
+    {
+        std::shared_ptr<RenderJob> job = engine.submit(id, frames[i]);
+        if (!job || !job->wait())
+        {
+            detail = describe("job did not finish, frame", i);
+            return false;
+        }
+        size_t differing = countDifferingFromRender(job->getImage(), frames[i], *scene);
+        if (differing)
+        {
+            detail = describe("pixels differ from render(), frame", i) + ": " + std::to_string(differing);
+            return false;
+        }
+    }
+    return true;
+}
+
+//On a single worker a preview submitted while a batch job of one long tile runs must finish
+//before it, which takes preemption within the tile, and the preempted batch job must still
+//come out identical to render()
+bool checkPreviewPreemptsBatch(std::string& detail)
+{
+    Scene* scene = new Scene();
+    buildManySpheresScene(*scene, 60);
+    RenderEngine engine(1);
+    RenderEngine::SceneId id = engine.addScene(scene);
+
+    Options batchOptions = checkOptions(RenderEngine::kTileSize, RenderEngine::kTileSize, kIntegratorPath, 512);
+    std::shared_ptr<RenderJob> batch = engine.submit(id, batchOptions);
+    if (!batch || !waitUntil([&]() { return batch->getState() == RenderJob::kStateRunning; }))
+    {
+        detail = "batch job did not start";
+        return false;
+    }
+
+    Options previewOptions = checkOptions(160, 90, kIntegratorWhitted, 1);
+    std::shared_ptr<RenderJob> preview = engine.submit(id, previewOptions, RenderEngine::kPriorityPreview);
+    if (!preview || !preview->wait())
+    {
+        detail = "preview did not finish";
+        return false;
+    }
+    if (batch->getState() == RenderJob::kStateDone)
+    {
+        detail = "batch job finished before the preview";
+        return false;
+    }
+    if (countDifferingFromRender(preview->getImage(), previewOptions, *scene))
+    {
+        detail = "preview differs from render()";
+        return false;
+    }
+
+    if (!batch->wait() || countDifferingFromRender(batch->getImage(), batchOptions, *scene))
+    {
+        detail = "preempted batch job differs from render()";
+        return false;
+    }
+    return true;
+}
+
+//A cancelled job stops, wait() returns false for it. Cancelling a finished job changes nothing,
+//even once its engine is destroyed
+bool checkCancelAndWait(std::string& detail)
+{
+    Scene* scene = new Scene();
+    buildManySpheresScene(*scene, 60);
+    RenderEngine engine(1);
+    RenderEngine::SceneId id = engine.addScene(scene);
+
+    std::shared_ptr<RenderJob> job = engine.submit(id, checkOptions(480, 270, kIntegratorPath, 8));
+    if (!job || !waitUntil([&]() { return job->getProgress() > 0; }))
+    {
+        detail = "job did not start";
+        return false;
+    }
+    job->cancel();
+    if (job->wait() || job->getState() != RenderJob::kStateCancelled || job->getProgress() >= 1)
+    {
+        detail = "cancelled job finished";
+        return false;
+    }
+
+    std::shared_ptr<RenderJob> small = engine.submit(id, checkOptions(64, 64, kIntegratorWhitted, 1));
+    if (!small || !small->wait())
+    {
+        detail = "job after a cancelled one did not finish";
+        return false;
+    }
+    small->cancel();
+    if (small->getState() != RenderJob::kStateDone || !small->wait())
+    {
+        detail = "cancelling a finished job changed it";
+        return false;
+    }
+
+    //jobs outlive the engine that rendered them, what is left of them is cancelled
+    Scene* orphanScene = new Scene();
+    buildManySpheresScene(*orphanScene, 60);
+    RenderEngine* shortLived = new RenderEngine(1);
+    small = shortLived->submit(shortLived->addScene(new Scene()), checkOptions(16, 16, kIntegratorWhitted, 1));
+    bool finished = small && small->wait();
+    std::shared_ptr<RenderJob> orphan = shortLived->submit(shortLived->addScene(orphanScene),
+                                                           checkOptions(480, 270, kIntegratorPath, 8));
+    delete shortLived;
+    if (!finished)
+    {
+        detail = "job of the short lived engine did not finish";
+        return false;
+    }
+    orphan->cancel();
+    small->cancel();
+    if (orphan->wait() || orphan->getState() != RenderJob::kStateCancelled || !small->wait())
+    {
+        detail = "jobs are not finished after their engine is gone";
+        return false;
+    }
+    return true;
+}
+
+//After each of a material edit, a move and a resize, the incremental frame must be
+//bit-identical to a full render of the edited scene, and an edit of nothing traces nothing
+bool checkIncrementalMatchesFull(std::string& detail)
+{
+    Scene* scene = new Scene();
+    buildManySpheresScene(*scene, 60);
+    RenderEngine engine(2);
+    RenderEngine::SceneId id = engine.addScene(scene);
+
+    Options options = checkOptions(320, 180, kIntegratorWhitted, 1);
+    std::shared_ptr<RenderJob> frame = engine.submit(id, options);
+    if (!frame || !frame->wait())
+    {
+        detail = "first frame did not finish";
+        return false;
+    }
+    const uint32_t fullTiles = frame->getNumTiles();
+
+    //the spheres follow the floor, every third is a mirror
+    Sphere* diffuse = (Sphere*)scene->objects[24];
+    Sphere* mirror = (Sphere*)scene->objects[31];
+    for (int edit = 0; edit < 4; edit++)
+    {
+        SceneEdit sceneEdit(*frame);
+        if (edit == 0)
+        {
+            sceneEdit.markMaterialChanged(diffuse);
+            diffuse->albedo = vec3f(0.9f, 0.1f, 0.1f);
+        }
+        else if (edit == 1)
+        {
+            sceneEdit.markChanged(diffuse);
+            diffuse->center = diffuse->center + vec3f(0.5f, 0.8f, -0.6f);
+        }
+        else if (edit == 2)
+        {
+            sceneEdit.markChanged(mirror);
+            mirror->radius *= 1.3f;
+        }
+
+        std::shared_ptr<RenderJob> next = engine.submitIncremental(*frame, sceneEdit);
+        if (!next || !next->wait())
+        {
+            detail = describe("incremental frame did not finish, edit", edit);
+            return false;
+        }
+        if ((edit == 0 && next->getNumTiles() >= fullTiles) || (edit == 3 && next->getNumTiles() != 0))
+        {
+            detail = describe("incremental frame traced too many tiles, edit", edit);
+            return false;
+        }
+
+        std::shared_ptr<RenderJob> full = engine.submit(id, options);
+        if (!full || !full->wait() || countDiffering(next->getImage(), full->getImage()))
+        {
+            detail = describe("incremental frame differs from a full one, edit", edit);
+            return false;
+        }
+        frame = next;
+    }
+    return true;
+}
+
+//Hybrid frames, whose primary visibility is rasterized, must stay within the RMS error
+//--verify-hybrid accepts by default of the ray traced frame, on the default scene and on the
+//many spheres scene with its reflections
+bool checkHybridMatchesTraced(std::string& detail)
+{
+    for (int i = 0; i < 2; i++)
+    {
+        Scene scene;
+        if (i == 0)
+            buildDefaultScene(scene);
+        else
+            buildManySpheresScene(scene, 60);
+
+        Options options = checkOptions(320, 180, kIntegratorWhitted, 1);
+        Image traced(options.width, options.height), hybrid(options.width, options.height);
+        render(options, scene, resolveCrop(options), traced);
+        options.hybrid = true;
+        render(options, scene, resolveCrop(options), hybrid);
+        double error = rmse(traced, hybrid);
+        if (!(error <= 1e-3))
+        {
+            detail = describe("hybrid frame differs from the ray traced one, scene", i) + ": rmse " + std::to_string(error);
+            return false;
+        }
+    }
+    return true;
+}
+
+//scales by [size], rotates about the y and then the x axis and moves to [position]
+Transform placement(const vec3f& size, float yaw, float pitch, const vec3f& position)
+{
+    mat44f scale, y, x;
+    scale[0][0] = size.x;
+    scale[1][1] = size.y;
+    scale[2][2] = size.z;
+    y[0][0] = y[2][2] = cosf(yaw);
+    y[2][0] = sinf(yaw);
+    y[0][2] = -sinf(yaw);
+    x[1][1] = x[2][2] = cosf(pitch);
+    x[1][2] = sinf(pitch);
+    x[2][1] = -sinf(pitch);
+    mat44f m = scale * y * x;
+    m[3][0] = position.x;
+    m[3][1] = position.y;
+    m[3][2] = position.z;
+    return Transform(m);
+}
+
+//Instances of a unit sphere and of a triangle must hit where a sphere and a triangle built in
+//world space do, at the same distances with the same normals, and shadow rays with a tMax must
+//see the same. A frame of the many spheres scene with every sphere an instance must match the
+//plain one up to the odd silhouette pixel.
+bool checkInstance(std::string& detail)
+{
+    const int kRays = 20000;
+
+    Sphere unitSphere(vec3f(0), 1);
+    //tilted, so a non-uniform scale turns its normal
+    Triangle unitTriangle(vec3f(0, 0, 0), vec3f(1, 0, 1), vec3f(0, 1, 0.5f));
+    Transform sphereToWorld = placement(vec3f(2.5f), 0.7f, 0.3f, vec3f(3, -1, 4));
+    Transform triangleToWorld = placement(vec3f(6, 3, 1), -1.1f, 0.5f, vec3f(-2, 1, -3));
+    Instance sphereInstance(&unitSphere, sphereToWorld);
+    Instance triangleInstance(&unitTriangle, triangleToWorld);
+    Sphere sphere(vec3f(3, -1, 4), 2.5f);
+    Triangle triangle(triangleToWorld.point(unitTriangle.p0), triangleToWorld.point(unitTriangle.p1),
+                      triangleToWorld.point(unitTriangle.p2));
+
+    const Object* instances[2] = { &sphereInstance, &triangleInstance };
+    const Object* objects[2] = { &sphere, &triangle };
+    SampleRng rng(0, 0, 0x1257);
+    //rays grazing an edge may go either way once the transform has rounded them
+    int mismatches = 0;
+    for (int i = 0; i < kRays; i++)
+    {
+        int k = i & 1;
+        vec3f origin(rng.next01() * 30 - 15, rng.next01() * 30 - 15, rng.next01() * 30 - 15);
+        //aimed around the object, so about half the rays hit
+        vec3f target = k ? triangle.p0 + (triangle.p1 - triangle.p0) * rng.next01() + (triangle.p2 - triangle.p0) * rng.next01() :
+            vec3f(rng.next01() * 8 - 1, rng.next01() * 8 - 5, rng.next01() * 8);
+        Ray ray(origin, Vec3Util::normalize(target - origin));
+        bool shadow = (i >> 1) & 1;
+        if (shadow)
+        {
+            ray.type = kRayTypeShadow;
+            ray.tMax = rng.next01() * 30;
+        }
+
+        float t = INFINITY, tExpected = INFINITY;
+        bool hit = instances[k]->intersects(ray, t) && t < ray.tMax;
+        bool expected = objects[k]->intersects(ray, tExpected) && tExpected < ray.tMax;
+        if (hit != expected)
+        {
+            mismatches++;
+            continue;
+        }
+        if (!hit || shadow)
+            continue;
+
+        vec3f pHit = ray.pos + ray.dir * t;
+        vec3f normal, texCoord, expectedNormal = objects[k]->getNormal(pHit);
+        instances[k]->getSurfaceData(pHit, normal, texCoord);
+        //lengths are squared, either side of the triangle is fine
+        if (fabsf(t - tExpected) > 1e-4f * tExpected)
+            detail = describe("distance differs for ray", i);
+        else if (std::min((normal - expectedNormal).length(), (normal + expectedNormal).length()) > 1e-6f ||
+                 std::min((instances[k]->getNormal(pHit) - expectedNormal).length(),
+                          (instances[k]->getNormal(pHit) + expectedNormal).length()) > 1e-6f)
+            detail = describe("normal differs for ray", i);
+        if (!detail.empty())
+            return false;
+    }
+    if (mismatches > kRays / 1000)
+    {
+        detail = "hits differ for " + std::to_string(mismatches) + " rays";
+        return false;
+    }
+
+    Scene plain, instanced;
+    buildManySpheresScene(plain, 60);
+    buildManySpheresScene(instanced, 60);
+    //the instances do not own their spheres
+    std::vector<Sphere*> units;
+    for (size_t i = 0; i < instanced.objects.size(); i++)
+    {
+        Sphere* s = dynamic_cast<Sphere*>(instanced.objects[i]);
+        if (!s)
+            continue;
+        Sphere* unit = new Sphere(vec3f(0), 1, s->albedo);
+        unit->type = s->type;
+        units.push_back(unit);
+        instanced.objects[i] = new Instance(unit, placement(vec3f(s->radius), i * 0.37f, i * 0.11f, s->center));
+        delete s;
+    }
+    Options options = checkOptions(320, 180, kIntegratorWhitted, 1);
+    Image a(options.width, options.height), b(options.width, options.height);
+    render(options, plain, resolveCrop(options), a);
+    render(options, instanced, resolveCrop(options), b);
+    double error = rmse(a, b);
+    for (size_t i = 0; i < units.size(); i++)
+        delete units[i];
+    if (!(error < 0.01))
+    {
+        detail = "instanced frame differs from the plain one, rmse " + std::to_string(error);
+        return false;
+    }
+    return true;
+}
+
+//A finished checkpoint must not be resumed by a render with another integrator, sampler,
+//material, light or geometry: each of them traces its frame as if there was none
+bool checkCheckpointBelongsToRender(std::string& detail)
+{
+    std::string path = temporaryFile("checkpoint");
+    if (path.empty())
+    {
+        detail = "no temporary file";
+        return false;
+    }
+    
+    Options options = checkOptions(160, 90, kIntegratorWhitted, 2);
+    Scene scene;
+    buildDefaultScene(scene);
+    Image first(options.width, options.height);
+    options.checkpointPath = path.c_str();
+    render(options, scene, resolveCrop(options), first);
+    
+    StratifiedSampler stratified(options.samplesPerPixel);
+    bool ok = true;
+    for (int edit = 0; edit < 5 && ok; edit++)
+    {
+        Options other = options;
+        Scene otherScene;
+        buildDefaultScene(otherScene);
+        if (edit == 0)
+            other.integrator = kIntegratorPath;
+        else if (edit == 1)
+            other.sampler = &stratified;
+        else if (edit == 2)
+            otherScene.objects[1]->albedo = vec3f(0.9f, 0.2f, 0.2f);
+        else if (edit == 3)
+            otherScene.lights[1]->intensity *= 2;
+        else
+            ((Sphere*)otherScene.objects[1])->center.x += 1;
+        
+        Image image(other.width, other.height);
+        render(other, otherScene, resolveCrop(other), image);
+        other.checkpointPath = NULL;
+        if (!countDiffering(image, first) || countDifferingFromRender(image, other, otherScene))
+        {
+            detail = describe("checkpoint resumed by another render, edit", edit);
+            ok = false;
+        }
+    }
+    remove(path.c_str());
+    return ok;
+}
+
+const std::vector<RegressionCheck>& regressionChecks()
+{
+    static const std::vector<RegressionCheck> checks =
+    {
+        { "compressed-mesh", checkCompressedMesh },
+        { "engine-render", checkEngineMatchesRender },
+        { "engine-preempt", checkPreviewPreemptsBatch },
+        { "engine-cancel", checkCancelAndWait },
+        { "incremental", checkIncrementalMatchesFull },
+        { "instance", checkInstance },
+        { "hybrid", checkHybridMatchesTraced },
+        { "checkpoint", checkCheckpointBelongsToRender },
+    };
+    return checks;
+}
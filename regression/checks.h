@@ -0,0 +1,32 @@
+//
+//  checks.h
+//  theraytracer
+//
+//  Functional checks the regression suite runs next to the reference
+//  scenes: properties of the renderer that an image comparison cannot
+//  see, such as two code paths agreeing exactly
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#ifndef checks_h
+#define checks_h
+
+#include <string>
+#include <vector>
+
+struct RegressionCheck
+{
+    const char* name;
+    //returns false and describes the first mismatch in [detail] if the check fails
+    bool (*run)(std::string& detail);
+};
+
+//every check, in the order they run
+const std::vector<RegressionCheck>& regressionChecks();
+
+//The path of a new empty file in the temporary directory whose name starts with [prefix],
+//unique between concurrent runs. The caller removes it
+std::string temporaryFile(const char* prefix);
+
+#endif /* checks_h */
@@ -0,0 +1,595 @@
+//
+//  main.cpp
+//  theraytracer
+//
+//  Performance and image regression suite. Renders the reference scenes
+//  of scenes.h, each in a process of its own, records wall time, rays
+//  per second and peak resident memory, and compares the finalized image
+//  against a stored reference by PSNR and SSIM. Then it runs the
+//  functional checks of checks.h, also isolated. The results are written
+//  as a JSON report; the exit code is non-zero if a scene falls below the
+//  image thresholds, fails to render or has no reference, if it regressed
+//  in time or memory against a given baseline, or if a check fails.
+//
+//  Copyright © 2017 bajsko. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
+
+#include "math_macros.h"
+#include "image.h"
+#include "tonemap.h"
+#include "render_engine.h"
+#include "scenes.h"
+#include "checks.h"
+
+struct ReferenceScene
+{
+    const char* name;
+    //returns false if the scene cannot be built
+    bool (*build)(Scene& scene);
+    uint32_t width, height;
+    uint32_t samplesPerPixel;
+    IntegratorType integrator;
+    uint32_t maxDepth;
+};
+
+//the file of the large mesh, written once before the scenes render
+std::string largeMeshPath;
+const int kLargeMeshRings = 512;
+const int kLargeMeshSegments = 1024;
+
+bool buildDefault(Scene& scene) { buildDefaultScene(scene); return true; }
+bool buildManySpheres(Scene& scene) { buildManySpheresScene(scene, 500); return true; }
+bool buildManyLights(Scene& scene) { buildManyLightsScene(scene, 32); return true; }
+bool buildLargeMesh(Scene& scene) { return buildMeshScene(scene, largeMeshPath.c_str()); }
+
+const ReferenceScene kScenes[] =
+{
+    { "default", buildDefault, 960, 540, 1, kIntegratorWhitted, 3 },
+    { "many-spheres", buildManySpheres, 640, 360, 1, kIntegratorWhitted, 4 },
+    { "many-lights", buildManyLights, 480, 270, 2, kIntegratorPath, 3 },
+    { "large-mesh", buildLargeMesh, 640, 360, 1, kIntegratorWhitted, 3 },
+};
+
+enum Status
+{
+    kStatusPass,
+    kStatusFail,
+    //there is no reference image, or no baseline when one is given, to compare with
+    kStatusNoReference,
+    //the image passes, but the time or peak memory grew past the baseline
+    kStatusRegressed,
+    //the image was written as the new reference
+    kStatusUpdated,
+    //the scene did not render, the process crashed or the output could not be written
+    kStatusError,
+};
+
+const char* statusName(Status status)
+{
+    switch (status)
+    {
+        case kStatusPass: return "pass";
+        case kStatusFail: return "fail";
+        case kStatusNoReference: return "no-reference";
+        case kStatusRegressed: return "regressed";
+        case kStatusUpdated: return "updated";
+        default: return "error";
+    }
+}
+
+//What rendering one scene measured, plain data so a child process can send it back whole
+struct SceneResult
+{
+    double milliseconds = 0;
+    uint64_t rays = 0;
+    //peak resident set size of the process that rendered the scene
+    uint64_t peakRSSKB = 0;
+    double psnr = 0;
+    double ssim = 0;
+    //what the baseline recorded for the scene, 0 if it has none
+    double baselineMilliseconds = 0;
+    uint64_t baselineRSSKB = 0;
+    Status status = kStatusError;
+};
+
+struct SuiteOptions
+{
+    const char* referenceDir = "regression/references";
+    //an earlier report of this machine, the times and peak memory are checked against it if
+    //not NULL. Wall time says nothing across machines, so no baseline is kept with the sources
+    const char* baselinePath = NULL;
+    //the rendered images are also written here if not NULL
+    const char* outputDir = NULL;
+    bool update = false;
+    //a scene without a reference image or baseline entry passes
+    bool allowMissing = false;
+    uint32_t numThreads = 0;
+    //renders per scene, the fastest counts
+    int repeat = 1;
+    double minPSNR = 40;
+    double minSSIM = 0.98;
+    //how much slower and larger than the baseline a scene may get
+    double maxTimeRatio = 1.5;
+    double maxRSSRatio = 1.25;
+};
+
+//short renders are noisy, a scene may also be this much slower or larger than its baseline
+const double kTimeSlackMilliseconds = 10;
+const uint64_t kRSSSlackKB = 2048;
+
+//PSNR of 8-bit images over all channels, capped at kMaxPSNR for identical images so the
+//report stays valid JSON
+const double kMaxPSNR = 100;
+
+double psnr(const Image8& a, const Image8& b)
+{
+    size_t n = (size_t)a.getWidth() * a.getHeight() * 3;
+    const uint8_t* pa = &a.pixels[0].r;
+    const uint8_t* pb = &b.pixels[0].r;
+    double sumSquares = 0;
+    for (size_t i = 0; i < n; i++)
+        sumSquares += (double)(pa[i] - pb[i]) * (pa[i] - pb[i]);
+    if (sumSquares == 0)
+        return kMaxPSNR;
+    return std::min(kMaxPSNR, 10 * log10(255.0 * 255.0 * n / sumSquares));
+}
+
+//Mean SSIM of the luma of 8-bit images, over 8x8 windows every 4 pixels
+double ssim(const Image8& a, const Image8& b)
+{
+    const int w = a.getWidth(), h = a.getHeight();
+    const int window = 8, step = 4;
+    const double c1 = (0.01 * 255) * (0.01 * 255), c2 = (0.03 * 255) * (0.03 * 255);
+
+    std::vector<double> la((size_t)w * h), lb((size_t)w * h);
+    for (size_t i = 0; i < la.size(); i++)
+    {
+        la[i] = 0.299 * a.pixels[i].r + 0.587 * a.pixels[i].g + 0.114 * a.pixels[i].b;
+        lb[i] = 0.299 * b.pixels[i].r + 0.587 * b.pixels[i].g + 0.114 * b.pixels[i].b;
+    }
+
+    double sum = 0;
+    int count = 0;
+    for (int y = 0; y + window <= h; y += step)
+    {
+        for (int x = 0; x + window <= w; x += step)
+        {
+            double meanA = 0, meanB = 0;
+            for (int j = 0; j < window; j++)
+                for (int i = 0; i < window; i++)
+                {
+                    meanA += la[(size_t)(y + j) * w + x + i];
+                    meanB += lb[(size_t)(y + j) * w + x + i];
+                }
+            meanA /= window * window;
+            meanB /= window * window;
+
+            double varA = 0, varB = 0, cov = 0;
+            for (int j = 0; j < window; j++)
+                for (int i = 0; i < window; i++)
+                {
+                    double da = la[(size_t)(y + j) * w + x + i] - meanA;
+                    double db = lb[(size_t)(y + j) * w + x + i] - meanB;
+                    varA += da * da;
+                    varB += db * db;
+                    cov += da * db;
+                }
+            varA /= window * window - 1;
+            varB /= window * window - 1;
+            cov /= window * window - 1;
+
+            sum += ((2 * meanA * meanB + c1) * (2 * cov + c2)) /
+                   ((meanA * meanA + meanB * meanB + c1) * (varA + varB + c2));
+            count++;
+        }
+    }
+    return count ? sum / count : 1;
+}
+
+uint64_t peakRSSKB()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    //bytes on macOS, kilobytes elsewhere
+    return (uint64_t)usage.ru_maxrss / 1024;
+#else
+    return (uint64_t)usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
+
+//Renders [scene], measures it and checks it against its reference
+SceneResult runScene(const ReferenceScene& ref, const SuiteOptions& suite)
+{
+    SceneResult result;
+
+    Scene scene;
+    if (!ref.build(scene))
+        return result;
+
+    Options options;
+    options.width = ref.width;
+    options.height = ref.height;
+    options.fov = 70 * DEG_TO_RAD;
+    options.backgroundColor = vec3f(0);
+    options.maxDepth = ref.maxDepth;
+    options.samplesPerPixel = ref.samplesPerPixel;
+    options.integrator = ref.integrator;
+    options.numThreads = suite.numThreads;
+
+    CropWindow crop = resolveCrop(options);
+    Image framebuffer(ref.width, ref.height);
+    result.milliseconds = INFINITY;
+    for (int i = 0; i < std::max(1, suite.repeat); i++)
+    {
+        std::atomic<uint64_t> rays(0);
+        options.rayCount = &rays;
+        auto start = std::chrono::steady_clock::now();
+        render(options, scene, crop, framebuffer);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        result.milliseconds = std::min(result.milliseconds, ms);
+        result.rays = rays;
+    }
+    result.peakRSSKB = peakRSSKB();
+
+    Image8 image(ref.width, ref.height);
+    Finalizer finalizer;
+    finalizer.run(framebuffer, image, suite.numThreads);
+
+    if (suite.outputDir)
+    {
+        std::string path = std::string(suite.outputDir) + "/" + ref.name + ".ppm";
+        if (writePPM(path.c_str(), image) != 0)
+            return result;
+    }
+
+    std::string referencePath = std::string(suite.referenceDir) + "/" + ref.name + ".ppm";
+    if (suite.update)
+    {
+        result.status = writePPM(referencePath.c_str(), image) == 0 ? kStatusUpdated : kStatusError;
+        return result;
+    }
+
+    Image* stored = readPPM(referencePath.c_str(), suite.numThreads);
+    if (!stored)
+    {
+        result.status = kStatusNoReference;
+        return result;
+    }
+    if (stored->getWidth() != image.getWidth() || stored->getHeight() != image.getHeight())
+    {
+        //a reference of another size fails every threshold
+        delete stored;
+        result.status = kStatusFail;
+        return result;
+    }
+
+    Image8 reference(stored->getWidth(), stored->getHeight());
+    for (int i = 0; i < stored->getWidth() * stored->getHeight(); i++)
+    {
+        RGB c = stored->get(i);
+        RGB8 p = { (uint8_t)lrintf(c.r * 255), (uint8_t)lrintf(c.g * 255), (uint8_t)lrintf(c.b * 255) };
+        reference.pixels[i] = p;
+    }
+    delete stored;
+
+    result.psnr = psnr(image, reference);
+    result.ssim = ssim(image, reference);
+    result.status = (result.psnr >= suite.minPSNR && result.ssim >= suite.minSSIM) ? kStatusPass : kStatusFail;
+    return result;
+}
+
+//Runs [run] in a child process, which sends back what it returns as plain bytes. returns
+//false if the child crashed or the result did not arrive
+template<typename Result, typename Run>
+bool runIsolated(Run run, Result& result)
+{
+#ifndef _WIN32
+    int fds[2];
+    if (pipe(fds) != 0)
+        return false;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        Result childResult = run();
+        ssize_t written = write(fds[1], &childResult, sizeof(childResult));
+        _exit(written == (ssize_t)sizeof(childResult) ? 0 : 1);
+    }
+    close(fds[1]);
+
+    ssize_t received = 0;
+    while (pid > 0 && received < (ssize_t)sizeof(result))
+    {
+        ssize_t n = read(fds[0], (char*)&result + received, sizeof(result) - received);
+        if (n <= 0)
+            break;
+        received += n;
+    }
+    close(fds[0]);
+
+    int status = 0;
+    if (pid > 0)
+        waitpid(pid, &status, 0);
+    return pid > 0 && received == (ssize_t)sizeof(result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+    result = run();
+    return true;
+#endif
+}
+
+//runScene() in a child process, so that the peak memory is the scene's own and a crash
+//fails only the scene
+SceneResult runSceneIsolated(const ReferenceScene& ref, const SuiteOptions& suite)
+{
+    SceneResult result;
+    if (!runIsolated([&]() { return runScene(ref, suite); }, result))
+        return SceneResult();
+    return result;
+}
+
+//What a check found, plain data for the same reason as SceneResult
+struct CheckResult
+{
+    Status status = kStatusError;
+    char detail[256] = {};
+};
+
+CheckResult runCheckIsolated(const RegressionCheck& check)
+{
+    CheckResult result;
+    bool finished = runIsolated([&]()
+    {
+        CheckResult childResult;
+        std::string detail;
+        childResult.status = check.run(detail) ? kStatusPass : kStatusFail;
+        snprintf(childResult.detail, sizeof(childResult.detail), "%s", detail.c_str());
+        return childResult;
+    }, result);
+    if (!finished)
+    {
+        result = CheckResult();
+        snprintf(result.detail, sizeof(result.detail), "crashed");
+    }
+    return result;
+}
+
+//Writes the file of the large mesh in a child process. The scenes are forked from this one
+//and would start out with the peak memory of building the hierarchy
+bool writeLargeMeshIsolated()
+{
+#ifndef _WIN32
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(writeMeshFile(largeMeshPath.c_str(), kLargeMeshRings, kLargeMeshSegments) ? 0 : 1);
+    
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        return false;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+    return writeMeshFile(largeMeshPath.c_str(), kLargeMeshRings, kLargeMeshSegments);
+#endif
+}
+
+//The time and peak memory of the scene [name] in a report written by an earlier run
+//returns false if there is no report at [path] or it has no such scene
+bool readBaseline(const char* path, const char* name, double& milliseconds, uint64_t& peakRSSKB)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    //writeReport() puts every scene on a line of its own
+    const std::string key = std::string("{\"name\": \"") + name + "\"";
+    const char* msKey = "\"milliseconds\": ";
+    const char* rssKey = "\"peakRSSKB\": ";
+    char line[1024];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file))
+    {
+        const char* entry = strstr(line, key.c_str());
+        const char* ms = entry ? strstr(entry, msKey) : NULL;
+        const char* rss = entry ? strstr(entry, rssKey) : NULL;
+        if (ms && rss)
+        {
+            milliseconds = atof(ms + strlen(msKey));
+            peakRSSKB = strtoull(rss + strlen(rssKey), NULL, 10);
+            found = true;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+bool writeReport(const char* path, const SuiteOptions& suite, const std::vector<const ReferenceScene*>& scenes,
+                 const std::vector<SceneResult>& results, const std::vector<const RegressionCheck*>& checks,
+                 const std::vector<CheckResult>& checkResults, bool pass)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+        return false;
+
+    fprintf(file, "{\n  \"minPSNR\": %g,\n  \"minSSIM\": %g,\n  \"maxTimeRatio\": %g,\n  \"maxRSSRatio\": %g,\n  \"scenes\": [\n",
+            suite.minPSNR, suite.minSSIM, suite.maxTimeRatio, suite.maxRSSRatio);
+    for (size_t i = 0; i < scenes.size(); i++)
+    {
+        const ReferenceScene& ref = *scenes[i];
+        const SceneResult& r = results[i];
+        double raysPerSecond = r.milliseconds > 0 ? r.rays / (r.milliseconds * 1e-3) : 0;
+        fprintf(file, "    {\"name\": \"%s\", \"width\": %u, \"height\": %u, \"spp\": %u, \"integrator\": \"%s\", "
+                "\"milliseconds\": %.3f, \"rays\": %llu, \"raysPerSecond\": %.0f, \"peakRSSKB\": %llu, "
+                "\"baselineMilliseconds\": %.3f, \"baselinePeakRSSKB\": %llu, "
+                "\"psnr\": %.3f, \"ssim\": %.5f, \"status\": \"%s\"}%s\n",
+                ref.name, ref.width, ref.height, ref.samplesPerPixel,
+                ref.integrator == kIntegratorPath ? "path" : "whitted",
+                r.milliseconds, (unsigned long long)r.rays, raysPerSecond, (unsigned long long)r.peakRSSKB,
+                r.baselineMilliseconds, (unsigned long long)r.baselineRSSKB, r.psnr, r.ssim, statusName(r.status), i + 1 < scenes.size() ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"checks\": [\n");
+    for (size_t i = 0; i < checks.size(); i++)
+    {
+        fprintf(file, "    {\"name\": \"%s\", \"status\": \"%s\", \"detail\": \"%s\"}%s\n", checks[i]->name,
+                statusName(checkResults[i].status), checkResults[i].detail, i + 1 < checks.size() ? "," : "");
+    }
+    fprintf(file, "  ],\n  \"pass\": %s\n}\n", pass ? "true" : "false");
+    return fclose(file) == 0;
+}
+
+int main(int argc, const char** argv)
+{
+    //usage: regression [--references dir] [--baseline report.json] [--update] [--allow-missing]
+    //                  [--output dir] [--report report.json] [--scene name]... [--check name]...
+    //                  [--threads n] [--repeat n]
+    //                  [--min-psnr db] [--min-ssim value] [--max-time-ratio r] [--max-rss-ratio r]
+    //--update renders the references instead of checking against them, and writes the report to
+    //the --baseline path if one is given. Time and peak memory are only gated with --baseline:
+    //record one with --update --baseline on a machine, then check later runs on the same machine
+    //against it. An update of some scenes with --scene writes a baseline of only those. A scene
+    //without a reference image, or without a baseline entry when gating, fails unless
+    //--allow-missing is given. The checks of checks.h run after the scenes; naming scenes or
+    //checks runs only the named ones.
+    SuiteOptions suite;
+    const char* reportPath = "regression_report.json";
+    std::vector<std::string> only;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--references" && i + 1 < argc)
+            suite.referenceDir = argv[++i];
+        else if (arg == "--baseline" && i + 1 < argc)
+            suite.baselinePath = argv[++i];
+        else if (arg == "--update")
+            suite.update = true;
+        else if (arg == "--allow-missing")
+            suite.allowMissing = true;
+        else if (arg == "--output" && i + 1 < argc)
+            suite.outputDir = argv[++i];
+        else if (arg == "--report" && i + 1 < argc)
+            reportPath = argv[++i];
+        else if ((arg == "--scene" || arg == "--check") && i + 1 < argc)
+            only.push_back(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            suite.numThreads = atoi(argv[++i]);
+        else if (arg == "--repeat" && i + 1 < argc)
+            suite.repeat = std::max(1, atoi(argv[++i]));
+        else if (arg == "--min-psnr" && i + 1 < argc)
+            suite.minPSNR = atof(argv[++i]);
+        else if (arg == "--min-ssim" && i + 1 < argc)
+            suite.minSSIM = atof(argv[++i]);
+        else if (arg == "--max-time-ratio" && i + 1 < argc)
+            suite.maxTimeRatio = atof(argv[++i]);
+        else if (arg == "--max-rss-ratio" && i + 1 < argc)
+            suite.maxRSSRatio = atof(argv[++i]);
+        else
+        {
+            printf("unknown argument %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    std::vector<const ReferenceScene*> scenes;
+    for (size_t i = 0; i < sizeof(kScenes) / sizeof(kScenes[0]); i++)
+    {
+        if (only.empty() || std::find(only.begin(), only.end(), kScenes[i].name) != only.end())
+            scenes.push_back(&kScenes[i]);
+    }
+    std::vector<const RegressionCheck*> checks;
+    for (size_t i = 0; i < regressionChecks().size(); i++)
+    {
+        const RegressionCheck& check = regressionChecks()[i];
+        if (only.empty() || std::find(only.begin(), only.end(), check.name) != only.end())
+            checks.push_back(&check);
+    }
+    if (scenes.empty() && checks.empty())
+    {
+        printf("no scene or check matches\n");
+        return 2;
+    }
+
+#ifndef _WIN32
+    if (suite.update)
+        mkdir(suite.referenceDir, 0755);
+    if (suite.outputDir)
+        mkdir(suite.outputDir, 0755);
+#endif
+    
+    for (size_t i = 0; i < scenes.size(); i++)
+    {
+        if (scenes[i]->build != buildLargeMesh)
+            continue;
+        largeMeshPath = temporaryFile("regression_large_mesh_");
+        if (largeMeshPath.empty() || !writeLargeMeshIsolated())
+            printf("failed to write the large mesh %s\n", largeMeshPath.c_str());
+    }
+    
+    std::vector<SceneResult> results;
+    bool pass = true;
+    for (size_t i = 0; i < scenes.size(); i++)
+    {
+        SceneResult r = runSceneIsolated(*scenes[i], suite);
+        if (!suite.update && suite.baselinePath && (r.status == kStatusPass || r.status == kStatusNoReference))
+        {
+            if (!readBaseline(suite.baselinePath, scenes[i]->name, r.baselineMilliseconds, r.baselineRSSKB))
+                r.status = kStatusNoReference;
+            else if (r.milliseconds > r.baselineMilliseconds * suite.maxTimeRatio + kTimeSlackMilliseconds ||
+                     r.peakRSSKB > r.baselineRSSKB * suite.maxRSSRatio + kRSSSlackKB)
+                r.status = kStatusRegressed;
+        }
+        results.push_back(r);
+        pass = pass && (r.status == kStatusPass || r.status == kStatusUpdated ||
+                        (r.status == kStatusNoReference && suite.allowMissing));
+        printf("%-14s %10.1f ms %8.2f Mrays/s %8llu KB  psnr %7.2f  ssim %.4f  %s\n", scenes[i]->name, r.milliseconds,
+               r.milliseconds > 0 ? r.rays / (r.milliseconds * 1e3) : 0, (unsigned long long)r.peakRSSKB,
+               r.psnr, r.ssim, statusName(r.status));
+    }
+
+    if (!largeMeshPath.empty())
+        remove(largeMeshPath.c_str());
+    
+    std::vector<CheckResult> checkResults;
+    for (size_t i = 0; i < checks.size(); i++)
+    {
+        CheckResult r = runCheckIsolated(*checks[i]);
+        checkResults.push_back(r);
+        pass = pass && r.status == kStatusPass;
+        printf("%-14s %s%s%s\n", checks[i]->name, statusName(r.status), r.detail[0] ? ": " : "", r.detail);
+    }
+    
+    if (!writeReport(reportPath, suite, scenes, results, checks, checkResults, pass))
+    {
+        printf("failed to write %s\n", reportPath);
+        return 1;
+    }
+    if (suite.update && suite.baselinePath &&
+        !writeReport(suite.baselinePath, suite, scenes, results, checks, checkResults, pass))
+    {
+        printf("failed to write %s\n", suite.baselinePath);
+        return 1;
+    }
+    printf("%s, report in %s\n", pass ? "PASS" : "FAIL", reportPath);
+    return pass ? 0 : 1;
+}